@@ -0,0 +1,43 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+    基准测试共用的计时和结果输出。
+    给人看的表格输出到标准错误；机器可读的结果输出到标准输出，每个结果一行JSON，比如
+        {"bench":"timer","case":"wheel/100000","metric":"adjust","value":12.3,"unit":"ns/op"}
+    每个程序先输出一行运行环境（编译器、是否优化、CPU数量、时间），
+    不同的构建各跑一遍run_all.sh，再用compare.py按bench、case和metric对比两次的结果。
+*/
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline double now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline void bench_meta( const char* bench )
+{
+#ifdef __OPTIMIZE__
+    int optimize = 1;
+#else
+    int optimize = 0;
+#endif
+    char when[32];
+    time_t t = time( NULL );
+    struct tm tm;
+    strftime( when, sizeof( when ), "%Y-%m-%dT%H:%M:%SZ", gmtime_r( &t, &tm ) );
+    printf( "{\"bench\":\"%s\",\"compiler\":\"%s\",\"optimize\":%d,\"cpus\":%ld,\"time\":\"%s\"}\n",
+            bench, __VERSION__, optimize, sysconf( _SC_NPROCESSORS_ONLN ), when );
+}
+
+static inline void bench_result( const char* bench, const char* name, const char* metric, double value, const char* unit )
+{
+    printf( "{\"bench\":\"%s\",\"case\":\"%s\",\"metric\":\"%s\",\"value\":%.6g,\"unit\":\"%s\"}\n",
+            bench, name, metric, value, unit );
+}
+
+#endif
@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+# 对比两次run_all.sh的结果：./compare.py old.jsonl new.jsonl
+# 按bench、case、metric对齐，输出两次的值和变化的百分比。
+# 单位是ns/...的值越小越好，ops/s越大越好，变好的变化前面标+，变差的标-
+import json
+import sys
+
+
+def load(path):
+    meta = {}
+    results = {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith('{'):
+                continue
+            r = json.loads(line)
+            if 'metric' not in r:
+                meta[r['bench']] = r
+                continue
+            results[(r['bench'], r['case'], r['metric'])] = (r['value'], r['unit'])
+    return meta, results
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: compare.py old.jsonl new.jsonl')
+    old_meta, old = load(sys.argv[1])
+    new_meta, new = load(sys.argv[2])
+    for bench in sorted(set(old_meta) & set(new_meta)):
+        o, n = old_meta[bench], new_meta[bench]
+        if (o['compiler'], o['optimize'], o['cpus']) != (n['compiler'], n['optimize'], n['cpus']):
+            print('%s: old %s -O%d %d cpus, new %s -O%d %d cpus' % (bench, o['compiler'], o['optimize'], o['cpus'],
+                                                                    n['compiler'], n['optimize'], n['cpus']))
+    print('%-10s %-24s %-14s %14s %14s %9s' % ('bench', 'case', 'metric', 'old', 'new', 'change'))
+    for key in sorted(set(old) & set(new)):
+        (ov, unit), (nv, _) = old[key], new[key]
+        change = (nv - ov) / ov * 100 if ov else 0.0
+        better = change > 0 if unit.endswith('/s') else change < 0
+        mark = '+' if better else '-' if change else ' '
+        print('%-10s %-24s %-14s %14.6g %14.6g %s%7.1f%%' % (key + (ov, nv, mark, abs(change))))
+    for key in sorted(set(old) ^ set(new)):
+        print('%-10s %-24s %-14s only in %s' % (key + ('old' if key in old else 'new',)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,601 @@
+/*
+    HTTP/1.1压力测试工具，代替test_presure中的webbench。
+    webbench每个客户端fork一个进程，每个请求新建一个连接（HTTP/1.0），只输出每分钟的页面数和每秒的字节数，
+    测不出长连接、流水线和尾延迟。这里每个线程一个epoll，连接一直保持（keep-alive），
+    每个连接上可以同时有多个未完成的请求（流水线），输出吞吐量和延迟的分位数。
+    编译：g++ -O2 -I.. loadgen.cpp ../stats.cpp -o loadgen -pthread
+    运行：./loadgen [-c 连接数] [-t 线程数] [-d 秒数] [-p 流水线深度] [-R 每秒请求数] [-u URL]... [-H 请求头]... ip port
+    例如：./loadgen -c 100 -t 2 -d 10 -p 4 -u /index.html -u /index.html -u /images/image1.jpg 127.0.0.1 12345
+
+    两种模式：
+    1. 不指定-R（闭环）：每个连接上始终保持p个未完成的请求，收到一个应答就发下一个请求，测最大吞吐量。
+       延迟从请求交给socket开始算
+    2. 指定-R（固定速率）：总的请求速率是R，平均分给所有连接，每个请求有一个计划的发送时间。
+       服务器变慢时，闭环的测试工具会跟着少发请求，正好错过了最慢的那段时间（coordinated omission），
+       测出的尾延迟偏低。这里的延迟从计划的发送时间开始算，连接上已经有p个未完成的请求、没能按时发出的请求，
+       等待的时间也计入延迟。另外输出从实际发送开始算的延迟（服务时间）作为对比
+
+    每个请求随机选一个-u给出的URL，同一个URL给多次就是加大它的比例，默认只请求/index.html。
+    -H给出的字段（比如"Accept-Encoding: gzip"）加在每个请求中。
+    延迟用stats.h中的对数线性直方图记录，相对误差不超过1/16，分位数取桶的上界。结果输出到标准错误。
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <string>
+#include <vector>
+#include <queue>
+#include <functional>
+#include "stats.h"
+
+#define MAX_DEPTH 64                // 流水线深度的上限
+#define READ_BUFFER_SIZE 16384      // 每个连接的读缓冲区，要放得下应答头部，响应体只计数不保存
+#define MAX_EVENT_NUMBER 256
+#define RETRY_NS 10000000L          // 连接失败后10毫秒再重新连接
+
+// 响应体还剩多少字节，或者下面两种状态
+#define READING_HEAD -1             // 还在读应答头部
+#define UNTIL_CLOSE -2              // 没有Content-Length，响应体直到连接关闭
+
+static sockaddr_in server_addr;
+static int conn_count = 64;
+static int thread_count = 2;
+static int depth = 1;
+static double duration_s = 10;
+static double rate = 0;             // 每秒请求数，0表示闭环
+static long interval_ns = 0;        // 固定速率模式下每个连接上两个请求之间的时间
+static std::vector< std::string > requests;     // 每个URL的完整请求
+static std::string extra_headers;               // -H给出的字段
+static long start_ns, end_ns;
+
+// 已经发出还没收到应答的请求
+struct pending {
+    long intended_ns;   // 计划的发送时间，闭环时等于sent_ns
+    long sent_ns;
+};
+
+struct client_conn {
+    int index;
+    int fd;
+    bool connected;
+    unsigned int events;        // 当前在epoll中注册的事件
+    std::string out;            // 还没写进socket的请求
+    size_t out_off;
+    pending queue[MAX_DEPTH];   // 按发送的顺序排列，应答也按这个顺序到达
+    int q_head;
+    int q_count;
+    long next_ns;               // 固定速率模式下下一个请求计划的发送时间
+    bool in_heap;               // 是否在定时的堆中，wake_ns是堆中那一项的时间，时间不同的项已经作废
+    long wake_ns;
+    char* in;                   // 收到的还没解析的数据
+    int in_len;
+    long body_left;             // 当前应答的响应体还剩的字节数，或者READING_HEAD、UNTIL_CLOSE
+    int status;
+    bool close_after;           // 当前应答带Connection: close，收完之后重新连接
+};
+
+struct worker {
+    pthread_t tid;
+    int epfd;
+    int timerfd;
+    long armed_ns;
+    unsigned long seed;
+    client_conn* conns;
+    int nconns;
+    // 按时间排序的（时间，连接）：固定速率模式下请求的发送时间，以及连接失败后重新连接的时间
+    std::priority_queue< std::pair<long, int>, std::vector< std::pair<long, int> >, std::greater< std::pair<long, int> > > heap;
+
+    unsigned long completed;
+    unsigned long bytes;
+    unsigned long statuses[6];  // 1xx到5xx，0是无法解析的状态码
+    unsigned long errors;       // 连接失败、连接被重置、应答格式错误
+    unsigned long lost;         // 因为连接断开没有收到应答的请求
+    unsigned long reconnects;   // 服务器要求关闭连接后重新连接的次数
+    long max_latency;
+    long max_service;
+    latency_histogram latency;  // 从计划的发送时间算起
+    latency_histogram service;  // 从实际的发送时间算起
+};
+
+static void conn_open( worker* w, client_conn* c, long now );
+
+static void usage( const char* prog )
+{
+    fprintf( stderr, "usage: %s [-c connections] [-t threads] [-d seconds] [-p pipeline_depth] [-R requests_per_second] [-u url]... [-H header]... ip port\n", prog );
+    fprintf( stderr, "  -c  connections kept open, default 64\n" );
+    fprintf( stderr, "  -t  threads, each with its own epoll and share of the connections, default 2\n" );
+    fprintf( stderr, "  -d  test duration in seconds, default 10\n" );
+    fprintf( stderr, "  -p  requests outstanding per connection, up to %d, default 1\n", MAX_DEPTH );
+    fprintf( stderr, "  -R  send at this fixed total rate and measure latency from the scheduled send time, default as fast as possible\n" );
+    fprintf( stderr, "  -u  URL to request, may be repeated (repeats raise its share), default /index.html\n" );
+    fprintf( stderr, "  -H  header line added to every request, may be repeated\n" );
+    exit( 1 );
+}
+
+static unsigned long next_random( worker* w )
+{
+    // xorshift64
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 7;
+    w->seed ^= w->seed << 17;
+    return w->seed;
+}
+
+static void set_events( worker* w, client_conn* c, unsigned int events )
+{
+    if( c->events == events ) return;
+    epoll_event event;
+    event.events = events;
+    event.data.ptr = c;
+    epoll_ctl( w->epfd, EPOLL_CTL_MOD, c->fd, &event );
+    c->events = events;
+}
+
+// 在时间t处理这个连接
+static void schedule( worker* w, client_conn* c, long t )
+{
+    if( c->in_heap && c->wake_ns <= t ) return;
+    w->heap.push( std::make_pair( t, c->index ) );
+    c->in_heap = true;
+    c->wake_ns = t;
+}
+
+// 关闭连接，error表示连接是出错断开的。还没收到应答的请求丢掉了
+static void conn_close( worker* w, client_conn* c, bool error )
+{
+    epoll_ctl( w->epfd, EPOLL_CTL_DEL, c->fd, NULL );
+    close( c->fd );
+    c->fd = -1;
+    c->connected = false;
+    if( error ) w->errors++;
+    w->lost += c->q_count;
+    c->q_head = c->q_count = 0;
+    c->out.clear();
+    c->out_off = 0;
+    c->in_len = 0;
+    c->body_left = READING_HEAD;
+    c->close_after = false;
+}
+
+// 连接断开之后马上重新连接，连接没有建立起来时等一会儿再试
+static void conn_reopen( worker* w, client_conn* c, bool error, long now )
+{
+    bool was_connected = c->connected;
+    conn_close( w, c, error );
+    if( was_connected ) {
+        conn_open( w, c, now );
+    } else {
+        schedule( w, c, now + RETRY_NS );
+    }
+}
+
+static void conn_open( worker* w, client_conn* c, long now )
+{
+    c->fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( c->fd < 0 ) {
+        w->errors++;
+        schedule( w, c, now + RETRY_NS );
+        return;
+    }
+    int on = 1;
+    setsockopt( c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+    // 连接建立时socket变成可写，在EPOLLOUT中检查连接的结果
+    epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.ptr = c;
+    epoll_ctl( w->epfd, EPOLL_CTL_ADD, c->fd, &event );
+    c->events = EPOLLOUT;
+    if( connect( c->fd, ( sockaddr* )&server_addr, sizeof( server_addr ) ) < 0 && errno != EINPROGRESS ) {
+        conn_reopen( w, c, true, now );
+    }
+}
+
+// 把请求写进socket，写不完时等EPOLLOUT。出错时返回false
+static bool flush_out( worker* w, client_conn* c )
+{
+    while( c->out_off < c->out.size() ) {
+        ssize_t n = write( c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off );
+        if( n > 0 ) {
+            c->out_off += n;
+        } else if( n < 0 && errno == EINTR ) {
+            continue;
+        } else if( n < 0 && errno == EAGAIN ) {
+            set_events( w, c, EPOLLIN | EPOLLOUT );
+            return true;
+        } else {
+            return false;
+        }
+    }
+    c->out.clear();
+    c->out_off = 0;
+    set_events( w, c, EPOLLIN );
+    return true;
+}
+
+static void issue( worker* w, client_conn* c, long intended, long now )
+{
+    c->out += requests[ next_random( w ) % requests.size() ];
+    pending& p = c->queue[ ( c->q_head + c->q_count ) % MAX_DEPTH ];
+    p.intended_ns = intended;
+    p.sent_ns = now;
+    c->q_count++;
+}
+
+// 发出该发的请求：闭环时补满p个，固定速率时发出计划时间已经到了的请求
+static void issue_due( worker* w, client_conn* c, long now )
+{
+    if( rate == 0 ) {
+        while( c->q_count < depth ) issue( w, c, now, now );
+    } else {
+        while( c->q_count < depth && c->next_ns <= now ) {
+            issue( w, c, c->next_ns, now );
+            c->next_ns += interval_ns;
+        }
+        // 有p个未完成的请求时不再定时，收到应答后再发，晚发的时间计入延迟
+        if( c->q_count < depth ) schedule( w, c, c->next_ns );
+    }
+    if( !c->out.empty() && !flush_out( w, c ) ) {
+        conn_reopen( w, c, true, now );
+    }
+}
+
+static void complete_response( worker* w, client_conn* c, long now )
+{
+    const pending& p = c->queue[ c->q_head ];
+    c->q_head = ( c->q_head + 1 ) % MAX_DEPTH;
+    c->q_count--;
+    // 测试结束之后收到的应答不计入结果
+    if( now > end_ns ) return;
+    long latency = now - p.intended_ns;
+    long service = now - p.sent_ns;
+    w->latency.record( latency );
+    w->service.record( service );
+    if( latency > w->max_latency ) w->max_latency = latency;
+    if( service > w->max_service ) w->max_service = service;
+    w->completed++;
+    w->statuses[ c->status >= 100 && c->status < 600 ? c->status / 100 : 0 ]++;
+}
+
+// 解析应答头部，得到状态码、响应体的长度和是否要关闭连接
+static bool parse_head( client_conn* c, char* head, char* end )
+{
+    *end = '\0';
+    if( strncmp( head, "HTTP/1.", 7 ) != 0 || strlen( head ) < 12 ) return false;
+    c->status = atoi( head + 9 );
+    long length = UNTIL_CLOSE;
+    c->close_after = strncmp( head, "HTTP/1.0", 8 ) == 0;
+    char* line = strstr( head, "\r\n" );
+    while( line ) {
+        line += 2;
+        if( strncasecmp( line, "Content-Length:", 15 ) == 0 ) {
+            length = strtol( line + 15, NULL, 10 );
+        } else if( strncasecmp( line, "Connection:", 11 ) == 0 ) {
+            char* eol = strstr( line, "\r\n" );
+            if( eol ) *eol = '\0';
+            c->close_after = strcasestr( line + 11, "close" ) != NULL;
+            if( eol ) *eol = '\r';
+        }
+        line = strstr( line, "\r\n" );
+    }
+    // 这些状态码没有响应体
+    if( c->status < 200 || c->status == 204 || c->status == 304 ) length = 0;
+    if( length == UNTIL_CLOSE ) c->close_after = true;
+    c->body_left = length;
+    return true;
+}
+
+// 处理读缓冲区中完整的应答。返回-1表示应答格式错误，1表示服务器要关闭连接，0表示继续
+static int parse_responses( worker* w, client_conn* c, long now )
+{
+    int pos = 0;
+    int ret = 0;
+    while( ret == 0 ) {
+        if( c->body_left == READING_HEAD ) {
+            char* head = c->in + pos;
+            char* end = ( char* )memmem( head, c->in_len - pos, "\r\n\r\n", 4 );
+            if( !end ) {
+                // 头部放不下整个读缓冲区
+                if( pos == 0 && c->in_len == READ_BUFFER_SIZE ) ret = -1;
+                break;
+            }
+            // 没有发请求却收到了应答
+            if( c->q_count == 0 || !parse_head( c, head, end ) ) {
+                ret = -1;
+                break;
+            }
+            pos = end + 4 - c->in;
+        }
+        long avail = c->in_len - pos;
+        if( c->body_left == UNTIL_CLOSE ) {
+            pos += avail;
+            break;
+        }
+        long take = c->body_left < avail ? c->body_left : avail;
+        pos += take;
+        c->body_left -= take;
+        if( c->body_left > 0 ) break;
+        complete_response( w, c, now );
+        c->body_left = READING_HEAD;
+        if( c->close_after ) ret = 1;
+    }
+    memmove( c->in, c->in + pos, c->in_len - pos );
+    c->in_len -= pos;
+    return ret;
+}
+
+static void conn_read( worker* w, client_conn* c, long now )
+{
+    while( true ) {
+        ssize_t n = read( c->fd, c->in + c->in_len, READ_BUFFER_SIZE - c->in_len );
+        if( n > 0 ) {
+            w->bytes += n;
+            c->in_len += n;
+            int ret = parse_responses( w, c, now );
+            if( ret < 0 ) {
+                conn_reopen( w, c, true, now );
+                return;
+            }
+            if( ret > 0 ) {
+                w->reconnects++;
+                conn_reopen( w, c, false, now );
+                return;
+            }
+        } else if( n == 0 ) {
+            // 响应体直到连接关闭的应答到这里才算收完
+            if( c->body_left == UNTIL_CLOSE ) {
+                complete_response( w, c, now );
+                w->reconnects++;
+                conn_reopen( w, c, false, now );
+            } else {
+                // 没有未完成的请求时，是服务器关闭了空闲的连接
+                conn_reopen( w, c, c->q_count > 0 || c->body_left != READING_HEAD, now );
+            }
+            return;
+        } else if( errno == EINTR ) {
+            continue;
+        } else if( errno == EAGAIN ) {
+            break;
+        } else {
+            conn_reopen( w, c, true, now );
+            return;
+        }
+    }
+    issue_due( w, c, now );
+}
+
+static void handle_event( worker* w, client_conn* c, unsigned int events, long now )
+{
+    if( !c->connected ) {
+        int err = 0;
+        socklen_t len = sizeof( err );
+        getsockopt( c->fd, SOL_SOCKET, SO_ERROR, &err, &len );
+        if( err != 0 ) {
+            conn_reopen( w, c, true, now );
+            return;
+        }
+        c->connected = true;
+        set_events( w, c, EPOLLIN );
+        issue_due( w, c, now );
+        return;
+    }
+    if( events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) ) {
+        conn_read( w, c, now );
+    }
+    // conn_read可能已经关闭并重新打开了连接，新的socket还在连接中，不能用旧的EPOLLOUT去掉它等待连接完成的EPOLLOUT
+    if( c->fd >= 0 && c->connected && ( events & EPOLLOUT ) && !flush_out( w, c ) ) {
+        conn_reopen( w, c, true, now );
+    }
+}
+
+static void* worker_run( void* arg )
+{
+    worker* w = ( worker* )arg;
+    long now = monotonic_ns();
+    for( int i = 0; i < w->nconns; i++ ) {
+        conn_open( w, &w->conns[i], now );
+    }
+    epoll_event events[MAX_EVENT_NUMBER];
+    while( true ) {
+        now = monotonic_ns();
+        if( now >= end_ns ) break;
+        while( !w->heap.empty() && w->heap.top().first <= now ) {
+            std::pair<long, int> top = w->heap.top();
+            w->heap.pop();
+            client_conn* c = &w->conns[top.second];
+            if( !c->in_heap || c->wake_ns != top.first ) continue;
+            c->in_heap = false;
+            if( c->fd < 0 ) {
+                conn_open( w, c, now );
+            } else if( c->connected ) {
+                issue_due( w, c, now );
+            }
+        }
+        // timerfd的精度是纳秒，epoll_wait的超时只有毫秒
+        long next = end_ns;
+        if( !w->heap.empty() && w->heap.top().first < next ) next = w->heap.top().first;
+        if( next != w->armed_ns ) {
+            itimerspec its;
+            memset( &its, 0, sizeof( its ) );
+            its.it_value.tv_sec = next / 1000000000L;
+            its.it_value.tv_nsec = next % 1000000000L;
+            timerfd_settime( w->timerfd, TFD_TIMER_ABSTIME, &its, NULL );
+            w->armed_ns = next;
+        }
+        int number = epoll_wait( w->epfd, events, MAX_EVENT_NUMBER, -1 );
+        if( number < 0 && errno != EINTR ) {
+            perror( "epoll_wait" );
+            break;
+        }
+        now = monotonic_ns();
+        for( int i = 0; i < number; i++ ) {
+            client_conn* c = ( client_conn* )events[i].data.ptr;
+            if( !c ) {
+                unsigned long expirations;
+                if( read( w->timerfd, &expirations, sizeof( expirations ) ) < 0 ) {}
+                w->armed_ns = -1;
+                continue;
+            }
+            // 同一批事件中前面的事件可能已经关闭了这个连接
+            if( c->fd >= 0 ) handle_event( w, c, events[i].events, now );
+        }
+    }
+    return NULL;
+}
+
+static void print_latency( const char* name, const histogram_sum& h, long max )
+{
+    fprintf( stderr, "%-10s %10.3f", name, h.count ? h.sum / 1e6 / h.count : 0 );
+    static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+    for( size_t i = 0; i < sizeof( qs ) / sizeof( qs[0] ); i++ ) {
+        // 桶的上界可能比实际的最大值还大
+        double q = histogram_quantile( h, qs[i] ) * 1e9;
+        fprintf( stderr, " %10.3f", ( q < max ? q : max ) / 1e6 );
+    }
+    fprintf( stderr, " %10.3f\n", max / 1e6 );
+}
+
+int main( int argc, char* argv[] )
+{
+    int opt;
+    while( ( opt = getopt( argc, argv, "c:t:d:p:R:u:H:" ) ) != -1 ) {
+        switch( opt ) {
+            case 'c': conn_count = atoi( optarg ); break;
+            case 't': thread_count = atoi( optarg ); break;
+            case 'd': duration_s = atof( optarg ); break;
+            case 'p': depth = atoi( optarg ); break;
+            case 'R': rate = atof( optarg ); break;
+            case 'u':
+                if( optarg[0] != '/' ) usage( argv[0] );
+                requests.push_back( optarg );
+                break;
+            case 'H':
+                extra_headers += optarg;
+                extra_headers += "\r\n";
+                break;
+            default: usage( argv[0] );
+        }
+    }
+    if( argc - optind != 2 || conn_count <= 0 || thread_count <= 0 || duration_s <= 0
+        || depth <= 0 || depth > MAX_DEPTH || rate < 0 ) {
+        usage( argv[0] );
+    }
+    if( thread_count > conn_count ) thread_count = conn_count;
+    memset( &server_addr, 0, sizeof( server_addr ) );
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons( atoi( argv[optind + 1] ) );
+    if( inet_pton( AF_INET, argv[optind], &server_addr.sin_addr ) != 1 ) usage( argv[0] );
+
+    // URL换成完整的请求，服务器只有看到Connection: keep-alive才保持连接
+    if( requests.empty() ) requests.push_back( "/index.html" );
+    for( size_t i = 0; i < requests.size(); i++ ) {
+        requests[i] = "GET " + requests[i] + " HTTP/1.1\r\nHost: " + argv[optind] + ":" + argv[optind + 1] + "\r\nConnection: keep-alive\r\n" + extra_headers + "\r\n";
+    }
+
+    start_ns = monotonic_ns();
+    end_ns = start_ns + (long)( duration_s * 1e9 );
+    if( rate > 0 ) interval_ns = (long)( 1e9 * conn_count / rate );
+    if( rate > 0 && interval_ns == 0 ) usage( argv[0] );
+
+    worker* workers = new worker[thread_count];
+    client_conn* conns = new client_conn[conn_count];
+    for( int i = 0; i < conn_count; i++ ) {
+        client_conn* c = &conns[i];
+        c->fd = -1;
+        c->connected = false;
+        c->out_off = 0;
+        c->q_head = c->q_count = 0;
+        // 各个连接的发送时间错开，不要所有连接同时发请求
+        c->next_ns = start_ns + interval_ns / conn_count * i;
+        c->in_heap = false;
+        c->in = new char[READ_BUFFER_SIZE];
+        c->in_len = 0;
+        c->body_left = READING_HEAD;
+        c->close_after = false;
+    }
+    int first = 0;
+    for( int i = 0; i < thread_count; i++ ) {
+        worker* w = &workers[i];
+        w->epfd = epoll_create1( EPOLL_CLOEXEC );
+        w->timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl( w->epfd, EPOLL_CTL_ADD, w->timerfd, &event );
+        w->armed_ns = -1;
+        w->seed = 0x9e3779b97f4a7c15UL * ( i + 1 );
+        w->conns = conns + first;
+        w->nconns = conn_count / thread_count + ( i < conn_count % thread_count ? 1 : 0 );
+        for( int j = 0; j < w->nconns; j++ ) w->conns[j].index = j;
+        first += w->nconns;
+        w->completed = w->bytes = w->errors = w->lost = w->reconnects = 0;
+        memset( w->statuses, 0, sizeof( w->statuses ) );
+        w->max_latency = w->max_service = 0;
+        pthread_create( &w->tid, NULL, worker_run, w );
+    }
+
+    unsigned long completed = 0, bytes = 0, errors = 0, lost = 0, reconnects = 0, in_flight = 0;
+    unsigned long statuses[6] = { 0 };
+    long max_latency = 0, max_service = 0;
+    // 两个直方图之和将近10KB，不放在栈上
+    std::vector< histogram_sum > hists( 2 );
+    memset( &hists[0], 0, sizeof( histogram_sum ) * hists.size() );
+    for( int i = 0; i < thread_count; i++ ) {
+        worker* w = &workers[i];
+        pthread_join( w->tid, NULL );
+        completed += w->completed;
+        bytes += w->bytes;
+        errors += w->errors;
+        lost += w->lost;
+        reconnects += w->reconnects;
+        for( int j = 0; j < 6; j++ ) statuses[j] += w->statuses[j];
+        if( w->max_latency > max_latency ) max_latency = w->max_latency;
+        if( w->max_service > max_service ) max_service = w->max_service;
+        w->latency.merge( hists[0].counts, &hists[0].count, &hists[0].sum );
+        w->service.merge( hists[1].counts, &hists[1].count, &hists[1].sum );
+        for( int j = 0; j < w->nconns; j++ ) {
+            in_flight += w->conns[j].q_count;
+            if( w->conns[j].fd >= 0 ) close( w->conns[j].fd );
+        }
+        close( w->epfd );
+        close( w->timerfd );
+    }
+    double elapsed = ( end_ns - start_ns ) / 1e9;
+
+    fprintf( stderr, "%s:%s, %d threads, %d connections, pipeline depth %d, %.1f s, ",
+             argv[optind], argv[optind + 1], thread_count, conn_count, depth, elapsed );
+    if( rate > 0 ) {
+        fprintf( stderr, "fixed rate %.0f req/s\n", rate );
+    } else {
+        fprintf( stderr, "closed loop\n" );
+    }
+    fprintf( stderr, "requests   %lu (%.1f req/s), %.2f MB read (%.2f MB/s)\n",
+             completed, completed / elapsed, bytes / 1e6, bytes / 1e6 / elapsed );
+    fprintf( stderr, "status     2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, other %lu\n",
+             statuses[2], statuses[3], statuses[4], statuses[5], statuses[0] + statuses[1] );
+    fprintf( stderr, "errors     %lu, lost requests %lu, reconnects %lu, in flight at end %lu\n",
+             errors, lost, reconnects, in_flight );
+    fprintf( stderr, "%-10s %10s %10s %10s %10s %10s %10s\n", "latency", "mean(ms)", "p50", "p90", "p99", "p99.9", "max" );
+    if( rate > 0 ) {
+        print_latency( "corrected", hists[0], max_latency );
+        print_latency( "service", hists[1], max_service );
+    } else {
+        print_latency( "response", hists[1], max_service );
+    }
+
+    for( int i = 0; i < conn_count; i++ ) {
+        delete[] conns[i].in;
+    }
+    delete[] conns;
+    delete[] workers;
+    return 0;
+}
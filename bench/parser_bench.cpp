@@ -0,0 +1,195 @@
+/*
+    HTTP解析器基准测试：比较逐字节扫描和SSE2、AVX2向量化扫描的解析速度。
+    编译：g++ -O2 -I.. parser_bench.cpp ../http_conn.cpp ../simd_scan.cpp ../file_cache.cpp ../buffer_pool.cpp ../http_response.cpp ../gzip.cpp ../stat_cache.cpp ../stats.cpp ../log.cpp -o parser_bench -pthread -lz
+    运行：./parser_bench [-n 请求数量] [请求文件...]，默认1000000个请求，
+          请求文件默认是抓包得到的../baowen.txt和corpus目录中的几个请求：
+          minimal（curl那样只有几个字段）、conditional（浏览器的长请求，带Cookie，304应答）、range（206应答）
+
+    请求文件中的换行统一换成\r\n，请求行中的URL换成/index.html，文件末尾的空行作为请求的结束。
+    1. scan：只用scan2把请求切分成行，测量扫描本身的速度
+    2. parse：把请求交给http_conn::handle_request，经过完整的解析、查缓存和生成应答，
+       然后假装应答已经发送出去，测量每个请求的处理时间。元数据缓存、文件缓存和gzip缓存是打开的（和服务器的默认设置一样），
+       除了第一个请求之外都会命中，不会有文件系统的系统调用
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+#include "http_conn.h"
+#include "simd_scan.h"
+#include "bench.h"
+
+extern const char* doc_root;
+
+// 读入请求文件，换行换成\r\n，URL换成/index.html
+static std::string load_request( const char* path )
+{
+    FILE* fp = fopen( path, "r" );
+    if( !fp ) {
+        perror( path );
+        exit( 1 );
+    }
+    std::string req;
+    char line[8192];
+    bool first = true;
+    while( fgets( line, sizeof( line ), fp ) ) {
+        size_t len = strcspn( line, "\r\n" );
+        line[len] = '\0';
+        if( first ) {
+            // GET / HTTP/1.1 -> GET /index.html HTTP/1.1
+            char* url = strchr( line, ' ' );
+            char* version = url ? strchr( url + 1, ' ' ) : NULL;
+            if( version ) {
+                req.append( line, url - line );
+                req += " /index.html";
+                req += version;
+            } else {
+                req += line;
+            }
+            first = false;
+        } else {
+            req += line;
+        }
+        req += "\r\n";
+        if( len == 0 ) break;
+    }
+    fclose( fp );
+    if( req.size() < 4 || req.compare( req.size() - 4, 4, "\r\n\r\n" ) != 0 ) {
+        req += "\r\n";
+    }
+    return req;
+}
+
+// 返回每个请求的纳秒数
+static double bench_scan( scan2_fn scan, const std::string& req, long count, long* lines )
+{
+    const char* begin = req.data();
+    const char* end = begin + req.size();
+    long n = 0;
+    double start = now_ns();
+    for( long i = 0; i < count; i++ ) {
+        const char* p = begin;
+        while( ( p = scan( p, end, '\r', '\n' ) ) < end ) {
+            n++;
+            p += 2;
+        }
+        __asm__ __volatile__( "" : : "r"( p ) : "memory" );
+    }
+    double elapsed = now_ns() - start;
+    *lines = n;
+    return elapsed / count;
+}
+
+// 返回每个请求的纳秒数，status是第一个应答的状态码
+static double bench_parse( scan2_fn scan, const std::string& req, long count, int sockfd, long* responses, int* status )
+{
+    scan2 = scan;
+    http_conn* conn = new http_conn;
+    sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    conn->init( sockfd, addr, -1 );
+
+    long n = 0;
+    double start = now_ns();
+    for( long i = 0; i < count; i++ ) {
+        if( !conn->append_read( req.data(), req.size() ) ) {
+            fprintf( stderr, "request does not fit in the read buffer\n" );
+            exit( 1 );
+        }
+        if( conn->handle_request() == http_conn::NO_REQUEST ) {
+            continue;
+        }
+        // 假装应答已经全部发送出去
+        const struct iovec* iov = conn->write_iov();
+        if( n == 0 ) *status = atoi( (const char*)iov[0].iov_base + 9 );
+        int bytes = 0;
+        for( int j = 0; j < conn->write_iov_count(); j++ ) {
+            bytes += iov[j].iov_len;
+        }
+        conn->advance_write( bytes );
+        if( !conn->finish_write() ) {
+            fprintf( stderr, "connection closed after request %ld\n", i );
+            exit( 1 );
+        }
+        n++;
+    }
+    double elapsed = now_ns() - start;
+    delete conn;
+    *responses = n;
+    return elapsed / count;
+}
+
+int main( int argc, char* argv[] )
+{
+    long count = 1000000;
+    int opt;
+    while( ( opt = getopt( argc, argv, "n:" ) ) != -1 ) {
+        if( opt != 'n' ) {
+            fprintf( stderr, "usage: %s [-n requests] [request_file...]\n", argv[0] );
+            return 1;
+        }
+        count = atol( optarg );
+    }
+    std::vector< const char* > paths( argv + optind, argv + argc );
+    if( paths.empty() ) {
+        paths.push_back( "../baowen.txt" );
+        paths.push_back( "corpus/minimal.txt" );
+        paths.push_back( "corpus/conditional.txt" );
+        paths.push_back( "corpus/range.txt" );
+    }
+
+    http_conn::m_file_cache = new file_cache( 64 << 20 );
+    http_conn::m_gzip_cache = new file_cache( 16 << 20 );
+    http_conn::m_stat_cache = new stat_cache( doc_root, 3600, 4096 );
+    int sockfd = socket( AF_INET, SOCK_STREAM, 0 );
+
+    struct impl {
+        const char* name;
+        scan2_fn fn;
+    } impls[] = {
+        { "scalar", scan2_scalar },
+        { "sse2", scan2_sse2_impl },
+        { "avx2", scan2_avx2_impl },
+    };
+
+    bench_meta( "parser" );
+    fprintf( stderr, "%ld requests per case, default %s\n", count, scan2_name );
+    fprintf( stderr, "%-12s %6s %6s %8s %14s %14s %14s\n", "request", "bytes", "status", "impl", "scan(ns/req)", "scan(GB/s)", "parse(ns/req)" );
+    for( size_t k = 0; k < paths.size(); k++ ) {
+        std::string req = load_request( paths[k] );
+        // 用文件名（去掉扩展名）作为case的名字
+        std::string file = paths[k];
+        std::string base = basename( &file[0] );
+        base = base.substr( 0, base.rfind( '.' ) );
+        for( size_t i = 0; i < sizeof( impls ) / sizeof( impls[0] ); i++ ) {
+            if( !impls[i].fn ) {
+                fprintf( stderr, "%-12s %6zu %6s %8s %14s\n", base.c_str(), req.size(), "", impls[i].name, "unsupported" );
+                continue;
+            }
+            long lines, responses;
+            int status = 0;
+            double scan = bench_scan( impls[i].fn, req, count, &lines );
+            double parse = bench_parse( impls[i].fn, req, count, sockfd, &responses, &status );
+            if( responses != count ) {
+                fprintf( stderr, "%s: only %ld of %ld requests answered\n", impls[i].name, responses, count );
+            }
+            fprintf( stderr, "%-12s %6zu %6d %8s %14.1f %14.2f %14.1f\n", base.c_str(), req.size(), status, impls[i].name, scan, req.size() / scan, parse );
+            std::string name = base + "/" + impls[i].name;
+            bench_result( "parser", name.c_str(), "scan", scan, "ns/req" );
+            bench_result( "parser", name.c_str(), "parse", parse, "ns/req" );
+        }
+    }
+
+    delete http_conn::m_file_cache;
+    http_conn::m_file_cache = NULL;
+    delete http_conn::m_gzip_cache;
+    http_conn::m_gzip_cache = NULL;
+    delete http_conn::m_stat_cache;
+    http_conn::m_stat_cache = NULL;
+    return 0;
+}
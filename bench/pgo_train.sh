@@ -0,0 +1,40 @@
+#!/bin/sh
+# PGO的训练：用loadgen驱动插桩（-fprofile-generate）的服务器，服务器收到SIGTERM正常退出时写出profile。
+# 由CMake的pgo目标调用，一般不需要直接运行。
+# 用法：./pgo_train.sh 插桩的webserver loadgen 网站根目录 [每一轮的秒数，默认3]，端口由PGO_PORT指定，默认12399
+#
+# 每一轮启动一次服务器，覆盖生产环境中常见的路径：
+#   1. 长连接，大部分请求命中缓存的index.html（gzip变体）和图片，少量404和/__stats
+#   2. 同样的请求混合，流水线深度8，工作窃取模式的线程池
+#   3. Range请求（206）和条件请求（304）
+set -e
+server=$1
+loadgen=$2
+root=$3
+seconds=${4:-3}
+port=${PGO_PORT:-12399}
+
+if [ ! -x "$server" ] || [ ! -x "$loadgen" ] || [ ! -d "$root" ]; then
+    echo "usage: $0 webserver loadgen doc_root [seconds]" >&2
+    exit 1
+fi
+
+mix="-u /index.html -u /index.html -u /index.html -u /index.html -u /index.html -u /index.html
+     -u /images/image1.jpg -u /images/image1.jpg -u /nothere.html -u /__stats"
+
+# $1是服务器的参数，之后是loadgen的参数
+round() {
+    server_args=$1
+    shift
+    "$server" -d "$root" -l warn $server_args $port &
+    pid=$!
+    sleep 0.5
+    "$loadgen" -d "$seconds" "$@" 127.0.0.1 $port || { kill -TERM $pid; exit 1; }
+    kill -TERM $pid
+    wait $pid
+}
+
+round "" -c 64 -t 2 $mix -H "Accept-Encoding: gzip, deflate"
+round "-w" -c 32 -t 2 -p 8 $mix -H "Accept-Encoding: gzip, deflate"
+round "" -c 16 -t 1 -p 4 -u /index.html -u /images/image1.jpg -H "Range: bytes=0-99"
+round "" -c 16 -t 1 -p 4 -u /index.html -H "If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT"
@@ -0,0 +1,242 @@
+/*
+    任务队列基准测试：比较原来的 std::list + 互斥锁 + 信号量 的线程池、无锁环形队列 + futex 的线程池，
+    以及工作窃取模式的线程池。
+    编译：g++ -O2 -I.. queue_bench.cpp ../stats.cpp ../log.cpp -o queue_bench -pthread
+    运行：./queue_bench [任务数量] [生产者数量]，默认2000000个任务、4个生产者（相当于4个reactor）
+
+    1. 吞吐量：生产者线程不停地append空任务（队列满时让出CPU后重试），工作线程数量分别为1、2、4、8、16、32、64，
+       测量从开始append到所有任务都被处理完的时间，输出每秒处理的任务数。
+       任务本身只把一个原子计数器加一，所以测到的几乎全是入队、出队和唤醒的开销。
+    2. 交接延迟：队列中一次只有一个任务，append之前记下时间，工作线程开始处理时记录延迟，处理完再append下一个。
+       工作线程每次都已经空闲（自旋完进入睡眠），测到的是从append到空闲的工作线程被唤醒、取到任务的时间，
+       也就是reactor把一个请求交给线程池的延迟
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <list>
+#include <atomic>
+#include <string.h>
+#include "locker.h"
+#include "threadpool.h"
+#include "stats.h"
+#include "bench.h"
+
+#define HANDOFF_ROUNDS 20000
+
+static std::atomic<long> done(0);
+
+struct task {
+    void process() { done.fetch_add(1, std::memory_order_relaxed); }
+};
+
+// 测量交接延迟的任务，同一时间只有一个工作线程在记录延迟
+struct stamped_task {
+    long sent_ns;
+    std::atomic<bool> finished;
+    latency_histogram* hist;
+    void process() {
+        hist->record( monotonic_ns() - sent_ns );
+        finished.store( true, std::memory_order_release );
+    }
+};
+
+// 原来的线程池实现，只增加了析构时让工作线程退出的逻辑
+template<typename T>
+class list_threadpool {
+public:
+    list_threadpool( int thread_num, int max_requests ) : m_thread_number( thread_num ), m_max_requests( max_requests ), m_stop( false ) {
+        m_threads = new pthread_t[thread_num];
+        for( int i = 0; i < thread_num; i++ ) {
+            pthread_create( m_threads + i, NULL, worker, this );
+        }
+    }
+    ~list_threadpool() {
+        m_stop = true;
+        for( int i = 0; i < m_thread_number; i++ ) {
+            m_queuestat.post();
+        }
+        for( int i = 0; i < m_thread_number; i++ ) {
+            pthread_join( m_threads[i], NULL );
+        }
+        delete [] m_threads;
+    }
+    bool append( T* request ) {
+        m_queuelocker.lock();
+        if( (int)m_workqueue.size() > m_max_requests ) {
+            m_queuelocker.unlock();
+            return false;
+        }
+        m_workqueue.push_back( request );
+        m_queuelocker.unlock();
+        m_queuestat.post();
+        return true;
+    }
+
+private:
+    static void* worker( void* arg ) {
+        ( (list_threadpool*)arg )->run();
+        return NULL;
+    }
+    void run() {
+        while( !m_stop ) {
+            m_queuestat.wait();
+            m_queuelocker.lock();
+            if( m_workqueue.empty() ) {
+                m_queuelocker.unlock();
+                continue;
+            }
+            T* request = m_workqueue.front();
+            m_workqueue.pop_front();
+            m_queuelocker.unlock();
+            if( !request ) continue;
+            request->process();
+        }
+    }
+
+    int m_thread_number;
+    pthread_t* m_threads;
+    int m_max_requests;
+    std::list< T* > m_workqueue;
+    locker m_queuelocker;
+    sem m_queuestat;
+    std::atomic<bool> m_stop;
+};
+
+// 工作窃取模式的线程池，生产者不指定hint，任务轮流分配给各个工作线程
+template<typename T>
+class stealing_threadpool : public threadpool<T> {
+public:
+    stealing_threadpool( int thread_num, int max_requests ) : threadpool<T>( thread_num, max_requests, true ) {}
+};
+
+template<typename Pool>
+struct producer_arg {
+    Pool* pool;
+    long count;
+};
+
+static task the_task;
+
+template<typename Pool>
+static void* producer( void* arg )
+{
+    producer_arg<Pool>* a = (producer_arg<Pool>*)arg;
+    for( long i = 0; i < a->count; i++ ) {
+        while( !a->pool->append( &the_task ) ) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// 返回每秒处理的任务数
+template<typename Pool>
+static double run( int workers, int producers, long tasks )
+{
+    done = 0;
+    Pool* pool = new Pool( workers, 10000 );
+    pthread_t* tids = new pthread_t[producers];
+    producer_arg<Pool>* args = new producer_arg<Pool>[producers];
+
+    double start = now_ns();
+    for( int i = 0; i < producers; i++ ) {
+        args[i].pool = pool;
+        args[i].count = tasks / producers;
+        pthread_create( tids + i, NULL, producer<Pool>, args + i );
+    }
+    for( int i = 0; i < producers; i++ ) {
+        pthread_join( tids[i], NULL );
+    }
+    long total = tasks / producers * producers;
+    while( done.load( std::memory_order_relaxed ) < total ) {
+        sched_yield();
+    }
+    double elapsed = now_ns() - start;
+
+    delete pool;
+    delete [] tids;
+    delete [] args;
+    return total / ( elapsed / 1e9 );
+}
+
+// 交接延迟的直方图加到sum上
+template<typename Pool>
+static void handoff( int workers, histogram_sum* sum )
+{
+    Pool* pool = new Pool( workers, 10000 );
+    latency_histogram* hist = new latency_histogram;
+    stamped_task t;
+    t.hist = hist;
+    for( long i = 0; i < HANDOFF_ROUNDS; i++ ) {
+        t.finished.store( false, std::memory_order_relaxed );
+        t.sent_ns = monotonic_ns();
+        while( !pool->append( &t ) ) {
+            sched_yield();
+        }
+        while( !t.finished.load( std::memory_order_acquire ) ) {
+            sched_yield();
+        }
+    }
+    memset( sum, 0, sizeof( *sum ) );
+    hist->merge( sum->counts, &sum->count, &sum->sum );
+    delete pool;
+    delete hist;
+}
+
+template<typename Pool>
+static void print_handoff( const char* impl, int workers )
+{
+    histogram_sum* sum = new histogram_sum;
+    handoff<Pool>( workers, sum );
+    double mean = sum->count ? (double)sum->sum / sum->count : 0;
+    double p50 = histogram_quantile( *sum, 0.5 ) * 1e9;
+    double p99 = histogram_quantile( *sum, 0.99 ) * 1e9;
+    double p999 = histogram_quantile( *sum, 0.999 ) * 1e9;
+    fprintf( stderr, "%8s %8d %12.0f %12.0f %12.0f %12.0f\n", impl, workers, mean, p50, p99, p999 );
+    char name[64];
+    snprintf( name, sizeof( name ), "%s/%d", impl, workers );
+    bench_result( "queue", name, "handoff_mean", mean, "ns" );
+    bench_result( "queue", name, "handoff_p50", p50, "ns" );
+    bench_result( "queue", name, "handoff_p99", p99, "ns" );
+    bench_result( "queue", name, "handoff_p99.9", p999, "ns" );
+    delete sum;
+}
+
+int main( int argc, char* argv[] )
+{
+    long tasks = argc > 1 ? atol( argv[1] ) : 2000000;
+    int producers = argc > 2 ? atoi( argv[2] ) : 4;
+    static const int worker_counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+    bench_meta( "queue" );
+    fprintf( stderr, "%d producers, %ld tasks, %ld cpus\n", producers, tasks, sysconf( _SC_NPROCESSORS_ONLN ) );
+    fprintf( stderr, "%8s %16s %16s %16s\n", "workers", "list(ops/s)", "mpmc(ops/s)", "steal(ops/s)" );
+    for( size_t i = 0; i < sizeof( worker_counts ) / sizeof( worker_counts[0] ); i++ ) {
+        int w = worker_counts[i];
+        double l = run< list_threadpool<task> >( w, producers, tasks );
+        double m = run< threadpool<task> >( w, producers, tasks );
+        double s = run< stealing_threadpool<task> >( w, producers, tasks );
+        fprintf( stderr, "%8d %16.0f %16.0f %16.0f\n", w, l, m, s );
+        char name[3][32];
+        snprintf( name[0], sizeof( name[0] ), "list/%d", w );
+        snprintf( name[1], sizeof( name[1] ), "mpmc/%d", w );
+        snprintf( name[2], sizeof( name[2] ), "steal/%d", w );
+        bench_result( "queue", name[0], "throughput", l, "ops/s" );
+        bench_result( "queue", name[1], "throughput", m, "ops/s" );
+        bench_result( "queue", name[2], "throughput", s, "ops/s" );
+    }
+
+    fprintf( stderr, "\nhandoff latency, %d rounds\n", HANDOFF_ROUNDS );
+    fprintf( stderr, "%8s %8s %12s %12s %12s %12s\n", "impl", "workers", "mean(ns)", "p50(ns)", "p99(ns)", "p99.9(ns)" );
+    static const int handoff_workers[] = { 1, 4 };
+    for( size_t i = 0; i < sizeof( handoff_workers ) / sizeof( handoff_workers[0] ); i++ ) {
+        int w = handoff_workers[i];
+        print_handoff< list_threadpool<stamped_task> >( "list", w );
+        print_handoff< threadpool<stamped_task> >( "mpmc", w );
+        print_handoff< stealing_threadpool<stamped_task> >( "steal", w );
+    }
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+    应答头部基准测试：比较原来每个字段一次vsnprintf的add_response和现在预先生成的头部模板。
+    编译：g++ -O2 -I.. response_bench.cpp ../http_response.cpp -o response_bench
+    运行：./response_bench [次数]，默认每种情况10000000次
+
+    printf/200、printf/404 : 原来的add_status_line、add_headers（add_content_length、add_content_type、add_linger、
+                             add_blank_line）和add_content，每个字段一次vsnprintf
+    template/200           : write_response_head加上结束头部的空行，也就是add_headers
+    canned/404             : 启动时生成好的完整错误应答，只查表，不复制
+    file/200、file/206     : 文件应答完整的头部，和add_file_headers一样：模板、Content-Range（206）、
+                             Accept-Ranges、ETag、Last-Modified和空行，加上按扩展名查MIME类型
+    头部写到同一块缓冲区中，测到的是生成头部本身的开销。
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "http_response.h"
+#include "bench.h"
+
+#define WRITE_BUFFER_SIZE 1024
+#define ACCEPT_RANGES_BYTES "Accept-Ranges: bytes\r\n"
+
+static char write_buf[WRITE_BUFFER_SIZE];
+static int write_idx;
+
+// 原来的add_response
+static bool add_response( const char* format, ... )
+{
+    if( write_idx >= WRITE_BUFFER_SIZE ) {
+        return false;
+    }
+    va_list arg_list;
+    va_start( arg_list, format );
+    int len = vsnprintf( write_buf + write_idx, WRITE_BUFFER_SIZE - 1 - write_idx, format, arg_list );
+    va_end( arg_list );
+    if( len >= ( WRITE_BUFFER_SIZE - 1 - write_idx ) ) return false;
+    write_idx += len;
+    return true;
+}
+
+// 原来的add_status_line和add_headers
+static void printf_head( int status, const char* title, int content_len, bool linger )
+{
+    add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
+    add_response( "Content-Length: %d\r\n", content_len );
+    add_response( "Content-Type: %s\r\n", "text/html" );
+    add_response( "Connection: %s\r\n", linger ? "keep-alive" : "close" );
+    add_response( "%s", "\r\n" );
+}
+
+static void add_field( const char* field, int len )
+{
+    memcpy( write_buf + write_idx, field, len );
+    write_idx += len;
+}
+
+static const char* error_404_form = "The requested file was not found on this server.\n";
+
+static void case_printf_200( const struct stat& )
+{
+    printf_head( 200, "OK", 554, true );
+}
+
+static void case_printf_404( const struct stat& )
+{
+    printf_head( 404, "Not Found", strlen( error_404_form ), true );
+    add_response( "%s", error_404_form );
+}
+
+static void case_template_200( const struct stat& )
+{
+    write_idx += write_response_head( write_buf, WRITE_BUFFER_SIZE, 200, 554, true );
+    add_field( "\r\n", 2 );
+}
+
+static void case_canned_404( const struct stat& )
+{
+    int len;
+    const char* r = canned_response( 404, true, &len );
+    // 只引用，不复制
+    __asm__ __volatile__( "" : : "r"( r ) : "memory" );
+    write_idx += len;
+}
+
+// add_file_headers，first小于0时是200应答
+static void file_head( const struct stat& st, long first, long last )
+{
+    char line[ETAG_SIZE + HTTP_DATE_LEN + 32];
+    const char* mime = mime_type( "/images/image1.jpg" );
+    int status = first < 0 ? 200 : 206;
+    unsigned long len = first < 0 ? st.st_size : last - first + 1;
+    write_idx += write_response_head( write_buf, WRITE_BUFFER_SIZE, status, len, true, mime );
+    if( first >= 0 ) {
+        write_idx += write_content_range( write_buf + write_idx, first, last, st.st_size );
+    }
+    add_field( ACCEPT_RANGES_BYTES, sizeof( ACCEPT_RANGES_BYTES ) - 1 );
+
+    char etag[ETAG_SIZE];
+    int etag_len = make_etag( st, false, etag );
+    memcpy( line, "ETag: ", 6 );
+    memcpy( line + 6, etag, etag_len );
+    memcpy( line + 6 + etag_len, "\r\n", 2 );
+    add_field( line, 6 + etag_len + 2 );
+
+    memcpy( line, "Last-Modified: ", 15 );
+    int n = 15 + format_http_date( st.st_mtime, line + 15 );
+    memcpy( line + n, "\r\n", 2 );
+    add_field( line, n + 2 );
+    add_field( "\r\n", 2 );
+}
+
+static void case_file_200( const struct stat& st )
+{
+    file_head( st, -1, -1 );
+}
+
+static void case_file_206( const struct stat& st )
+{
+    file_head( st, 0, 99 );
+}
+
+// 返回每次的纳秒数，bytes是生成的头部的长度
+static double run( void (*fn)( const struct stat& ), const struct stat& st, long count, int* bytes )
+{
+    double start = now_ns();
+    for( long i = 0; i < count; i++ ) {
+        write_idx = 0;
+        fn( st );
+        __asm__ __volatile__( "" : : "r"( write_buf ) : "memory" );
+    }
+    double elapsed = now_ns() - start;
+    *bytes = write_idx;
+    return elapsed / count;
+}
+
+int main( int argc, char* argv[] )
+{
+    long count = argc > 1 ? atol( argv[1] ) : 10000000;
+
+    // 固定的文件信息，ETag和Last-Modified每次的结果一样
+    struct stat st;
+    memset( &st, 0, sizeof( st ) );
+    st.st_ino = 1234567;
+    st.st_size = 173169;
+    st.st_mtime = 1700000000;
+
+    struct bench_case {
+        const char* name;
+        void (*fn)( const struct stat& );
+    } cases[] = {
+        { "printf/200", case_printf_200 },
+        { "printf/404", case_printf_404 },
+        { "template/200", case_template_200 },
+        { "canned/404", case_canned_404 },
+        { "file/200", case_file_200 },
+        { "file/206", case_file_206 },
+    };
+
+    bench_meta( "response" );
+    fprintf( stderr, "%ld iterations per case\n", count );
+    fprintf( stderr, "%-14s %8s %12s\n", "case", "bytes", "ns/op" );
+    for( size_t i = 0; i < sizeof( cases ) / sizeof( cases[0] ); i++ ) {
+        int bytes;
+        double ns = run( cases[i].fn, st, count, &bytes );
+        fprintf( stderr, "%-14s %8d %12.1f\n", cases[i].name, bytes, ns );
+        bench_result( "response", cases[i].name, "build", ns, "ns/op" );
+    }
+    return 0;
+}
@@ -0,0 +1,16 @@
+#!/bin/sh
+# 用固定的参数运行所有基准测试。机器可读的结果（每行一个JSON，见bench.h）输出到标准输出，表格输出到标准错误
+# 用法：./run_all.sh [基准测试程序所在的目录，默认是当前目录] [结果文件，默认是标准输出]
+# 同一台机器上两个构建的结果用compare.py对比：./compare.py old.jsonl new.jsonl
+set -e
+dir=$(cd "${1:-.}" && pwd)
+if [ -n "$2" ]; then
+    exec > "$2"
+fi
+# parser_bench默认的请求文件是相对于bench目录的路径
+cd "$(dirname "$0")"
+
+"$dir/parser_bench" -n 1000000
+"$dir/timer_bench" 1000 10000 100000
+"$dir/queue_bench" 2000000 4
+"$dir/response_bench" 10000000
@@ -0,0 +1,175 @@
+/*
+    定时器基准测试：比较升序链表 sort_timer_lst 和分层时间轮 time_wheel。
+    编译：g++ -O2 -I.. timer_bench.cpp ../http_conn.cpp ../simd_scan.cpp ../file_cache.cpp ../buffer_pool.cpp ../http_response.cpp ../gzip.cpp ../stat_cache.cpp ../stats.cpp ../log.cpp -o timer_bench -pthread -lz
+    运行：./timer_bench [定时器数量...]，默认分别测试 10000、100000、1000000 个定时器
+
+    对每种规模，先放入N个定时器（超时时间在15秒内随机分布，模拟空闲的长连接），然后测量：
+    add    : 再添加一个超时时间为 now+15 的定时器（新连接）
+    adjust : 把一个已有的定时器延长到 now+15（连接上有数据可读，每个请求都会发生）
+    del    : 删除一个定时器（连接关闭）
+    tick   : 让时间前进到所有定时器都到期，平均到每个定时器的开销
+    链表在大规模下每次操作都是O(n)，所以只测量少量操作再取平均值。
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include "http_conn.h"
+#include "time_wheel.h"
+#include "bench.h"
+
+static const time_t IDLE = 15;         // 链表使用秒
+static const time_t IDLE_MS = 15000;   // 时间轮使用毫秒
+
+// 所有定时器都指向同一个没有打开的连接，到期时close_conn什么也不做
+static http_conn dummy;
+
+struct result {
+    double add, adjust, del, tick;
+};
+
+// 时间轮到期的回调，什么也不做
+static void expire_nothing( http_conn*, void* )
+{
+}
+
+static result bench_list( int n, time_t now )
+{
+    result r;
+    sort_timer_lst lst;
+    std::vector< util_timer* > timers( n );
+
+    // 按超时时间从大到小插入，每次都插到链表头，避免预先构造就花掉O(n^2)的时间。
+    // 超时时间相同的定时器会被插到后面，所以先用严格递减的值插入，再原地改成实际的超时时间（仍然有序）
+    for( int i = n - 1; i >= 0; --i ) {
+        util_timer* t = new util_timer;
+        t->expire = i;
+        t->user_data = &dummy;
+        timers[i] = t;
+        lst.add_timer( t );
+    }
+    for( int i = 0; i < n; ++i ) {
+        timers[i]->expire = now + (time_t)( (long long)IDLE * i / n );
+    }
+
+    int ops = n >= 1000000 ? 100 : ( n >= 100000 ? 1000 : 10000 );
+
+    std::vector< util_timer* > added( ops );
+    double start = now_ns();
+    for( int i = 0; i < ops; ++i ) {
+        util_timer* t = new util_timer;
+        t->expire = now + IDLE;
+        t->user_data = &dummy;
+        added[i] = t;
+        lst.add_timer( t );
+    }
+    r.add = ( now_ns() - start ) / ops;
+
+    start = now_ns();
+    for( int i = 0; i < ops; ++i ) {
+        util_timer* t = timers[ rand() % n ];
+        t->expire = now + IDLE;
+        lst.adjust_timer( t );
+    }
+    r.adjust = ( now_ns() - start ) / ops;
+
+    start = now_ns();
+    for( int i = 0; i < ops; ++i ) {
+        lst.del_timer( added[i] );
+    }
+    r.del = ( now_ns() - start ) / ops;
+
+    // sort_timer_lst::tick() 使用系统时间，把所有定时器的超时时间改成已经过去的时间再tick
+    for( int i = 0; i < n; ++i ) {
+        timers[i]->expire = 0;
+    }
+    start = now_ns();
+    lst.tick();
+    r.tick = ( now_ns() - start ) / n;
+    return r;
+}
+
+static result bench_wheel( int n, time_t now )
+{
+    result r;
+    now = now * 1000;
+    time_wheel wheel( now );
+    std::vector< util_timer* > timers( n );
+
+    for( int i = 0; i < n; ++i ) {
+        util_timer* t = wheel.create_timer();
+        t->expire = now + rand() % IDLE_MS;
+        t->user_data = &dummy;
+        timers[i] = t;
+        wheel.add_timer( t );
+    }
+
+    int ops = 100000;
+
+    std::vector< util_timer* > added( ops );
+    double start = now_ns();
+    for( int i = 0; i < ops; ++i ) {
+        util_timer* t = wheel.create_timer();
+        t->expire = now + IDLE_MS;
+        t->user_data = &dummy;
+        added[i] = t;
+        wheel.add_timer( t );
+    }
+    r.add = ( now_ns() - start ) / ops;
+
+    start = now_ns();
+    for( int i = 0; i < ops; ++i ) {
+        util_timer* t = timers[ rand() % n ];
+        t->expire = now + IDLE_MS;
+        wheel.adjust_timer( t );
+    }
+    r.adjust = ( now_ns() - start ) / ops;
+
+    start = now_ns();
+    for( int i = 0; i < ops; ++i ) {
+        wheel.del_timer( added[i] );
+    }
+    r.del = ( now_ns() - start ) / ops;
+
+    start = now_ns();
+    wheel.tick( now + IDLE_MS, expire_nothing, NULL );
+    r.tick = ( now_ns() - start ) / n;
+    return r;
+}
+
+static void print_result( const char* impl, int n, const result& r )
+{
+    fprintf( stderr, "%-8s %10d %12.1f %12.1f %12.1f %12.1f\n", impl, n, r.add, r.adjust, r.del, r.tick );
+    char name[64];
+    snprintf( name, sizeof( name ), "%s/%d", impl, n );
+    bench_result( "timer", name, "add", r.add, "ns/op" );
+    bench_result( "timer", name, "adjust", r.adjust, "ns/op" );
+    bench_result( "timer", name, "del", r.del, "ns/op" );
+    bench_result( "timer", name, "tick", r.tick, "ns/timer" );
+}
+
+int main( int argc, char* argv[] )
+{
+    std::vector< int > sizes;
+    for( int i = 1; i < argc; ++i ) {
+        sizes.push_back( atoi( argv[i] ) );
+    }
+    if( sizes.empty() ) {
+        sizes.push_back( 10000 );
+        sizes.push_back( 100000 );
+        sizes.push_back( 1000000 );
+    }
+
+    srand( 1 );
+    time_t now = time( NULL );
+    bench_meta( "timer" );
+    fprintf( stderr, "%-8s %10s %12s %12s %12s %12s\n", "impl", "timers", "add(ns)", "adjust(ns)", "del(ns)", "tick(ns)" );
+    for( size_t i = 0; i < sizes.size(); ++i ) {
+        int n = sizes[i];
+        result l = bench_list( n, now );
+        print_result( "list", n, l );
+        result w = bench_wheel( n, now );
+        print_result( "wheel", n, w );
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include "buffer_pool.h"
+#include <stdlib.h>
+
+buffer_pool::buffer_pool( int max_free, long max_free_bytes ) : m_allocs( 0 ), m_reuses( 0 ), m_in_use( 0 )
+{
+    // 大的缓冲区按字节数限制，至少缓存一个
+    for( int i = 0; i < CLASSES; i++ ) {
+        long by_bytes = max_free_bytes >> ( MIN_SHIFT + i );
+        m_max_free[i] = by_bytes < max_free ? ( by_bytes > 0 ? (int)by_bytes : 1 ) : max_free;
+    }
+}
+
+buffer_pool::~buffer_pool()
+{
+    for( int i = 0; i < CLASSES; i++ ) {
+        for( size_t j = 0; j < m_free[i].bufs.size(); j++ ) {
+            ::free( m_free[i].bufs[j] );
+        }
+    }
+}
+
+// size所在的级别，超过最大级别时返回-1
+int buffer_pool::size_class( int size )
+{
+    int cls = 0;
+    while( cls < CLASSES && ( MIN_SIZE << cls ) < size ) {
+        cls++;
+    }
+    return cls < CLASSES ? cls : -1;
+}
+
+char* buffer_pool::alloc( int size, int* real_size )
+{
+    int cls = size_class( size );
+    if( cls < 0 ) {
+        return NULL;
+    }
+    *real_size = MIN_SIZE << cls;
+    m_allocs.fetch_add( 1, std::memory_order_relaxed );
+    m_in_use.fetch_add( *real_size, std::memory_order_relaxed );
+
+    char* buf = NULL;
+    free_list& fl = m_free[cls];
+    fl.lock.lock();
+    if( !fl.bufs.empty() ) {
+        buf = fl.bufs.back();
+        fl.bufs.pop_back();
+    }
+    fl.lock.unlock();
+
+    if( buf ) {
+        m_reuses.fetch_add( 1, std::memory_order_relaxed );
+        return buf;
+    }
+    buf = (char*)malloc( *real_size );
+    if( !buf ) {
+        m_in_use.fetch_sub( *real_size, std::memory_order_relaxed );
+    }
+    return buf;
+}
+
+void buffer_pool::free( char* buf, int size )
+{
+    if( !buf ) {
+        return;
+    }
+    m_in_use.fetch_sub( size, std::memory_order_relaxed );
+    int cls = size_class( size );
+    free_list& fl = m_free[cls];
+    fl.lock.lock();
+    if( (int)fl.bufs.size() < m_max_free[cls] ) {
+        fl.bufs.push_back( buf );
+        buf = NULL;
+    }
+    fl.lock.unlock();
+    if( buf ) {
+        ::free( buf );
+    }
+}
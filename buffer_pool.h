@@ -0,0 +1,51 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include <vector>
+#include <atomic>
+#include "locker.h"
+
+/*
+    读缓冲区池。缓冲区的大小分成若干级（2KB、4KB、8KB……1MB），每一级有自己的锁和空闲链表，
+    释放的缓冲区放回对应级别的空闲链表，下次直接复用，不再调用malloc。
+    每一级最多缓存max_free个空闲缓冲区，并且每一级缓存的字节数不超过max_free_bytes，多出来的直接free，
+    避免一次请求高峰之后内存一直被占着。默认2KB的一级缓存1024个，1MB的一级只缓存4个，所有级别加起来不超过38MB。
+    缓冲区可能被一个线程分配（reactor读数据时），被另一个线程释放（工作线程处理完请求时），所以需要加锁。
+*/
+class buffer_pool {
+public:
+    static const int MIN_SHIFT = 11;                // 最小的缓冲区是2KB
+    static const int CLASSES = 10;                  // 2KB ~ 1MB
+    static const int MIN_SIZE = 1 << MIN_SHIFT;
+    static const int MAX_SIZE = MIN_SIZE << ( CLASSES - 1 );
+
+    explicit buffer_pool( int max_free = 1024, long max_free_bytes = 4L << 20 );
+    ~buffer_pool();
+
+    // 分配一个不小于size的缓冲区，实际大小通过real_size返回；size超过MAX_SIZE时返回NULL
+    char* alloc( int size, int* real_size );
+    // 归还一个由alloc分配的缓冲区，size是alloc返回的实际大小
+    void free( char* buf, int size );
+
+    // 统计信息
+    unsigned long allocs() const { return m_allocs; }   // alloc调用的次数
+    unsigned long reuses() const { return m_reuses; }   // 其中从空闲链表复用的次数
+    long in_use() const { return m_in_use; }            // 正在使用的缓冲区的总字节数
+
+private:
+    static int size_class( int size );
+
+    struct free_list {
+        locker lock;
+        std::vector< char* > bufs;
+    };
+
+    int m_max_free[CLASSES];    // 每一级最多缓存的空闲缓冲区数
+    free_list m_free[CLASSES];
+    std::atomic<unsigned long> m_allocs;
+    std::atomic<unsigned long> m_reuses;
+    std::atomic<long> m_in_use;
+};
+
+#endif
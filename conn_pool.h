@@ -0,0 +1,58 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include <vector>
+#include "http_conn.h"
+
+/*
+    连接对象池。原来启动时一次性创建MAX_FD个http_conn（每个4KB多，一共两百多MB的地址空间），
+    现在以fd为下标的users表里只存指针，连接对象在accept时从所属reactor的连接池中分配，连接关闭后还回池中。
+    池按块（每块CHUNK个对象）申请内存，内存占用随同时在线的连接数增长，而不是由MAX_FD决定。
+
+    连接对象只由它所属的reactor分配和释放（工作线程不会关闭连接），所以不需要加锁。
+*/
+class conn_pool {
+public:
+    static const int CHUNK = 64;    // 每次扩充的连接对象数
+
+    conn_pool() : m_live( 0 ) {}
+
+    // 连接池被销毁时，释放所有内存块
+    ~conn_pool() {
+        for( size_t i = 0; i < m_chunks.size(); ++i ) {
+            delete [] m_chunks[i];
+        }
+    }
+
+    // 从池中分配一个连接对象
+    http_conn* alloc() {
+        if( m_free.empty() ) {
+            http_conn* chunk = new http_conn[CHUNK];
+            m_chunks.push_back( chunk );
+            for( int i = CHUNK - 1; i >= 0; --i ) {
+                m_free.push_back( &chunk[i] );
+            }
+        }
+        http_conn* conn = m_free.back();
+        m_free.pop_back();
+        m_live++;
+        return conn;
+    }
+
+    // 把连接对象还回池中，调用者保证连接已经关闭、没有工作线程或者内核请求还在使用它
+    void free( http_conn* conn ) {
+        conn->release();
+        m_free.push_back( conn );
+        m_live--;
+    }
+
+    int live() const { return m_live; }    // 正在使用的连接对象数
+    int capacity() const { return (int)m_chunks.size() * CHUNK; }  // 已经分配的连接对象数
+
+private:
+    int m_live;
+    std::vector< http_conn* > m_free;       // 空闲的连接对象
+    std::vector< http_conn* > m_chunks;     // 分配的所有内存块
+};
+
+#endif
@@ -0,0 +1,206 @@
+#include "file_cache.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <functional>
+
+file_cache::file_cache(size_t budget) : m_budget(budget), m_hits(0), m_misses(0), m_evictions(0)
+{
+    m_shard_budget = budget / FILE_CACHE_SHARDS;
+    m_max_entry = m_shard_budget / 4;
+    for(int i = 0; i < FILE_CACHE_SHARDS; i++)
+    {
+        m_shards[i].head = m_shards[i].tail = NULL;
+        m_shards[i].bytes = 0;
+    }
+}
+
+file_cache::~file_cache()
+{
+    for(int i = 0; i < FILE_CACHE_SHARDS; i++)
+    {
+        entry* e = m_shards[i].head;
+        while(e)
+        {
+            entry* next = e->next;
+            release(e);
+            e = next;
+        }
+    }
+}
+
+file_cache::shard* file_cache::get_shard(const char* path)
+{
+    size_t h = std::hash<std::string>()(path);
+    return &m_shards[h % FILE_CACHE_SHARDS];
+}
+
+void file_cache::unlink(shard* s, entry* e)
+{
+    if(e->prev) e->prev->next = e->next;
+    else s->head = e->next;
+    if(e->next) e->next->prev = e->prev;
+    else s->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+void file_cache::push_front(shard* s, entry* e)
+{
+    e->prev = NULL;
+    e->next = s->head;
+    if(s->head) s->head->prev = e;
+    s->head = e;
+    if(!s->tail) s->tail = e;
+}
+
+file_cache::entry* file_cache::acquire(const char* path)
+{
+    shard* s = get_shard(path);
+    s->lock.lock();
+    std::unordered_map< std::string, entry* >::iterator it = s->map.find(path);
+    if(it == s->map.end())
+    {
+        s->lock.unlock();
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    entry* e = it->second;
+    // 移到LRU链表头部
+    if(e != s->head)
+    {
+        unlink(s, e);
+        push_front(s, e);
+    }
+    e->refs.fetch_add(1, std::memory_order_relaxed);
+    s->lock.unlock();
+    m_hits.fetch_add(1, std::memory_order_relaxed);
+    return e;
+}
+
+file_cache::entry* file_cache::insert(const char* path, int fd, const struct stat& st)
+{
+    size_t size = st.st_size;
+    if(!cacheable(size)) return NULL;
+
+    // 在锁外读入文件
+    char* data = (char*)malloc(size > 0 ? size : 1);
+    if(!data) return NULL;
+    size_t done = 0;
+    while(done < size)
+    {
+        ssize_t n = pread(fd, data + done, size - done, done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0)
+        {
+            // 文件在stat之后被截断或者读取出错
+            free(data);
+            return NULL;
+        }
+        done += n;
+    }
+    return insert_data(path, data, st);
+}
+
+file_cache::entry* file_cache::insert_data(const char* path, char* data, const struct stat& st)
+{
+    size_t size = st.st_size;
+    if(!cacheable(size))
+    {
+        free(data);
+        return NULL;
+    }
+
+    entry* e = new entry;
+    e->path = path;
+    e->data = data;
+    e->st = st;
+    e->refs.store(2, std::memory_order_relaxed);   // 缓存和调用者各一个引用
+    e->prev = e->next = NULL;
+
+    shard* s = get_shard(path);
+    s->lock.lock();
+    std::unordered_map< std::string, entry* >::iterator it = s->map.find(e->path);
+    entry* victims = NULL;
+    if(it != s->map.end())
+    {
+        entry* old = it->second;
+        if(old->st.st_ino == st.st_ino && old->st.st_mtim.tv_sec == st.st_mtim.tv_sec
+           && old->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec && old->st.st_size == st.st_size)
+        {
+            // 其他线程已经先一步读入了同一个文件，使用它的缓存项
+            old->refs.fetch_add(1, std::memory_order_relaxed);
+            s->lock.unlock();
+            free(e->data);
+            delete e;
+            return old;
+        }
+        // 缓存中的是文件修改之前的版本，替换掉
+        unlink(s, old);
+        s->map.erase(it);
+        s->bytes -= old->st.st_size;
+        old->next = victims;
+        victims = old;
+    }
+    s->map[e->path] = e;
+    push_front(s, e);
+    s->bytes += size;
+
+    // 超过预算，从LRU链表尾部淘汰，不淘汰刚加入的缓存项
+    while(s->bytes > m_shard_budget && s->tail && s->tail != e)
+    {
+        entry* victim = s->tail;
+        unlink(s, victim);
+        s->map.erase(victim->path);
+        s->bytes -= victim->st.st_size;
+        victim->next = victims;
+        victims = victim;
+        m_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    s->lock.unlock();
+
+    // 在锁外释放被淘汰的缓存项
+    while(victims)
+    {
+        entry* next = victims->next;
+        release(victims);
+        victims = next;
+    }
+    return e;
+}
+
+void file_cache::erase(entry* e)
+{
+    shard* s = get_shard(e->path.c_str());
+    s->lock.lock();
+    std::unordered_map< std::string, entry* >::iterator it = s->map.find(e->path);
+    if(it == s->map.end() || it->second != e)
+    {
+        s->lock.unlock();
+        return;
+    }
+    unlink(s, e);
+    s->map.erase(it);
+    s->bytes -= e->st.st_size;
+    s->lock.unlock();
+    // 释放缓存本身的引用
+    release(e);
+}
+
+void file_cache::release(entry* e)
+{
+    if(e->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        free(e->data);
+        delete e;
+    }
+}
+
+size_t file_cache::bytes() const
+{
+    size_t total = 0;
+    for(int i = 0; i < FILE_CACHE_SHARDS; i++)
+    {
+        total += m_shards[i].bytes;
+    }
+    return total;
+}
@@ -0,0 +1,85 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+
+/*
+    静态文件缓存，放在do_request前面，命中时不需要stat、open、mmap、close和munmap。
+    以文件的完整路径为键，值是文件内容和stat信息，所有工作线程共享。
+
+    为了减少锁竞争，缓存按路径的哈希值分成FILE_CACHE_SHARDS个分片，每个分片有自己的锁、哈希表和
+    LRU链表，内存预算平均分给各个分片，分片中文件的总大小超过预算时从LRU链表尾部淘汰。
+    超过单个分片预算1/4的大文件不缓存，仍然走mmap。
+
+    缓存项带引用计数：缓存本身持有一个引用，每个正在发送它的连接各持有一个引用。被淘汰的缓存项
+    只是从哈希表中移除，内存在最后一个连接发送完毕、释放引用之后才回收。
+*/
+
+#define FILE_CACHE_SHARDS 16
+
+class file_cache {
+public:
+    struct entry {
+        std::string path;
+        char* data;             // 文件内容
+        struct stat st;         // 读入文件时的stat信息
+        std::atomic<int> refs;  // 引用计数
+        entry* prev;            // LRU链表，表头是最近使用的
+        entry* next;
+    };
+
+    explicit file_cache(size_t budget);
+    ~file_cache();
+
+    // 查找path对应的缓存项，命中时返回增加了引用计数的缓存项，否则返回NULL
+    entry* acquire(const char* path);
+    // 读入fd指向的文件并加入缓存，st是调用者stat得到的信息。文件太大或者读取失败时返回NULL，
+    // 成功时返回增加了引用计数的缓存项
+    entry* insert(const char* path, int fd, const struct stat& st);
+    // 把调用者已经准备好的内容（比如压缩后的文件）加入缓存，data由malloc分配，长度是st.st_size，
+    // 所有权转给缓存。成功时返回增加了引用计数的缓存项，太大时释放data并返回NULL
+    entry* insert_data(const char* path, char* data, const struct stat& st);
+    // 文件已经被修改，把缓存项从缓存中移除（已经被淘汰或者替换时什么也不做），调用者自己的引用不受影响
+    void erase(entry* e);
+    // 连接发送完毕，释放引用
+    static void release(entry* e);
+
+    // 文件是否小到可以放进缓存
+    bool cacheable(size_t size) const { return size <= m_max_entry; }
+
+    // 统计信息
+    unsigned long hits() const { return m_hits; }
+    unsigned long misses() const { return m_misses; }
+    unsigned long evictions() const { return m_evictions; }
+    size_t bytes() const;
+    size_t budget() const { return m_budget; }
+
+private:
+    struct shard {
+        locker lock;
+        std::unordered_map< std::string, entry* > map;
+        entry* head;
+        entry* tail;
+        size_t bytes;   // 分片中缓存项的总大小
+    };
+
+    shard* get_shard(const char* path);
+    void unlink(shard* s, entry* e);
+    void push_front(shard* s, entry* e);
+
+private:
+    size_t m_budget;        // 总的内存预算（字节）
+    size_t m_shard_budget;  // 每个分片的内存预算
+    size_t m_max_entry;     // 单个文件的最大大小
+    shard m_shards[FILE_CACHE_SHARDS];
+    std::atomic<unsigned long> m_hits;
+    std::atomic<unsigned long> m_misses;
+    std::atomic<unsigned long> m_evictions;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include "gzip.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+bool gzip_compressible( const char* path )
+{
+    static const char* const exts[] = { "html", "htm", "css", "js", "json", "txt", "xml", "svg" };
+    const char* dot = strrchr( path, '.' );
+    if( !dot || strchr( dot, '/' ) ) {
+        return false;
+    }
+    for( size_t i = 0; i < sizeof( exts ) / sizeof( exts[0] ); ++i ) {
+        if( strcasecmp( dot + 1, exts[i] ) == 0 ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 一个编码项的q值，没有q参数时是1
+static double coding_q( const char* p, const char* end )
+{
+    while( p < end ) {
+        const char* semi = (const char*)memchr( p, ';', end - p );
+        if( !semi ) break;
+        p = semi + 1;
+        while( p < end && ( *p == ' ' || *p == '\t' ) ) ++p;
+        if( end - p >= 2 && ( p[0] == 'q' || p[0] == 'Q' ) && p[1] == '=' ) {
+            return strtod( p + 2, NULL );
+        }
+    }
+    return 1;
+}
+
+// Accept-Encoding: gzip, deflate;q=0.5, *;q=0
+bool gzip_accepted( const char* value, int len )
+{
+    double gzip_q = -1, star_q = -1;
+    const char* p = value;
+    const char* end = value + len;
+    while( p < end ) {
+        const char* comma = (const char*)memchr( p, ',', end - p );
+        const char* item_end = comma ? comma : end;
+        while( p < item_end && ( *p == ' ' || *p == '\t' ) ) ++p;
+        const char* name_end = p;
+        while( name_end < item_end && *name_end != ';' && *name_end != ' ' && *name_end != '\t' ) ++name_end;
+        int name_len = name_end - p;
+        if( ( name_len == 4 && strncasecmp( p, "gzip", 4 ) == 0 ) || ( name_len == 6 && strncasecmp( p, "x-gzip", 6 ) == 0 ) ) {
+            gzip_q = coding_q( name_end, item_end );
+        } else if( name_len == 1 && *p == '*' ) {
+            star_q = coding_q( name_end, item_end );
+        }
+        p = comma ? comma + 1 : end;
+    }
+    // 明确列出的gzip优先于*
+    return gzip_q >= 0 ? gzip_q > 0 : star_q > 0;
+}
+
+char* gzip_compress( const char* data, size_t len, size_t* out_len )
+{
+    z_stream zs;
+    memset( &zs, 0, sizeof( zs ) );
+    // windowBits加16表示输出gzip格式（带gzip头和CRC32尾），而不是zlib格式
+    if( deflateInit2( &zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+        return NULL;
+    }
+    // 只压缩一次、结果一直留在缓存中，所以用最高的压缩级别
+    size_t bound = deflateBound( &zs, len );
+    char* out = (char*)malloc( bound );
+    if( !out ) {
+        deflateEnd( &zs );
+        return NULL;
+    }
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = bound;
+    int ret = deflate( &zs, Z_FINISH );
+    size_t n = zs.total_out;
+    deflateEnd( &zs );
+    if( ret != Z_STREAM_END || n >= len ) {
+        free( out );
+        return NULL;
+    }
+    *out_len = n;
+    // 压缩结果通常比deflateBound小得多，缩小到实际大小，缓存按实际大小计算预算
+    char* shrunk = (char*)realloc( out, n );
+    return shrunk ? shrunk : out;
+}
@@ -0,0 +1,27 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stddef.h>
+
+/*
+    静态文件的gzip压缩。客户端在Accept-Encoding中接受gzip时，do_request按下面的顺序选择响应体：
+    1. 压缩变体缓存中已经有这个文件的gzip版本，直接发送
+    2. 文件旁边有预先压缩好的file.gz，发送它（小的读入压缩变体缓存）
+    3. 用zlib压缩一次，结果放进压缩变体缓存，之后的请求都从缓存发送
+    只压缩文本类的文件，图片等已经压缩过的格式和太小的文件原样发送。任何情况下都不会每个请求压缩一次。
+*/
+
+// 小于这个大小的文件不压缩，压缩节省的字节抵不上Content-Encoding字段和gzip头尾的开销
+static const int GZIP_MIN_SIZE = 256;
+
+// 按扩展名判断文件是否值得压缩（html、css、js、json、txt、xml、svg）
+bool gzip_compressible( const char* path );
+
+// 解析Accept-Encoding字段的值，判断客户端是否接受gzip（gzip、x-gzip或者*，q不为0）
+bool gzip_accepted( const char* value, int len );
+
+// 把data压缩成gzip格式，返回malloc分配的结果，长度写入out_len。
+// 压缩失败或者压缩后不比原来小时返回NULL
+char* gzip_compress( const char* data, size_t len, size_t* out_len );
+
+#endif
@@ -1,19 +1,20 @@
 #include "http_conn.h"
-
-int http_conn::m_epollfd = -1; 
-int  http_conn::m_user_count = 0;
-
-// 定义HTTP响应的一些状态信息
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
-const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
-const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Fount";
-const char* error_404_form = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
-const char* error_500_form = "There was an unusual problem serving the requested file.\n";
-
+#include "simd_scan.h"
+#include "gzip.h"
+#include <algorithm>
+#include <ctype.h>
+
+std::atomic<int> http_conn::m_user_count( 0 );
+file_cache* http_conn::m_file_cache = NULL;
+file_cache* http_conn::m_gzip_cache = NULL;
+stat_cache* http_conn::m_stat_cache = NULL;
+bool http_conn::m_use_sendfile = true;
+int http_conn::m_max_header_size = http_conn::DEFAULT_MAX_HEADER_SIZE;
+buffer_pool http_conn::m_read_pool;
+long http_conn::m_max_queue_wait_ns = 0;
+locker http_conn::m_gzip_lock;
+std::set< std::string > http_conn::m_gzip_inflight;
+alignas(CACHE_LINE_SIZE) std::atomic<bool> http_conn::m_queue_slow( false );
 
 // 网站的根目录
 const char* doc_root = "/home/yjq/webserver/resources";
@@ -28,7 +29,7 @@ int setnonblocking(int fd)
     return old_flag;
 }
 
-// 向epoll中添加需要监听的文件描述符
+// 向epoll中添加需要监听的文件描述符，fd在创建时（socket/accept4的SOCK_NONBLOCK）就已经是非阻塞的了
 void addfd(int epollfd, int fd, bool one_shot){
     epoll_event event;
     event.data.fd = fd;
@@ -44,8 +45,6 @@ void addfd(int epollfd, int fd, bool one_shot){
         event.events |= EPOLLONESHOT;
     }
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    // 设置文件描述符非阻塞
-    setnonblocking(fd);
 }
 
 
@@ -65,17 +64,21 @@ void modfd(int epollfd, int fd, int ev){
 }
 
 // 初始化连接
-void http_conn::init(int sockfd, const sockaddr_in &addr){
+void http_conn::init(int sockfd, const sockaddr_in &addr, int epollfd){
     m_sockfd = sockfd;
     m_address = addr;
+    m_epollfd = epollfd;
+    close_pending = false;
+    // 上一个连接异常关闭时可能还没有释放文件映射或缓存项
+    release_responses();
 
-    printf("build connection with fd %d\n", sockfd);
+    LOG_DEBUG("build connection with fd %d", sockfd);
     // 端口复用
     int reuse = 1;
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
-    // 添加到epoll对象中
-    addfd(m_epollfd, sockfd, true);
+    // 添加到epoll对象中，io_uring后端没有epoll对象
+    if(m_epollfd >= 0) addfd(m_epollfd, sockfd, true);
     m_user_count++;
 
     init();
@@ -83,49 +86,130 @@ void http_conn::init(int sockfd, const sockaddr_in &addr){
 
 void http_conn::init()
 {
-    bytes_to_send = 0;
-    bytes_have_send = 0;
+    m_resp_head = 0;
+    m_resp_count = 0;
+    m_close_after = false;
+    m_request_bytes = 0;
+    m_iv_count = 0;
+    m_iv_more = false;
+
+    reset_request();
+    m_start_line = 0;
+    m_checked_index = 0;
+    release_read_buf();
+    m_write_idx = 0;
+    bzero(m_write_buf, WRITE_BUFFER_SIZE);
+    bzero(m_real_file, FILENAME_LEN);
+    
+}
 
+void http_conn::reset_request()
+{
     m_check_state = CHECK_STATE_REQUESTLINE;  // 初始化状态为解析请求首行
     m_linger = false;
+    m_gzip = false;
+    m_vary = false;
+    m_etag_len = 0;
+    m_range_count = 0;
 
     m_method = GET;
     m_url = 0;
     m_version = 0;
     m_content_length = 0;
-    m_host = 0;
+    m_header_count = 0;
+    memset(m_known, -1, sizeof(m_known));
+}
+
+// 只在请求的边界上调用（解析请求首行的状态下），此时没有任何指针指向读缓冲区
+void http_conn::compact_read_buf()
+{
+    int left = m_read_index - m_start_line;
+    memmove( m_read_buf, m_read_buf + m_start_line, left );
+    bzero( m_read_buf + left, m_read_index - left );
+    m_checked_index -= m_start_line;
+    m_read_index = left;
     m_start_line = 0;
-    m_checked_index = 0;
+}
+
+/*
+    读缓冲区放不下请求时，从缓冲区池中换一个更大的（下一级大小），把已有的数据复制过去。
+    解析器中的m_url、m_version指向读缓冲区，复制之后把它们改成指向新缓冲区中对应的位置，
+    已经解析的部分不需要重新解析。getline()使用的是下标，不受影响。
+*/
+bool http_conn::grow_read_buf(int need)
+{
+    if( need > m_max_header_size ) {
+        return false;
+    }
+    if( need < READ_BUFFER_SIZE ) {
+        need = READ_BUFFER_SIZE;
+    }
+    int alloc;
+    char* buf = m_read_pool.alloc( need, &alloc );
+    if( !buf ) {
+        return false;
+    }
+    if( m_read_buf ) {
+        memcpy( buf, m_read_buf, m_read_index );
+        if( m_url ) m_url = buf + ( m_url - m_read_buf );
+        if( m_version ) m_version = buf + ( m_version - m_read_buf );
+        m_read_pool.free( m_read_buf, m_read_buf_alloc );
+    }
+    m_read_buf = buf;
+    m_read_buf_alloc = alloc;
+    m_read_buf_size = alloc < m_max_header_size ? alloc : m_max_header_size;
+    // 解析器依赖字符串结束符，新缓冲区中还没有数据的部分清零
+    bzero( m_read_buf + m_read_index, m_read_buf_size - m_read_index );
+    return true;
+}
+
+void http_conn::release_read_buf()
+{
+    m_read_pool.free( m_read_buf, m_read_buf_alloc );
+    m_read_buf = NULL;
+    m_read_buf_size = 0;
+    m_read_buf_alloc = 0;
     m_read_index = 0;
-    m_write_idx = 0;
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, WRITE_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
-    
+    m_checked_index = 0;
+    m_start_line = 0;
 }
 
 // 关闭连接
 void http_conn::close_conn(){
     if(m_sockfd != -1)
     {
-        printf("close connection fd %d\n", m_sockfd);
-        removefd(m_epollfd, m_sockfd);
+        LOG_DEBUG("close connection fd %d", m_sockfd);
+        if(m_epollfd < 0)
+        {
+            // io_uring后端：socket上还挂着multishot recv，它持有socket的引用，仅仅close不会真正关闭连接。
+            // 这里只shutdown让挂起的请求结束，fd由事件循环在请求全部完成后关闭，避免fd号被提前复用
+            shutdown(m_sockfd, SHUT_RDWR);
+        }
+        else removefd(m_epollfd, m_sockfd);
         m_sockfd = -1;
         m_user_count --;
     }
 }
 
+void http_conn::release()
+{
+    release_responses();
+    release_read_buf();
+}
+
 
 // 循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read()
 {
-    if(m_read_index >= READ_BUFFER_SIZE)  return false;
+    // 读缓冲区满了，说明一个请求就占满了整个缓冲区（处理完的请求已经被移走），换一个更大的缓冲区
+    if(m_read_index >= m_read_buf_size && !grow_read_buf(m_read_index + 1))  return false;
 
     // 读取到的字节
     int bytes_read = 0;
-    while(true)
+    // 读缓冲区满了就先停下来，剩下的数据留在socket中，等前面的请求处理完、缓冲区腾出空间后再读
+    while(m_read_index < m_read_buf_size)
     {
-        bytes_read = recv(m_sockfd, m_read_index + m_read_buf, READ_BUFFER_SIZE - m_read_index, 0);
+        bytes_read = recv(m_sockfd, m_read_index + m_read_buf, m_read_buf_size - m_read_index, 0);
         if(bytes_read == -1)
         {
             if(errno == EAGAIN || errno == EWOULDBLOCK)
@@ -142,8 +226,18 @@ bool http_conn::read()
         }
         m_read_index += bytes_read;
     }
-    printf("读取到了数据：\n");
-    printf("%s\n", m_read_buf);
+    m_recv_ns = monotonic_ns();
+    LOG_DEBUG("读取到了数据：\n%.*s", m_read_index, m_read_buf);
+    return true;
+}
+
+// 把已经由事件循环（io_uring后端）收到的数据追加到读缓冲区，超过读缓冲区的上限时返回false
+bool http_conn::append_read(const char* data, int len)
+{
+    if(len > m_read_buf_size - m_read_index && !grow_read_buf(m_read_index + len)) return false;
+    memcpy(m_read_buf + m_read_index, data, len);
+    m_read_index += len;
+    m_recv_ns = monotonic_ns();
     return true;
 }
 
@@ -162,6 +256,8 @@ http_conn::HTTP_CODE http_conn::process_read()
 
         // 获取一行数据
         text = getline();   // m_read_buf + m_start_line
+        // 行的长度，不包括已经被改成'\0'的\r\n
+        int len = m_checked_index - 2 - m_start_line;
 
         m_start_line = m_checked_index;
         // printf("got 1 http line:\n");
@@ -171,20 +267,20 @@ http_conn::HTTP_CODE http_conn::process_read()
         {
             case CHECK_STATE_REQUESTLINE:
             {
-                ret = parse_request_line(text);
+                ret = parse_request_line(text, len);
                 if(ret == BAD_REQUEST) return BAD_REQUEST;
                 break;
             }
             case CHECK_STATE_HEADER:
             {
-                ret = parse_headers(text);
+                ret = parse_headers(text, len);
                 if(ret == BAD_REQUEST) return BAD_REQUEST;
                 else if(ret == GET_REQUEST) return do_request();  // 解析具体的请求信息
                 break;
             }
             case CHECK_STATE_CONTENT:
             {
-                ret = parse_content(text);
+                ret = parse_content();
                 if(ret == GET_REQUEST) return do_request();
                 line_status = LINE_OPEN;
                 break;
@@ -200,29 +296,31 @@ http_conn::HTTP_CODE http_conn::process_read()
 
 }
 
-// 解析HTTP请求行，获得请求方法，目标URL，HTTP版本
-http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
+// 解析HTTP请求行，获得请求方法，目标URL，HTTP版本。行的长度已知，分隔符用scan2查找，不再用strpbrk和strcasecmp重复扫描
+http_conn::HTTP_CODE http_conn::parse_request_line(char *text, int len)
 {
     // GET / HTTP/1.1
-    m_url = strpbrk(text, " \t");
-    if( !m_url) return BAD_REQUEST;
+    char *end = text + len;
+    m_url = (char*)scan2(text, end, ' ', '\t');
+    if( m_url == end ) return BAD_REQUEST;
+    int method_len = m_url - text;
 
     // GET\0/ HTTP/1.1
     *m_url++ = '\0';   //  '\0'表示字符串结束符  m_url = / HTTP/1.1
 
     char *method = text;  // 由于GET后面是子字符串结束符，所以text = GET
-    if( strcasecmp(method, "GET") == 0)
+    if( method_len == 3 && strncasecmp(method, "GET", 3) == 0)
     {
         m_method = GET;
     }
     else return BAD_REQUEST;
 
-    m_version = strpbrk(m_url, " \t");
-    if(!m_version)  return BAD_REQUEST;
+    m_version = (char*)scan2(m_url, end, ' ', '\t');
+    if( m_version == end )  return BAD_REQUEST;
 
     // GET\0/\0HTTP/1.1
     *m_version++ = '\0';   // m_version = HTTP/1.1
-    if(strcasecmp(m_version, "HTTP/1.1") !=0 ) return BAD_REQUEST;
+    if( end - m_version != 8 || strncasecmp(m_version, "HTTP/1.1", 8) != 0 ) return BAD_REQUEST;
 
     if(strncasecmp(m_url, "http://", 7) == 0)
     {
@@ -237,7 +335,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     return NO_REQUEST;
 }
     
-http_conn::HTTP_CODE  http_conn::parse_headers(char *text)
+http_conn::HTTP_CODE  http_conn::parse_headers(char *text, int len)
 {
     // 遇到空行，表示头部字段解析完毕
     if(text[0] == '\0')
@@ -252,245 +350,922 @@ http_conn::HTTP_CODE  http_conn::parse_headers(char *text)
         // 否则说明我们已经得到一个完整的请求
         return GET_REQUEST;
     }
-    else if( strncasecmp( text, "Connection:", 11) == 0 )
-    {
-        // 处理Connection 头部字段，  Connection: keep-alive
-        text += 11;
-        text += strspn(text, " \t");
-        if( strcasecmp( text, "keep-alive") == 0 )  m_linger = true;
-    }
-    else if( strncasecmp( text, "Content-Length:", 15) == 0 )
+
+    // 名字: 值，没有冒号的行忽略
+    char *end = text + len;
+    char *colon = (char*)scan2(text, end, ':', ':');
+    if( colon == end ) return NO_REQUEST;
+    if( m_header_count == MAX_HEADERS ) return BAD_REQUEST;
+
+    char *value = colon + 1;
+    value += strspn(value, " \t");
+    while( end > value && ( end[-1] == ' ' || end[-1] == '\t' ) ) *--end = '\0';
+
+    header& h = m_headers[m_header_count];
+    h.name = text - m_read_buf;
+    h.name_len = colon - text;
+    h.value = value - m_read_buf;
+    h.value_len = end - value;
+    h.id = lookup_header(text, h.name_len);
+    if( h.id != HDR_UNKNOWN ) m_known[h.id] = m_header_count;
+    m_header_count++;
+
+    // 解析器自己需要的字段，其他字段由处理函数通过get_header查找
+    switch( h.id )
     {
-        // 处理Content-Length头部字段
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = atol(text);
+        case HDR_CONNECTION:    // Connection: keep-alive
+            if( strcasecmp( value, "keep-alive") == 0 )  m_linger = true;
+            break;
+        case HDR_CONTENT_LENGTH:
+        {
+            // parse_content按这个长度移动解析位置，负数、溢出或者超过读缓冲区上限的长度会让它越过缓冲区，
+            // 都作为错误的请求。strtol得到的是64位的long，在转换成int之前比较
+            char* digits_end;
+            errno = 0;
+            long len = strtol(value, &digits_end, 10);
+            if( !isdigit( (unsigned char)value[0] ) || *digits_end != '\0' || errno == ERANGE || len > m_max_header_size ) {
+                return BAD_REQUEST;
+            }
+            m_content_length = (int)len;
+            break;
+        }
+        default:
+            break;
     }
-    else if( strncasecmp( text, "Host:", 5) == 0 )
+    return NO_REQUEST;
+}
+
+const char* http_conn::get_header( HEADER_ID id, int* len ) const
+{
+    int i = m_known[id];
+    if( i < 0 ) return NULL;
+    if( len ) *len = m_headers[i].value_len;
+    return m_read_buf + m_headers[i].value;
+}
+
+const char* http_conn::find_header( const char* name, int* len ) const
+{
+    int name_len = strlen( name );
+    HEADER_ID id = lookup_header( name, name_len );
+    if( id != HDR_UNKNOWN ) return get_header( id, len );
+    for( int i = m_header_count - 1; i >= 0; --i )
     {
-        // 处理Host 头部字段
-        text += 5;
-        text += strspn(text, " \t");
-        m_host = text;
+        const header& h = m_headers[i];
+        if( h.name_len == name_len && strncasecmp( m_read_buf + h.name, name, name_len ) == 0 )
+        {
+            if( len ) *len = h.value_len;
+            return m_read_buf + h.value;
+        }
     }
-    // else printf( "oop! unknow header %s\n", text);
-
-    return NO_REQUEST;
+    return NULL;
 }
 
-// 我们没有真正的解析HTTP请求的消息体，只是判断它是否被完整的读入了   
-http_conn::HTTP_CODE http_conn::parse_content(char *text)
+// 我们没有真正的解析HTTP请求的消息体，只是判断它是否被完整的读入了。
+// 消息体之后可能紧跟着流水线上的下一个请求，所以跳过消息体，但不修改其中的内容
+http_conn::HTTP_CODE http_conn::parse_content()
 {
-    if( m_read_index >= (m_content_length + m_checked_index) )
+    if( m_read_index >= (long)m_content_length + m_checked_index )
     {
-        text[ m_content_length ] = '\0';
+        m_checked_index += m_content_length;
+        m_start_line = m_checked_index;
         return GET_REQUEST;
     }
     return NO_REQUEST;
 }
 
-// 解析一行，判断依据\r\n
+// 解析一行，判断依据\r\n。用向量化的scan2一次检查16或32个字节，直接跳到下一个'\r'或'\n'
 http_conn::LINE_STATUS http_conn::paser_line()
 {
-    char temp;
-    for(; m_checked_index < m_read_index; ++m_checked_index)
-    {
-        temp = m_read_buf[m_checked_index];
-        if(temp == '\r')
-        {
-            if((m_checked_index + 1) == m_read_index) return LINE_OPEN;
-            else if(m_read_buf[m_checked_index + 1] == '\n')
-            {
-                m_read_buf[m_checked_index++] = '\0';  // 空字符
-                m_read_buf[m_checked_index++] = '\0';
-                return LINE_OK;
-            }
+    m_checked_index = scan2(m_read_buf + m_checked_index, m_read_buf + m_read_index, '\r', '\n') - m_read_buf;
 
-            return LINE_BAD;
-        }
-        else if( temp == '\n' )
+    // 没有找到行结束符，这一行的数据还不完整
+    if(m_checked_index >= m_read_index) return LINE_OPEN;
+
+    if(m_read_buf[m_checked_index] == '\r')
+    {
+        if((m_checked_index + 1) == m_read_index) return LINE_OPEN;
+        else if(m_read_buf[m_checked_index + 1] == '\n')
         {
-            if((m_checked_index > 1) && (m_read_buf[m_checked_index-1] == '\r'))
-            {
-                m_read_buf[m_checked_index -1] = '\0';
-                m_read_buf[m_checked_index++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
+            m_read_buf[m_checked_index++] = '\0';  // 空字符
+            m_read_buf[m_checked_index++] = '\0';
+            return LINE_OK;
         }
+        return LINE_BAD;
     }
 
-    return LINE_OK;
+    // '\n'
+    if((m_checked_index > 1) && (m_read_buf[m_checked_index-1] == '\r'))
+    {
+        m_read_buf[m_checked_index -1] = '\0';
+        m_read_buf[m_checked_index++] = '\0';
+        return LINE_OK;
+    }
+    return LINE_BAD;
+}
+
 
+// 文件的元数据，使用元数据缓存时从缓存中查找，否则直接读取
+static stat_cache::entry* get_meta( const char* url, const char* path )
+{
+    if( http_conn::m_stat_cache ) {
+        return http_conn::m_stat_cache->acquire( url, path );
+    }
+    return stat_cache::load( url, path );
 }
 
+// 缓存的文件内容是否和当前的文件一致。文件被修改或者替换之后inode、大小或者修改时间至少有一个会变
+static bool same_file( const struct stat& a, const struct stat& b )
+{
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size
+        && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
 
 // 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
-// 如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其
-// 映射到内存地址m_file_address处，并告诉调用者获取文件成功
+// 如果目标文件存在、对所有用户可读，且不是目录，则从缓存、sendfile或者mmap准备文件内容，
+// 并告诉调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request()
 {
-    // "/home/webserver/resources"
+    // 内部的统计页面，不对应任何文件
+    int stats_len = sizeof( STATS_URL ) - 1;
+    if( strncmp( m_url, STATS_URL, stats_len ) == 0 && ( m_url[stats_len] == '\0' || m_url[stats_len] == '?' ) ) {
+        return do_stats_request();
+    }
+
+    // "/home/webserver/resources" + 规范化之后的URL，URL同时也是元数据缓存的键
     strcpy( m_real_file, doc_root );
     int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    // stat()返回文件状态信息
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if ( stat( m_real_file, &m_file_stat ) < 0 ) {
-        return NO_RESOURCE;
+    char* url = m_real_file + len;
+    if( !normalize_url( m_url, url, FILENAME_LEN - len ) ) {
+        return BAD_REQUEST;
     }
 
-    // 判断访问权限
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) ) {
-        return FORBIDDEN_REQUEST;
+    // 元数据缓存命中时不需要stat、open，不存在的文件也会被缓存
+    m_file_meta = get_meta( url, m_real_file );
+    switch( m_file_meta->status ) {
+        case stat_cache::NOT_FOUND:
+            return NO_RESOURCE;
+        case stat_cache::FORBIDDEN:
+            return FORBIDDEN_REQUEST;
+        case stat_cache::IS_DIR:
+            return BAD_REQUEST;
+        default:
+            break;
+    }
+    m_file_stat = m_file_meta->st;
+    m_mime = m_file_meta->mime;
+
+    // 文本类的文件有gzip版本，客户端接受gzip时优先发送压缩版本
+    if( gzip_compressible( m_real_file ) ) {
+        m_vary = true;
+        int ae_len;
+        const char* ae = get_header( HDR_ACCEPT_ENCODING, &ae_len );
+        if( ae && gzip_accepted( ae, ae_len ) ) {
+            HTTP_CODE ret = do_gzip_request();
+            if( ret != NO_REQUEST ) return ret;
+        }
     }
 
-    // 判断是否是目录
-    if ( S_ISDIR( m_file_stat.st_mode ) ) {
-        return BAD_REQUEST;
+    // 客户端缓存的版本仍然有效，不需要读取文件内容
+    if( not_modified() ) {
+        return NOT_MODIFIED;
     }
+    return prepare_file( m_file_cache, m_real_file );
+}
 
-    // 以只读方式打开文件
-    int fd = open( m_real_file, O_RDONLY );
+/*
+    准备发送m_file_meta对应的文件，m_file_stat是它的stat信息。先查内容缓存，缓存项和文件不一致（文件被修改过）时
+    丢掉它重新读取；小文件以key为键读入cache，之后的请求直接从缓存发送，其他文件用sendfile或者mmap发送。
+    文件描述符属于m_file_meta，这里不会关闭它
+*/
+http_conn::HTTP_CODE http_conn::prepare_file( file_cache* cache, const char* key )
+{
+    if( cache ) {
+        m_cache_entry = cache->acquire( key );
+        if( m_cache_entry && !same_file( m_cache_entry->st, m_file_stat ) ) {
+            cache->erase( m_cache_entry );
+            file_cache::release( m_cache_entry );
+            m_cache_entry = NULL;
+        }
+        if( !m_cache_entry && cache->cacheable( m_file_stat.st_size ) ) {
+            m_cache_entry = cache->insert( key, m_file_meta->fd, m_file_stat );
+        }
+        if( m_cache_entry ) {
+            m_file_address = m_cache_entry->data;
+            return FILE_REQUEST;
+        }
+    }
+    // epoll后端直接用sendfile从文件发送，不需要映射到用户空间。io_uring后端通过iovec发送，仍然使用mmap
+    if( m_use_sendfile && m_epollfd >= 0 ) {
+        m_file_fd = m_file_meta->fd;
+        return FILE_REQUEST;
+    }
     // 创建内存映射
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
+    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, m_file_meta->fd, 0 );
+    if( m_file_address == MAP_FAILED ) {
+        m_file_address = 0;
+        return INTERNAL_ERROR;
+    }
     // printf("FILE_REQUEST\n");
     return FILE_REQUEST;
 }
 
-// 对内存映射区执行munmap操作
-void http_conn::unmap() {
-    if( m_file_address )
-    {
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = 0;
+/*
+    准备m_real_file的gzip版本：
+    1. 预先压缩好的m_real_file.gz，它有自己的元数据，内容缓存在压缩变体缓存中，以.gz文件的路径为键
+    2. 运行时压缩的版本，在压缩变体缓存中以原文件的路径为键，缓存项的inode和修改时间和原文件一致才有效，
+       没有时压缩一次放进缓存
+    压缩不划算的文件（太小、太大、压缩后不比原来小）在缓存中记一个长度为0的缓存项，之后的请求不再尝试压缩。
+    同一个文件同时只由一个工作线程压缩，其他线程在压缩完成、放进缓存之前按原样发送，
+    文件刚被修改时的一批请求不会让每个工作线程都用最高的压缩级别压缩一遍。
+    返回NO_REQUEST时调用者按原样发送文件
+*/
+http_conn::HTTP_CODE http_conn::do_gzip_request()
+{
+    int len = strlen( doc_root );
+    char gz_file[FILENAME_LEN + 3];
+    snprintf( gz_file, sizeof( gz_file ), "%s.gz", m_real_file );
+    stat_cache::entry* gz = get_meta( gz_file + len, gz_file );
+    if( gz->status == stat_cache::OK ) {
+        // 之后发送.gz文件，原文件的元数据不再需要
+        stat_cache::release( m_file_meta );
+        m_file_meta = gz;
+        m_file_stat = gz->st;
+        m_gzip = true;
+        if( not_modified() ) return NOT_MODIFIED;
+        return prepare_file( m_gzip_cache, gz_file );
+    }
+    stat_cache::release( gz );
+
+    if( !m_gzip_cache ) return NO_REQUEST;
+    m_cache_entry = m_gzip_cache->acquire( m_real_file );
+    if( m_cache_entry && ( m_cache_entry->st.st_ino != m_file_stat.st_ino
+                           || m_cache_entry->st.st_mtim.tv_sec != m_file_stat.st_mtim.tv_sec
+                           || m_cache_entry->st.st_mtim.tv_nsec != m_file_stat.st_mtim.tv_nsec ) ) {
+        // 原文件被修改过，压缩的版本已经过时
+        m_gzip_cache->erase( m_cache_entry );
+        file_cache::release( m_cache_entry );
+        m_cache_entry = NULL;
+    }
+    if( m_cache_entry ) {
+        if( m_cache_entry->st.st_size == 0 ) {
+            file_cache::release( m_cache_entry );
+            m_cache_entry = NULL;
+            return NO_REQUEST;
+        }
+        return use_gzip_entry();
     }
-}
 
+    if( !claim_gzip( m_real_file, true ) ) return NO_REQUEST;
+    // 查找缓存和登记之间，别的线程可能刚好压缩完，再查一次
+    m_cache_entry = m_gzip_cache->acquire( m_real_file );
+    if( m_cache_entry && m_cache_entry->st.st_mtim.tv_nsec == m_file_stat.st_mtim.tv_nsec
+        && m_cache_entry->st.st_mtim.tv_sec == m_file_stat.st_mtim.tv_sec && m_cache_entry->st.st_ino == m_file_stat.st_ino ) {
+        claim_gzip( m_real_file, false );
+    } else {
+        if( m_cache_entry ) file_cache::release( m_cache_entry );
+        m_cache_entry = compress_variant();
+        claim_gzip( m_real_file, false );
+    }
+    if( m_cache_entry && m_cache_entry->st.st_size == 0 ) {
+        file_cache::release( m_cache_entry );
+        m_cache_entry = NULL;
+    }
+    if( !m_cache_entry ) return NO_REQUEST;
+    return use_gzip_entry();
+}
 
+file_cache::entry* http_conn::compress_variant()
+{
+    size_t size = m_file_stat.st_size;
+    char* gz_data = NULL;
+    size_t gz_len = 0;
+    if( size >= (size_t)GZIP_MIN_SIZE && m_gzip_cache->cacheable( size ) ) {
+        char* data = ( char* )malloc( size );
+        size_t done = 0;
+        while( data && done < size ) {
+            ssize_t n = pread( m_file_meta->fd, data + done, size - done, done );
+            if( n < 0 && errno == EINTR ) continue;
+            if( n <= 0 ) break;
+            done += n;
+        }
+        if( done < size ) {
+            // 文件在stat之后被截断或者读取出错，这次按原样发送，下一个请求再试
+            free( data );
+            return NULL;
+        }
+        gz_data = gzip_compress( data, size, &gz_len );
+        free( data );
+    }
+    if( !gz_data ) {
+        gz_data = ( char* )malloc( 1 );
+        if( !gz_data ) return NULL;
+    }
+    struct stat st = m_file_stat;
+    st.st_size = gz_len;
+    return m_gzip_cache->insert_data( m_real_file, gz_data, st );
+}
 
+bool http_conn::claim_gzip( const char* path, bool claim )
+{
+    bool ok = true;
+    m_gzip_lock.lock();
+    if( claim ) {
+        ok = m_gzip_inflight.insert( path ).second;
+    } else {
+        m_gzip_inflight.erase( path );
+    }
+    m_gzip_lock.unlock();
+    return ok;
+}
 
-bool http_conn::add_status_line(int status, const char*title)
+/*
+    汇总所有线程的统计，生成的内容放在一块匿名映射中，和mmap的文件一样交给应答，发送完毕后由release_response释放。
+    统计页面很少被访问，多一次mmap没有关系
+*/
+http_conn::HTTP_CODE http_conn::do_stats_request()
 {
-    return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
+    std::string body = render_stats();
+    void* addr = mmap( 0, body.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( addr == MAP_FAILED ) {
+        return INTERNAL_ERROR;
+    }
+    memcpy( addr, body.data(), body.size() );
+    m_file_address = ( char* )addr;
+    m_file_stat.st_size = body.size();
+    return STATS_REQUEST;
 }
 
-bool http_conn::add_headers( int content_len)
+// 发送压缩变体缓存中的m_cache_entry，客户端缓存的版本仍然有效时释放它，只发送304
+http_conn::HTTP_CODE http_conn::use_gzip_entry()
 {
-    add_content_length( content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+    m_file_stat = m_cache_entry->st;
+    m_gzip = true;
+    if( not_modified() ) {
+        file_cache::release( m_cache_entry );
+        m_cache_entry = NULL;
+        return NOT_MODIFIED;
+    }
+    m_file_address = m_cache_entry->data;
+    return FILE_REQUEST;
 }
 
-bool http_conn::add_content_length(int content_len)
+/*
+    为m_file_stat（m_gzip表示是否是gzip版本）生成ETag，然后按RFC 7232检查条件请求：
+    有If-None-Match时只看它，其中有匹配的实体标签就是没有修改；否则看If-Modified-Since，
+    文件的修改时间不晚于它就是没有修改
+*/
+bool http_conn::not_modified()
 {
-    return add_response( "Content-Length: %d\r\n", content_len);
+    m_etag_len = make_etag( m_file_stat, m_gzip, m_etag );
+    int len;
+    const char* inm = get_header( HDR_IF_NONE_MATCH, &len );
+    if( inm ) {
+        return etag_matches( inm, len, m_etag, m_etag_len );
+    }
+    const char* ims = get_header( HDR_IF_MODIFIED_SINCE, &len );
+    if( ims ) {
+        time_t since = parse_http_date( ims, len );
+        return since >= 0 && m_file_stat.st_mtime <= since;
+    }
+    return false;
 }
 
-bool http_conn::add_content_type()
+// 读一个非负的十进制数，没有数字或者溢出时返回-1
+static long parse_range_number( const char*& p, const char* end )
 {
-    return add_response("Content-Type: %s\r\n", "text/html");
+    const char* start = p;
+    long v = 0;
+    while( p < end && *p >= '0' && *p <= '9' ) {
+        if( v > ( __LONG_MAX__ - 9 ) / 10 ) return -1;
+        v = v * 10 + ( *p++ - '0' );
+    }
+    return p == start ? -1 : v;
 }
 
-bool http_conn::add_blank_line()
+static bool range_less( const http_conn::byte_range& a, const http_conn::byte_range& b )
 {
-    return add_response("%s", "\r\n");
+    return a.first < b.first;
 }
 
-bool http_conn::add_linger()
+/*
+    解析Range字段（Range: bytes=0-499, 1000-, -500），结果放在m_ranges中，按RFC 7233：
+    1. 没有Range字段、If-Range和当前的文件不符、单位不是bytes、语法错误或者范围超过MAX_RANGES个时忽略Range，返回0
+    2. 超出文件长度的范围丢掉，一个都不剩时返回-1，应答416
+    3. 多个范围排序并合并重叠或者相邻的，返回剩下的范围数
+*/
+int http_conn::parse_ranges()
 {
-    return add_response("Connection: %s\r\n", (m_linger == true)? "keep-alive" : "close");
+    int len;
+    const char* p = get_header( HDR_RANGE, &len );
+    if( !p ) return 0;
+    const char* end = p + len;
+
+    // If-Range是实体标签时必须和当前的ETag完全相同（强比较），是日期时必须等于文件的修改时间
+    int if_range_len;
+    const char* if_range = get_header( HDR_IF_RANGE, &if_range_len );
+    if( if_range ) {
+        if( if_range[0] == '"' ) {
+            if( if_range_len != m_etag_len || memcmp( if_range, m_etag, m_etag_len ) != 0 ) return 0;
+        } else if( parse_http_date( if_range, if_range_len ) != m_file_stat.st_mtime ) {
+            return 0;
+        }
+    }
+
+    if( len < 6 || strncasecmp( p, "bytes=", 6 ) != 0 ) return 0;
+    p += 6;
+    long size = m_file_stat.st_size;
+    int count = 0, specs = 0;
+    while( p < end ) {
+        while( p < end && ( *p == ' ' || *p == '\t' ) ) ++p;
+        if( p < end && *p == ',' ) {
+            ++p;
+            continue;
+        }
+        if( p == end ) break;
+        if( ++specs > MAX_RANGES ) return 0;
+        long first, last;
+        if( *p == '-' ) {
+            // 最后n个字节
+            ++p;
+            long n = parse_range_number( p, end );
+            if( n < 0 ) return 0;
+            first = n < size ? size - n : 0;
+            last = size - 1;
+            if( n == 0 ) first = size;  // 不满足
+        } else {
+            first = parse_range_number( p, end );
+            if( first < 0 || p == end || *p++ != '-' ) return 0;
+            last = size - 1;
+            if( p < end && *p >= '0' && *p <= '9' ) {
+                last = parse_range_number( p, end );
+                if( last < first ) return 0;
+                if( last >= size ) last = size - 1;
+            }
+        }
+        while( p < end && ( *p == ' ' || *p == '\t' ) ) ++p;
+        if( p < end && *p != ',' ) return 0;
+        if( first < size ) {
+            m_ranges[count].first = first;
+            m_ranges[count].last = last;
+            count++;
+        }
+    }
+    if( specs == 0 ) return 0;
+    if( count == 0 ) return -1;
+
+    std::sort( m_ranges, m_ranges + count, range_less );
+    int merged = 0;
+    for( int i = 1; i < count; ++i ) {
+        if( m_ranges[i].first <= m_ranges[merged].last + 1 ) {
+            if( m_ranges[i].last > m_ranges[merged].last ) m_ranges[merged].last = m_ranges[i].last;
+        } else {
+            m_ranges[++merged] = m_ranges[i];
+        }
+    }
+    return merged + 1;
 }
 
-bool http_conn::add_content(const char* content)
+// 释放当前请求打开的文件：对内存映射区执行munmap操作，文件来自缓存时释放缓存项的引用，最后释放文件的元数据
+void http_conn::unmap() {
+    // 用sendfile发送的文件属于元数据缓存项，不需要关闭
+    m_file_fd = -1;
+    if( m_cache_entry )
+    {
+        file_cache::release( m_cache_entry );
+        m_cache_entry = NULL;
+        m_file_address = 0;
+    }
+    else if( m_file_address )
+    {
+        munmap( m_file_address, m_file_stat.st_size );
+        m_file_address = 0;
+    }
+    if( m_file_meta )
+    {
+        stat_cache::release( m_file_meta );
+        m_file_meta = NULL;
+    }
+}
+
+// 释放一个应答的响应体占用的资源
+void http_conn::release_response( response& r )
 {
-    return add_response("%s", content);
+    if( r.owner ) {
+        if( r.cache_entry ) {
+            file_cache::release( r.cache_entry );
+        }
+        if( r.meta ) {
+            stat_cache::release( r.meta );
+        }
+    }
+    if( r.map_addr ) {
+        munmap( r.map_addr, r.map_len );
+    }
+    r.cache_entry = NULL;
+    r.meta = NULL;
+    r.body = NULL;
+    r.map_addr = NULL;
+    r.file_fd = -1;
+    r.owner = false;
 }
 
-// 往写缓冲区写入待发送的数据
-bool http_conn::add_response(const char* format, ...)
+// 释放所有排队的应答，清空应答队列
+void http_conn::release_responses()
 {
-    if( m_write_idx >= WRITE_BUFFER_SIZE)
-    {
-        return false;
+    unmap();
+    for( int i = 0; i < m_resp_count; ++i ) {
+        release_response( m_responses[ ( m_resp_head + i ) % MAX_PIPELINE ] );
     }
-    va_list arg_list;
-    va_start(arg_list, format);
-    // vsnprintf()用于向一个字符缓冲区打印格式化字符串，且可以限定打印的格式化字符串的最大长度
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx) ) return false;
+    m_resp_head = 0;
+    m_resp_count = 0;
+    m_write_idx = 0;
+}
+
+
+
+
+#define CONTENT_ENCODING_GZIP "Content-Encoding: gzip\r\n"
+#define VARY_ACCEPT_ENCODING "Vary: Accept-Encoding\r\n"
+#define ACCEPT_RANGES_BYTES "Accept-Ranges: bytes\r\n"
+#define CACHE_CONTROL_NO_STORE "Cache-Control: no-store\r\n"
 
+// 状态行和固定的头部字段，由预先生成的模板拼成，只有Content-Length需要转换
+bool http_conn::add_headers( int status, unsigned long content_len, const char* content_type )
+{
+    int len = write_response_head( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - m_write_idx, status, content_len, m_linger, content_type );
+    if( len < 0 ) return false;
+    m_write_idx += len;
+    return true;
+}
+
+// 追加一个完整的头部字段（包括\r\n）
+bool http_conn::add_field( const char* field, int len )
+{
+    if( WRITE_BUFFER_SIZE - m_write_idx < len ) return false;
+    memcpy( m_write_buf + m_write_idx, field, len );
     m_write_idx += len;
-    va_end( arg_list);
     return true;
 }
 
+/*
+    文件应答（200、206和304）的头部。304的Content-Length等字段和200时完全一样，
+    ETag、Last-Modified让客户端之后可以发送条件请求，Cache-Control按URL前缀的规则发送
+*/
+bool http_conn::add_file_headers( int status, unsigned long content_len, const char* content_type )
+{
+    char line[ETAG_SIZE + HTTP_DATE_LEN + 32];
+    if( !add_headers( status, content_len, content_type ? content_type : m_mime ) ) return false;
+    if( status == 206 && m_range_count == 1 ) {
+        char range[CONTENT_RANGE_SIZE];
+        if( !add_field( range, write_content_range( range, m_ranges[0].first, m_ranges[0].last, m_file_stat.st_size ) ) ) return false;
+    }
+    if( !add_field( ACCEPT_RANGES_BYTES, sizeof( ACCEPT_RANGES_BYTES ) - 1 ) ) return false;
+
+    memcpy( line, "ETag: ", 6 );
+    memcpy( line + 6, m_etag, m_etag_len );
+    memcpy( line + 6 + m_etag_len, "\r\n", 2 );
+    if( !add_field( line, 6 + m_etag_len + 2 ) ) return false;
+
+    memcpy( line, "Last-Modified: ", 15 );
+    int n = 15 + format_http_date( m_file_stat.st_mtime, line + 15 );
+    memcpy( line + n, "\r\n", 2 );
+    if( !add_field( line, n + 2 ) ) return false;
+
+    // 按do_request规范化之后的路径匹配，/images/../index.html不能套用/images的规则
+    int cc_len;
+    const char* cc = cache_control_for( m_real_file + strlen( doc_root ), &cc_len );
+    if( cc && !add_field( cc, cc_len ) ) return false;
+
+    if( m_gzip && !add_field( CONTENT_ENCODING_GZIP, sizeof( CONTENT_ENCODING_GZIP ) - 1 ) ) return false;
+    if( m_vary && !add_field( VARY_ACCEPT_ENCODING, sizeof( VARY_ACCEPT_ENCODING ) - 1 ) ) return false;
+    return add_blank_line();
+}
+
+// 结束头部的空行
+bool http_conn::add_blank_line()
+{
+    if( WRITE_BUFFER_SIZE - m_write_idx < 2 ) return false;
+    memcpy( m_write_buf + m_write_idx, "\r\n", 2 );
+    m_write_idx += 2;
+    return true;
+}
+
+// 填充一个请求的HTTP应答，并把它放到应答队列的末尾
 bool http_conn::process_write(HTTP_CODE ret)
 {
+    int header_start = m_write_idx;
+    int status;
+    // 只有文件应答和统计页面需要do_request准备的内容，304和错误应答立即释放它
+    if( ret != FILE_REQUEST && ret != STATS_REQUEST ) unmap();
     switch (ret)
     {
         case INTERNAL_ERROR:   // 表示服务器内部错误
-            add_status_line( 500, error_500_title);
-            add_headers( strlen( error_500_form));
-            if( !add_content(error_500_form) ) return false;
+            status = 500;
             break;
         case BAD_REQUEST:   // 客户请求语法错误
-            add_status_line(400, error_400_title);
-            add_headers( strlen(error_400_form));
-            if( !add_content(error_400_form)) return false;
+            status = 400;
             break;
         case NO_RESOURCE:   // 表示服务器没有资源
-            add_status_line(404, error_404_title);
-            add_headers( strlen(error_403_form));
-            if( !add_content(error_404_form)) return false;
+            status = 404;
             break;
         case FORBIDDEN_REQUEST:   // 表示客户对资源没有访问的权限
-            add_status_line(403, error_403_title);
-            add_headers( strlen(error_403_form));
-            if( !add_content( error_403_form)) return false;
+            status = 403;
             break;
         case FILE_REQUEST:  // 文件请求，获取文件成功
-            // printf("YES! YES! YES!\n");
-            add_status_line(300, ok_200_title);
-            add_headers(m_file_stat.st_size);
-            m_iv[ 0 ].iov_base = m_write_buf;
-            m_iv[0].iov_len = m_write_idx;
-            m_iv[1].iov_base = m_file_address;
-            m_iv[1].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
-            
-            bytes_to_send = m_write_idx + m_file_stat.st_size;
+            m_range_count = parse_ranges();
+            if( m_range_count < 0 ) {
+                // 请求的范围都超出了文件的长度，不发送文件内容
+                long size = m_file_stat.st_size;
+                unmap();
+                char range[CONTENT_RANGE_SIZE];
+                status = 416;
+                if( !add_headers( status, 0 ) || !add_field( range, write_content_range( range, -1, 0, size ) )
+                    || !add_blank_line() ) return false;
+                new_response( header_start );
+                m_status = status;
+                return true;
+            }
+            if( m_range_count > 1 ) {
+                if( add_multipart_response() ) {
+                    m_status = 206;
+                    return true;
+                }
+                // 队列或者写缓冲区放不下这么多段，忽略Range，发送整个文件
+                m_range_count = 0;
+            }
+            if( m_range_count == 1 ) {
+                status = 206;
+                if( !add_file_headers( status, m_ranges[0].last - m_ranges[0].first + 1 ) ) return false;
+                attach_body( new_response( header_start ), m_ranges[0].first, m_ranges[0].last - m_ranges[0].first + 1, true );
+                m_status = status;
+                return true;
+            }
+            status = 200;
+            if( !add_file_headers( status, m_file_stat.st_size ) ) return false;
+            attach_body( new_response( header_start ), 0, m_file_stat.st_size, true );
+            m_status = status;
+            return true;
+        case NOT_MODIFIED:  // 客户端缓存的版本仍然有效，只发送头部，没有响应体
+            status = 304;
+            if( !add_file_headers( status, m_file_stat.st_size ) ) return false;
+            new_response( header_start );
+            m_status = status;
+            return true;
+        case STATS_REQUEST:  // 统计页面，每次访问都重新生成，不能被缓存
+            status = 200;
+            if( !add_headers( status, m_file_stat.st_size, STATS_CONTENT_TYPE )
+                || !add_field( CACHE_CONTROL_NO_STORE, sizeof( CACHE_CONTROL_NO_STORE ) - 1 ) || !add_blank_line() ) return false;
+            attach_body( new_response( header_start ), 0, m_file_stat.st_size, true );
+            m_status = status;
             return true;
         default:
             return false;
     }
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
-    bytes_to_send = m_write_idx;
+    // 错误应答是预先生成的，整个应答作为响应体发送，不占用写缓冲区
+    response& r = new_response( header_start );
+    r.body = canned_response( status, m_linger, &r.body_len );
+    m_status = status;
     return true;
-    
 }
 
-// 写HTTP响应
+/*
+    访问日志的前半行（客户端地址、请求行和状态码）在应答排队时生成，放在写缓冲区中响应头的后面，
+    不属于任何应答，不会被发送。发送完最后一个字节时再补上字节数和响应时间，写进访问日志。
+    写缓冲区放不下时这个请求不记录
+*/
+void http_conn::add_access_log( response& r )
+{
+    static const int MAX_LOG_URL = 256;
+    char addr[INET_ADDRSTRLEN];
+    if( !inet_ntop( AF_INET, &m_address.sin_addr, addr, sizeof( addr ) ) ) strcpy( addr, "-" );
+    int url_len = m_url ? strlen( m_url ) : 1;
+    if( url_len > MAX_LOG_URL ) url_len = MAX_LOG_URL;
+    int space = WRITE_BUFFER_SIZE - m_write_idx;
+    int n = snprintf( m_write_buf + m_write_idx, space, "%s \"GET %.*s\" %d", addr, url_len, m_url ? m_url : "-", m_status );
+    if( n < 0 || n >= space ) return;
+    r.log_start = m_write_idx;
+    r.log_len = n;
+    m_write_idx += n;
+}
+
+// 把写缓冲区中从header_start开始的内容作为响应头，在应答队列的末尾加入一个还没有响应体的应答
+http_conn::response& http_conn::new_response( int header_start )
+{
+    response& r = m_responses[ ( m_resp_head + m_resp_count ) % MAX_PIPELINE ];
+    r.header_start = header_start;
+    r.header_len = m_write_idx - header_start;
+    r.body = NULL;
+    r.body_len = 0;
+    r.body_offset = 0;
+    r.cache_entry = NULL;
+    r.meta = NULL;
+    r.map_addr = NULL;
+    r.map_len = 0;
+    r.file_fd = -1;
+    r.owner = false;
+    r.sent = 0;
+    r.linger = m_linger;
+    r.start_ns = 0;
+    r.log_len = 0;
+    m_resp_count++;
+    return r;
+}
+
+/*
+    把do_request准备的文件从first开始的len个字节作为应答的响应体。一个文件可以分给多个应答（多个范围），
+    只有owner持有文件的资源（缓存项和元数据的引用、mmap），发送完毕后由release_response释放，
+    它必须是最后一个用到这个文件的应答。其他应答只是引用同一块内存或者同一个文件
+*/
+void http_conn::attach_body( response& r, long first, long len, bool owner )
+{
+    r.body = m_file_address ? m_file_address + first : NULL;
+    r.body_len = len;
+    r.body_offset = first;
+    r.file_fd = m_file_fd;
+    r.owner = owner;
+    if( owner ) {
+        r.cache_entry = m_cache_entry;
+        r.meta = m_file_meta;
+        if( m_file_address && !m_cache_entry ) {
+            r.map_addr = m_file_address;
+            r.map_len = m_file_stat.st_size;
+        }
+        m_file_address = 0;
+        m_cache_entry = NULL;
+        m_file_meta = NULL;
+        m_file_fd = -1;
+    }
+}
+
+/*
+    多个范围的206应答：multipart/byteranges，每一段是一个应答队列中的应答，响应头是这一段之前的分隔行和段头部
+    （第一段前面还有整个应答的头部），响应体直接引用文件中的这一段，最后一个应答只有结束分隔行。
+    队列中的空位或者写缓冲区不够时返回false，什么也不加入
+*/
+bool http_conn::add_multipart_response()
+{
+    // 各段的分隔行和段头部先生成到局部缓冲区中，以便算出整个应答的长度
+    static const int PART_HEAD_SIZE = sizeof( "\r\n--" BYTERANGES_BOUNDARY "\r\nContent-Type: \r\n\r\n" ) + MAX_MIME_LEN + CONTENT_RANGE_SIZE;
+    char parts[ MAX_RANGES * PART_HEAD_SIZE + sizeof( "\r\n--" BYTERANGES_BOUNDARY "--\r\n" ) ];
+    int part_start[ MAX_RANGES + 2 ];
+    int n = 0;
+    unsigned long total = 0;
+    int mime_len = strlen( m_mime );
+    for( int i = 0; i < m_range_count; ++i ) {
+        part_start[i] = n;
+        static const char delim[] = "\r\n--" BYTERANGES_BOUNDARY "\r\nContent-Type: ";
+        memcpy( parts + n, delim, sizeof( delim ) - 1 );
+        n += sizeof( delim ) - 1;
+        memcpy( parts + n, m_mime, mime_len );
+        n += mime_len;
+        memcpy( parts + n, "\r\n", 2 );
+        n += 2;
+        n += write_content_range( parts + n, m_ranges[i].first, m_ranges[i].last, m_file_stat.st_size );
+        memcpy( parts + n, "\r\n", 2 );
+        n += 2;
+        total += m_ranges[i].last - m_ranges[i].first + 1;
+    }
+    part_start[m_range_count] = n;
+    static const char close_delim[] = "\r\n--" BYTERANGES_BOUNDARY "--\r\n";
+    memcpy( parts + n, close_delim, sizeof( close_delim ) - 1 );
+    n += sizeof( close_delim ) - 1;
+    part_start[m_range_count + 1] = n;
+    total += n;
+
+    int header_start = m_write_idx;
+    if( MAX_PIPELINE - m_resp_count < m_range_count + 1 || !add_file_headers( 206, total, BYTERANGES_TYPE )
+        || WRITE_BUFFER_SIZE - m_write_idx < n ) {
+        m_write_idx = header_start;
+        return false;
+    }
+    for( int i = 0; i <= m_range_count; ++i ) {
+        int start = i == 0 ? header_start : m_write_idx;
+        add_field( parts + part_start[i], part_start[i + 1] - part_start[i] );
+        response& r = new_response( start );
+        if( i < m_range_count ) {
+            attach_body( r, m_ranges[i].first, m_ranges[i].last - m_ranges[i].first + 1, i == m_range_count - 1 );
+        }
+    }
+    return true;
+}
+
+// 把排队的应答整理成iovec，遇到要用sendfile发送的文件时停下来，它之后的应答要等文件发送完
+const struct iovec* http_conn::write_iov()
+{
+    m_iv_count = 0;
+    m_iv_more = false;
+    for( int i = 0; i < m_resp_count; ++i ) {
+        response& r = m_responses[ ( m_resp_head + i ) % MAX_PIPELINE ];
+        int sent = r.sent;
+        if( sent < r.header_len ) {
+            m_iv[m_iv_count].iov_base = m_write_buf + r.header_start + sent;
+            m_iv[m_iv_count].iov_len = r.header_len - sent;
+            m_iv_count++;
+            sent = r.header_len;
+        }
+        if( r.file_fd >= 0 ) {
+            m_iv_more = sent < r.header_len + r.body_len;
+            break;
+        }
+        if( r.body && sent < r.header_len + r.body_len ) {
+            m_iv[m_iv_count].iov_base = (void*)( r.body + ( sent - r.header_len ) );
+            m_iv[m_iv_count].iov_len = r.header_len + r.body_len - sent;
+            m_iv_count++;
+        }
+    }
+    return m_iv;
+}
+
+// 已经发送了temp个字节，把发送完的应答移出队列，返回排队的应答是否已经全部发送
+bool http_conn::advance_write(int temp)
+{
+    thread_stats* stats = local_stats();
+    stats->bytes_sent.add( temp );
+    long now = 0;
+    while( temp > 0 && m_resp_count > 0 ) {
+        response& r = m_responses[m_resp_head];
+        int left = r.header_len + r.body_len - r.sent;
+        if( temp < left ) {
+            r.sent += temp;
+            break;
+        }
+        temp -= left;
+        m_request_bytes += r.header_len + r.body_len;
+        if( r.start_ns ) {
+            // 一个请求的最后一个字节发送出去了
+            if( !now ) now = monotonic_ns();
+            stats->ttlb.record( now - r.start_ns );
+            if( r.log_len ) {
+                LOG_ACCESS( "%.*s %lu %ld", r.log_len, m_write_buf + r.log_start, m_request_bytes, ( now - r.start_ns ) / 1000 );
+            }
+            m_request_bytes = 0;
+        }
+        release_response( r );
+        m_resp_head = ( m_resp_head + 1 ) % MAX_PIPELINE;
+        m_resp_count--;
+    }
+    return m_resp_count == 0;
+}
+
+// 应答全部发送完毕，根据HTTP请求中的Connection字段决定是否保持连接，返回false表示需要关闭连接
+// 读缓冲区中流水线上的后续请求保留下来，由调用者继续处理
+bool http_conn::finish_write()
+{
+    if( m_close_after ) {
+        return false;
+    }
+    m_write_idx = 0;
+    m_resp_head = 0;
+    return true;
+}
+
+// 写HTTP响应，依次发送所有排队的应答。发送完之后读缓冲区中还有后续请求时不注册任何事件，
+// 由reactor把连接交给线程池（见pipeline_pending），请求的解析和文件的读取、压缩都不在reactor线程中进行
 bool http_conn::write()
 {
-    int temp = 0;
-   
-    if( bytes_to_send == 0)
+    if( m_resp_count == 0 )
     {
-        // 将要发送的字节为0， 这一次响应结束
+        // 没有要发送的数据，等待下一个请求
         modfd(m_epollfd, m_sockfd, EPOLLIN);
-        init();
         return true;
     }
 
     while(1) {
-        // 分散写
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        if( m_resp_count == 0 ) {
+            // 发送HTTP响应成功
+            if( !finish_write() ) {
+                return false;
+            }
+            // 客户端已经发来了下一个请求，不需要再等EPOLLIN
+            if( has_pending_input() ) {
+                return true;
+            }
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            return true;
+        }
+
+        response& r = m_responses[m_resp_head];
+        if( r.file_fd >= 0 && r.sent >= r.header_len ) {
+            // 队首应答的响应头已经发出去了，用sendfile发送文件内容
+            int ret = write_file();
+            if( ret < 0 ) {
+                release_responses();
+                return false;
+            }
+            if( ret == 0 ) {
+                return true;
+            }
+            continue;
+        }
+
+        // 分散写，一次发送多个排队的应答。后面紧跟着sendfile时带上MSG_MORE，
+        // 响应头会和文件的第一段内容合并成完整的报文段发送
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = (struct iovec*)write_iov();
+        msg.msg_iovlen = m_iv_count;
+        int temp = sendmsg( m_sockfd, &msg, m_iv_more ? MSG_MORE : 0 );
         if ( temp <= -1 ) {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
@@ -498,57 +1273,127 @@ bool http_conn::write()
                 modfd( m_epollfd, m_sockfd, EPOLLOUT );
                 return true;
             }
-            unmap();
+            release_responses();
             return false;
         }
+        advance_write( temp );
+    }
+    
+}
 
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-
-        if ( bytes_have_send >= m_iv[0].iov_len ) {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
-             
+/*
+    用sendfile发送队首应答的文件内容，文件内容不经过用户空间。返回1表示发送了一部分数据，
+    0表示socket写缓冲区满了（已经注册EPOLLOUT，下一次从断点继续），-1表示出错。
+    sendfile不支持这种文件时（EINVAL/ENOSYS），改为映射文件，由writev发送剩下的内容。
+*/
+int http_conn::write_file()
+{
+    response& r = m_responses[m_resp_head];
+    off_t offset = r.body_offset + r.sent - r.header_len;
+    ssize_t temp = sendfile( m_sockfd, r.file_fd, &offset, r.header_len + r.body_len - r.sent );
+    if( temp <= -1 ) {
+        if( errno == EAGAIN ) {
+            modfd( m_epollfd, m_sockfd, EPOLLOUT );
+            return 0;
         }
-        else
-        {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
+        if( errno == EINVAL || errno == ENOSYS ) {
+            // 从文件开头映射到这个应答的最后一个字节，mmap的偏移必须按页对齐
+            size_t len = r.body_offset + r.body_len;
+            char* addr = ( char* )mmap( 0, len, PROT_READ, MAP_PRIVATE, r.file_fd, 0 );
+            r.file_fd = -1;
+            if( addr == MAP_FAILED ) {
+                return -1;
+            }
+            r.body = addr + r.body_offset;
+            r.map_addr = addr;
+            r.map_len = len;
+            return 1;
         }
+        return -1;
+    }
+    if( temp == 0 ) {
+        // 文件在stat之后被截断了，无法发送声明的长度
+        return -1;
+    }
+    advance_write( temp );
+    return 1;
+}
 
-        if(bytes_to_send <= 0)
-        {
-            // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
+/*
+    解析读缓冲区中所有完整的请求，依次把应答放入队列，不涉及任何事件注册，供不同的事件循环后端共用。
+    客户端可以不等应答就连续发送多个请求（HTTP/1.1流水线），这些请求可能在同一次recv中到达，
+    所以一个请求处理完之后，读缓冲区中剩下的数据要留给下一个请求，而不是清空。
+    队列满、写缓冲区快用完或者某个请求要求关闭连接时停下来，剩下的请求等队列中的应答发送完再处理。
+    返回NO_REQUEST表示没有完整的请求；CLOSED_CONNECTION表示无法生成应答，需要关闭连接；
+    其他情况下返回最后一个请求的处理结果，应答已经在队列中
+*/
+http_conn::HTTP_CODE http_conn::handle_request()
+{
+    HTTP_CODE last = NO_REQUEST;
+    // 队列中至少要留出一个多段应答的位置，否则下一个请求的Range只能被忽略
+    while( !m_close_after && m_resp_count <= MAX_PIPELINE - ( MAX_RANGES + 1 ) && WRITE_BUFFER_SIZE - m_write_idx >= MIN_RESPONSE_SPACE )
+    {
+        // 在请求的边界上把前面已经处理完的请求从读缓冲区中移走
+        if( m_check_state == CHECK_STATE_REQUESTLINE && m_start_line > 0 ) {
+            compact_read_buf();
+        }
+
+        // 解析 HTTP 请求
+        long start = monotonic_ns();
+        HTTP_CODE read_ret = process_read();
+        if(read_ret == NO_REQUEST) break;
+
+        // 请求有语法错误时不知道下一个请求从哪里开始，发送应答之后关闭连接
+        if( read_ret == BAD_REQUEST || read_ret == INTERNAL_ERROR ) m_linger = false;
+
+        // 生成响应
+        if( !process_write( read_ret) ) {
             unmap();
-            modfd( m_epollfd, m_sockfd, EPOLLIN );
-            if(m_linger) {
-                init();
-                return true;
-            } else {
-                return false;
-            }
+            return CLOSED_CONNECTION;
         }
+        // 这个请求的最后一个应答发送完毕时，统计从收到请求开始的响应时间，记录访问日志
+        response& last_resp = m_responses[ ( m_resp_head + m_resp_count - 1 ) % MAX_PIPELINE ];
+        last_resp.start_ns = m_recv_ns;
+        if( access_log_enabled ) add_access_log( last_resp );
+        thread_stats* stats = local_stats();
+        stats->count_request( m_status );
+        stats->handle.record( monotonic_ns() - start );
+        if( !m_linger ) m_close_after = true;
+        last = read_ret;
+        reset_request();
     }
-    
+    // 读缓冲区中的数据已经全部处理完，缓冲区还给缓冲区池，空闲的长连接不占用读缓冲区
+    if( m_check_state == CHECK_STATE_REQUESTLINE && m_start_line == m_read_index ) {
+        release_read_buf();
+    }
+    return m_resp_count > 0 ? last : NO_REQUEST;
 }
 
 // 由线程池中的工作线程调用的，这是处理HTTP请求的入口函数
 void http_conn::process()
 {
-    // 解析 HTTP 请求
-    HTTP_CODE read_ret = process_read();
-    if(read_ret == NO_REQUEST)
-    {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        return;
+    long wait = monotonic_ns() - m_queued_ns;
+    local_stats()->queue_wait.record( wait );
+    // 和CoDel一样看请求实际的排队时间而不是队列长度，队列短但处理慢时也能发现过载
+    if( m_max_queue_wait_ns > 0 ) {
+        bool slow = wait > m_max_queue_wait_ns;
+        if( slow != m_queue_slow.load( std::memory_order_relaxed ) ) {
+            m_queue_slow.store( slow, std::memory_order_relaxed );
+        }
+    }
+    HTTP_CODE ret = handle_request();
+    int ev = EPOLLOUT;
+    if(ret == NO_REQUEST) ev = EPOLLIN;
+    else if( ret == CLOSED_CONNECTION ) {
+        // 连接只能由reactor关闭。这里只shutdown，reactor收到EPOLLRDHUP后关闭连接并回收连接对象
+        shutdown( m_sockfd, SHUT_RDWR );
+        ev = EPOLLIN;
     }
 
-    // 生成响应
-    bool write_ret = process_write( read_ret);
-    if( !write_ret ) close_conn();
-
-    modfd( m_epollfd, m_sockfd, EPOLLOUT);
+    // 在连接仍然busy的时候重新注册事件。先清除busy的话，空闲定时器可能在这期间关闭连接，
+    // fd号被新的连接复用，modfd就会错误地修改新连接的事件。清除busy之后不能再访问任何成员
+    modfd( m_epollfd, m_sockfd, ev );
+    set_busy( false );
 }
 
 
@@ -11,12 +11,22 @@
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
-#include <stdarg.h>
 #include <errno.h>
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 #include "locker.h"
+#include "file_cache.h"
+#include "stat_cache.h"
+#include "buffer_pool.h"
+#include "http_header.h"
+#include "http_response.h"
+#include "stats.h"
+#include "log.h"
 #include <string.h>
 #include <time.h>
+#include <atomic>
+#include <string>
+#include <set>
 
 class util_timer;
 
@@ -24,8 +34,19 @@ class http_conn
 {
 public:
     static const int FILENAME_LEN = 200;
-    static const int READ_BUFFER_SIZE = 2048; // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024;  // 写 缓冲区的大小
+    static const int READ_BUFFER_SIZE = 2048; // 读缓冲区的初始大小，请求放不下时按级别加倍，最大到m_max_header_size
+    static const int DEFAULT_MAX_HEADER_SIZE = 64 * 1024;  // 默认的请求大小上限
+    static const int WRITE_BUFFER_SIZE = 4096;  // 写 缓冲区的大小，流水线上排队的所有应答的响应头都放在这里
+    static const int MAX_PIPELINE = 32;  // 应答队列的长度。多个范围的206应答每一段占一个位置，一个请求最多占MAX_RANGES + 1个
+    static const int MAX_HEADERS = 64;  // 一个请求最多的头部字段数，超过时返回400
+    static const int MAX_RANGES = 8;  // 一个Range请求最多的范围数，超过时忽略Range，发送整个文件
+    static const int MIN_RESPONSE_SPACE = 512;  // 写缓冲区剩余空间少于这个值时，不再处理流水线上的下一个请求
+
+    // Range请求中的一个范围，first和last都包括在内
+    struct byte_range {
+        long first;
+        long last;
+    };
 
     // HTTP请求方法，这里只支持GET
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
@@ -46,63 +67,126 @@ public:
         NO_RESOURCE         :   表示服务器没有资源
         FORBIDDEN_REQUEST   :   表示客户对资源没有足够的访问权限
         FILE_REQUEST        :   文件请求,获取文件成功
+        NOT_MODIFIED        :   文件请求，客户端缓存的版本仍然有效，不需要发送文件内容
+        STATS_REQUEST       :   统计页面/__stats，内容已经生成在匿名映射中
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, NOT_MODIFIED, STATS_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
     
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
 public:
-    http_conn() {}
+    http_conn() : timer(NULL), close_pending(false), m_sockfd(-1), m_read_buf(NULL), m_read_buf_size(0), m_read_buf_alloc(0), m_read_index(0),
+                  m_checked_index(0), m_start_line(0), m_recv_ns(0), m_queued_ns(0), m_file_address(NULL), m_cache_entry(NULL), m_file_meta(NULL), m_file_fd(-1), m_mime(NULL), m_resp_head(0), m_resp_count(0), m_busy(0) {}
     ~http_conn() {}
 
 public:
-    void init(int sockfd, const sockaddr_in &addr); // 初始化新接收的连接
+    void init(int sockfd, const sockaddr_in &addr, int epollfd); // 初始化新接收的连接
     void close_conn();  // 关闭连接
+    void release();  // 连接对象还回连接池之前，释放它占用的读缓冲区、文件映射和缓存项
     void process(); // 处理客户端的请求
     bool read(); // 非阻塞读
-    bool write(); // 非阻塞的写
+    bool write(); // 非阻塞的写，返回false表示需要关闭连接
+    // write把应答全部发送完之后，读缓冲区中还有流水线上的后续请求，连接没有重新注册事件，需要交给线程池处理
+    bool pipeline_pending() const { return m_resp_count == 0 && has_pending_input(); }
+
+    // 下面这组函数把I/O和请求处理分开，供io_uring等不通过epoll驱动连接的后端使用
+    HTTP_CODE handle_request(); // 解析读缓冲区中所有完整的请求并把应答排队，不修改epoll事件
+    bool append_read(const char* data, int len); // 追加事件循环已经收到的数据
+    const struct iovec* write_iov(); // 把排队的应答整理成iovec，返回待发送的数据
+    int write_iov_count() const { return m_iv_count; }
+    bool advance_write(int bytes); // 已发送bytes字节，返回排队的应答是否全部发送完毕
+    bool finish_write(); // 应答全部发送完毕后的处理，返回是否保持连接
+    bool has_pending_input() const { return m_start_line < m_read_index; } // 读缓冲区中是否还有没处理的数据
+    bool is_open() const { return m_sockfd != -1; } // 连接是否还没有被关闭
+    int sockfd() const { return m_sockfd; }
+    // 连接交给工作线程之前由reactor设置，工作线程处理完、重新注册epoll事件之后清除。
+    // 连接处于busy状态时reactor不能关闭它，否则连接对象会在工作线程使用期间被还回连接池
+    // 设置busy时记下时间，工作线程开始处理时统计连接在队列中等待的时间。
+    // 工作线程在重新注册事件之后才清除busy，这时reactor可能已经把连接再次交给了线程池，
+    // 所以busy是一个计数，设置和清除各自加一、减一，不会互相覆盖
+    void set_busy( bool busy ) {
+        if( busy ) {
+            m_queued_ns = monotonic_ns();
+            m_busy.fetch_add( 1, std::memory_order_release );
+        } else {
+            m_busy.fetch_sub( 1, std::memory_order_release );
+        }
+    }
+    bool busy() const { return m_busy.load( std::memory_order_acquire ) > 0; }
 
 public:
-    static int m_epollfd; // 所有的socket上的事件都被注册到同一个epoll事件中
-    static int m_user_count; // 统计用户的数量
+    static std::atomic<int> m_user_count; // 统计用户的数量
+    static file_cache* m_file_cache; // 所有连接共享的静态文件缓存，为NULL时不使用缓存
+    static file_cache* m_gzip_cache; // 文件的gzip压缩版本的缓存，以原文件的路径为键，为NULL时只发送预先压缩好的.gz文件
+    static stat_cache* m_stat_cache; // 文件元数据缓存，为NULL时每个请求都读取元数据
+    static bool m_use_sendfile; // 没有命中缓存的文件是否用sendfile发送，为false时使用mmap
+    static int m_max_header_size; // 读缓冲区的上限，请求（请求行、头部和请求体）超过这个大小时关闭连接
+    static buffer_pool m_read_pool; // 所有连接共享的读缓冲区池
+    static locker m_gzip_lock; // 保护m_gzip_inflight
+    static std::set< std::string > m_gzip_inflight; // 正在被某个工作线程压缩的文件，同一个文件只压缩一次
+    static long m_max_queue_wait_ns; // 请求在线程池队列中等待时间的上限，0表示不限制
+    // 工作线程最近取出的请求等待时间是否超过了m_max_queue_wait_ns，reactor据此拒绝新的请求。
+    // 只在状态变化时写入，单独占用缓存行，不和其他共享的变量互相干扰
+    alignas(CACHE_LINE_SIZE) static std::atomic<bool> m_queue_slow;
     util_timer* timer;          // 定时器
+    bool close_pending;         // reactor要关闭连接时工作线程还没有清除busy，由定时器在busy清除后关闭，只由reactor访问
     
 
 private:
     void init();   // 初始化连接其余的信息
+    void reset_request();  // 一个请求处理完毕，为解析流水线上的下一个请求重置解析状态
+    void compact_read_buf();  // 把还没有处理的数据移到读缓冲区开头
+    bool grow_read_buf(int need);  // 把读缓冲区扩大到至少need字节，超过上限时返回false
+    void release_read_buf();  // 读缓冲区中没有数据时把它还给缓冲区池
     HTTP_CODE process_read();  // 解析HTTP请求
     bool process_write( HTTP_CODE ret );  // 填充HTTP应答
 
     // 下面这一组函数被process_read调用以分析HTTP请求
-    HTTP_CODE parse_request_line(char *text);  // 解析请求首行
-    HTTP_CODE parse_headers(char *text);  // 解析请求头
-    HTTP_CODE parse_content(char *text);    // 解析请求体
+    HTTP_CODE parse_request_line(char *text, int len);  // 解析请求首行，len是行的长度
+    HTTP_CODE parse_headers(char *text, int len);  // 解析请求头，len是行的长度
+    HTTP_CODE parse_content();    // 跳过请求体
     HTTP_CODE do_request();
+    HTTP_CODE do_gzip_request();  // 客户端接受gzip时准备压缩过的响应体，返回NO_REQUEST表示按原样发送
+    HTTP_CODE use_gzip_entry();  // 发送压缩变体缓存中的m_cache_entry
+    file_cache::entry* compress_variant();  // 读取并压缩m_real_file，放进压缩变体缓存，失败时返回NULL
+    // 登记（claim为true）或者注销正在压缩的文件，文件已经有线程在压缩时登记失败，返回false
+    static bool claim_gzip( const char* path, bool claim );
+    HTTP_CODE do_stats_request();  // 生成统计页面
+    bool not_modified();  // 为m_file_stat生成ETag，判断客户端缓存的版本是否仍然有效
+    HTTP_CODE prepare_file( file_cache* cache, const char* key );  // 从缓存，或者用sendfile、mmap发送m_file_meta对应的文件
     char *getline() { return m_read_buf + m_start_line; }
+    // 查找当前请求的头部字段的值，没有这个字段时返回NULL。已知字段是O(1)的，其他字段按名字逐个比较
+    const char* get_header( HEADER_ID id, int* len = NULL ) const;
+    const char* find_header( const char* name, int* len = NULL ) const;
     LINE_STATUS paser_line();
 
     // 这一组函数被process_write调用以填充HTTP应答。
-    void unmap();
-    bool add_response( const char* format, ...);
-    bool add_content( const char* content);
-    bool add_content_type();
-    bool add_status_line( int stauts, const char* title);
-    bool add_headers(int content_length);
-    bool add_content_length(int content_length);
-    bool add_linger();
+    void unmap();  // 释放当前请求打开或映射的文件
+    void release_responses();  // 释放所有排队的应答占用的文件资源
+    int write_file(); // 用sendfile发送队首应答的文件内容
+    bool add_headers( int status, unsigned long content_len, const char* content_type = NULL );
+    bool add_field( const char* field, int len );
+    bool add_file_headers( int status, unsigned long content_len, const char* content_type = NULL );
+    int parse_ranges();  // 解析Range字段，返回范围数，0表示发送整个文件，-1表示范围都不满足
+    bool add_multipart_response();  // 多个范围的206应答
     bool add_blank_line();
 
 private:
     int m_sockfd;  // 该http连接的socket
+    int m_epollfd; // 该连接所属reactor的epoll对象，连接上的事件都注册到这个epoll对象中
     sockaddr_in m_address; // 通信socket地址
 
-    char m_read_buf[READ_BUFFER_SIZE]; // 读缓冲区
+    char* m_read_buf; // 读缓冲区，从m_read_pool中分配，没有数据时为NULL
+    int m_read_buf_size;  // 读缓冲区可以使用的大小
+    int m_read_buf_alloc; // 读缓冲区实际分配的大小
     int m_read_index;  // 标识读缓冲区中以及读入的客户端数据的最后一个字节的下标
     int m_checked_index; // 当前分析的字符在读缓冲区的位置
     int m_start_line;      // 当前正在解析的行的起始位置
+    long m_recv_ns;        // 最近一次收到数据的时间，作为读缓冲区中的请求的到达时间
+    long m_queued_ns;      // 连接交给线程池的时间
 
     CHECK_STATE m_check_state;  // 主状态机当前所处的状态
     METHOD m_method;  // 请求方法
@@ -110,21 +194,77 @@ private:
     char m_real_file[FILENAME_LEN]; // 客户端请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
     char * m_url;       // 请求目标文件的文件名
     char * m_version;  // 协议版本，只支持HTTP1.1
-    char * m_host; // 主机名
     int m_content_length;  // 数据体的长度
     bool m_linger;  // HTTP请求是否要保存连接
+    bool m_gzip;    // 响应体是gzip压缩过的，应答带上Content-Encoding: gzip
+    bool m_vary;    // 文件有压缩版本，应答内容取决于Accept-Encoding，带上Vary字段
+    char m_etag[ETAG_SIZE];  // 要发送的文件的ETag，由not_modified生成
+    int m_etag_len;
+    byte_range m_ranges[MAX_RANGES];  // Range请求的范围，已经排序、合并过
+    int m_range_count;  // 范围数，0表示发送整个文件
+
+    // 当前请求的头部字段表，名字和值都用在读缓冲区中的偏移表示，读缓冲区扩大后仍然有效
+    struct header {
+        int name;       // 名字的偏移
+        int name_len;
+        int value;      // 值的偏移，值已经去掉了前后的空白，以'\0'结尾
+        int value_len;
+        int id;         // HEADER_ID
+    };
+    header m_headers[MAX_HEADERS];
+    int m_header_count;
+    signed char m_known[HDR_COUNT];   // 已知字段在m_headers中的下标，没有这个字段时为-1，重复的字段以最后一个为准
     
     
     char m_write_buf[WRITE_BUFFER_SIZE];  // 写缓冲区
-    int m_write_idx;  // 写缓冲区中待发送的字节数
-    char* m_file_address;   // 客户请求的目标文件被mmap到内存中的起始位置
+    int m_write_idx;  // 写缓冲区中已经使用的字节数
+    // do_request为当前请求准备的文件，process_write把它们交给排队的应答
+    char* m_file_address;   // 客户请求的目标文件被mmap到内存中的起始位置，或者是缓存中文件内容的起始位置
+    file_cache::entry* m_cache_entry;   // 命中缓存时持有的缓存项
+    stat_cache::entry* m_file_meta;     // 要发送的文件的元数据（完整路径、stat信息和打开的文件描述符）
+    int m_file_fd;          // 用sendfile发送时的目标文件，属于m_file_meta
+    const char* m_mime;     // 目标文件的MIME类型
     struct stat m_file_stat;
-    struct iovec m_iv[2];  // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示写内存块的数量
-    int m_iv_count;
 
-    int bytes_to_send;  // 将要发送的数据的字节数
-    int bytes_have_send;   // 已经发送的字节数
+    /*
+        流水线上排队等待发送的应答，按请求的顺序发送。每个应答由写缓冲区中的一段（响应头，错误页面的内容
+        也直接写在这里）和一个可选的响应体组成，响应体来自缓存、mmap或者用sendfile从文件发送
+    */
+    struct response {
+        int header_start;       // 响应头在m_write_buf中的位置
+        int header_len;
+        const char* body;       // 内存中的响应体（缓存、mmap或者预先生成的错误应答），没有时为NULL
+        int body_len;           // 响应体的长度，包括用sendfile发送的文件
+        long body_offset;       // 响应体在文件中的偏移，Range请求时不为0
+        file_cache::entry* cache_entry;   // 响应体来自缓存时持有的引用，发送完毕后释放
+        stat_cache::entry* meta;          // 文件的元数据，持有sendfile使用的文件描述符，发送完毕后释放
+        void* map_addr;         // 响应体所在的mmap区域，发送完毕后munmap
+        size_t map_len;
+        int file_fd;            // 用sendfile发送的文件，属于meta
+        bool owner;             // 这个应答持有cache_entry、meta和map_addr，发送完毕后释放。一个文件分成多段发送时只有最后一段持有
+        int sent;               // 已经发送的字节数（响应头加响应体）
+        bool linger;            // 发送完毕后是否保持连接
+        long start_ns;          // 请求的到达时间，只有一个请求的最后一个应答不为0，发送完毕时统计响应时间
+        int log_start;          // 访问日志中这个请求的前半行（地址、请求行和状态码）在m_write_buf中的位置
+        int log_len;            // 为0时不记录访问日志
+    };
+    void release_response( response& r );
+    response& new_response( int header_start );
+    void attach_body( response& r, long first, long len, bool owner );
+    response m_responses[MAX_PIPELINE];
+    int m_resp_head;    // 队首应答的下标
+    int m_resp_count;   // 排队的应答数
+    bool m_close_after;  // 队列中最后一个应答要求发送完毕后关闭连接，之后的请求不再处理
+    int m_status;        // 最近一个应答的状态码
+    unsigned long m_request_bytes;  // 队首请求已经发送完毕的应答的字节数，记在访问日志中
+    void add_access_log( response& r );
+
+    // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示写内存块的数量
+    struct iovec m_iv[MAX_PIPELINE * 2];
+    int m_iv_count;
+    bool m_iv_more;     // m_iv之后还有要用sendfile发送的数据，发送时带上MSG_MORE
 
+    std::atomic<int> m_busy;    // 连接正在被工作线程处理或者在线程池队列中（次数）
 };
 
 
@@ -242,7 +382,7 @@ public:
         if( !head ) {
             return;
         }
-        printf( "timer tick\n" );
+        LOG_DEBUG( "timer tick" );
         time_t cur = time( NULL );  // 获取当前系统时间
         util_timer* tmp = head;
         // 从头节点开始依次处理每个定时器，直到遇到一个尚未到期的定时器
@@ -253,6 +393,7 @@ public:
                 break;
             }
             // 调用定时器的回调函数，以执行定时任务
+            tmp->user_data->timer = NULL;
             tmp->user_data->close_conn();
             // 执行完定时器中的定时任务之后，就将它从链表中删除，并重置链表头节点
             head = tmp->next;
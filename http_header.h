@@ -0,0 +1,117 @@
+#ifndef HTTP_HEADER_H
+#define HTTP_HEADER_H
+
+#include <strings.h>
+
+/*
+    请求头部字段表。解析器把每个头部字段记录成(名字, 值)在读缓冲区中的偏移和长度，不复制任何数据，
+    处理函数可以按名字查找任意字段。记录偏移而不是指针，读缓冲区扩大（换成更大的缓冲区）之后仍然有效。
+
+    常用的字段在编译期用完美哈希映射到HEADER_ID：哈希值只取决于名字的长度、第一个字符和最后一个字符
+    （不区分大小写），每个已知字段落在HEADER_HASH_SIZE个槽中不同的槽里，static_assert保证没有冲突。
+    解析一行只需要算一次哈希、比较一次名字，再多的已知字段也不会增加比较次数，
+    查找已知字段的值是O(1)的数组访问。新增字段时如果发生冲突，编译会失败，需要调整header_hash中的系数。
+*/
+
+enum HEADER_ID {
+    HDR_UNKNOWN = 0,
+    HDR_HOST,
+    HDR_CONNECTION,
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_TRANSFER_ENCODING,
+    HDR_RANGE,
+    HDR_IF_RANGE,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_ACCEPT,
+    HDR_ACCEPT_ENCODING,
+    HDR_ACCEPT_LANGUAGE,
+    HDR_USER_AGENT,
+    HDR_COOKIE,
+    HDR_REFERER,
+    HDR_CACHE_CONTROL,
+    HDR_EXPECT,
+    HDR_UPGRADE,
+    HDR_PRAGMA,
+    HDR_AUTHORIZATION,
+    HDR_COUNT
+};
+
+// 已知字段的名字（小写），下标是HEADER_ID
+static constexpr const char* header_names[HDR_COUNT] = {
+    "",
+    "host",
+    "connection",
+    "content-length",
+    "content-type",
+    "transfer-encoding",
+    "range",
+    "if-range",
+    "if-none-match",
+    "if-modified-since",
+    "accept",
+    "accept-encoding",
+    "accept-language",
+    "user-agent",
+    "cookie",
+    "referer",
+    "cache-control",
+    "expect",
+    "upgrade",
+    "pragma",
+    "authorization",
+};
+
+static const int HEADER_HASH_SIZE = 64;
+
+constexpr int header_name_len( const char* s ) {
+    return *s ? 1 + header_name_len( s + 1 ) : 0;
+}
+
+// 名字的哈希值，|0x20把大写字母转成小写，对'-'和数字没有影响
+constexpr int header_hash( const char* name, int len ) {
+    return ( len + ( ( name[0] | 0x20 ) << 2 ) + ( name[len - 1] | 0x20 ) ) & ( HEADER_HASH_SIZE - 1 );
+}
+
+// 哈希槽到HEADER_ID的映射和各个名字的长度，在编译期生成
+struct header_slots {
+    unsigned char id[HEADER_HASH_SIZE];
+    unsigned char len[HDR_COUNT];
+};
+
+constexpr header_slots make_header_slots() {
+    header_slots s = {};
+    for( int i = 1; i < HDR_COUNT; ++i ) {
+        s.len[i] = header_name_len( header_names[i] );
+        s.id[ header_hash( header_names[i], s.len[i] ) ] = i;
+    }
+    return s;
+}
+
+static constexpr header_slots header_slot_table = make_header_slots();
+
+// 每个已知字段都能通过自己的槽找回自己，说明没有两个字段落在同一个槽中
+constexpr bool header_hash_is_perfect() {
+    for( int i = 1; i < HDR_COUNT; ++i ) {
+        if( header_slot_table.id[ header_hash( header_names[i], header_slot_table.len[i] ) ] != i ) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert( header_hash_is_perfect(), "header_hash has collisions, adjust its coefficients" );
+
+// 查找名字对应的HEADER_ID，不是已知字段时返回HDR_UNKNOWN
+inline HEADER_ID lookup_header( const char* name, int len ) {
+    if( len <= 0 ) {
+        return HDR_UNKNOWN;
+    }
+    int id = header_slot_table.id[ header_hash( name, len ) ];
+    if( id == HDR_UNKNOWN || header_slot_table.len[id] != len || strncasecmp( name, header_names[id], len ) != 0 ) {
+        return HDR_UNKNOWN;
+    }
+    return (HEADER_ID)id;
+}
+
+#endif
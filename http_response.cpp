@@ -0,0 +1,431 @@
+#include "http_response.h"
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string>
+#include <vector>
+
+// 定义HTTP响应的一些状态信息
+#define ERROR_400_FORM "Your request has bad syntax or is inherently impossible to satisfy.\n"
+#define ERROR_403_FORM "You do not have permission to get file from this server.\n"
+#define ERROR_404_FORM "The requested file was not found on this server.\n"
+#define ERROR_500_FORM "There was an unusual problem serving the requested file.\n"
+#define ERROR_503_FORM "The server is overloaded, please try again later.\n"
+// 过载时的503应答告诉客户端多久之后再重试（秒）
+#define RETRY_AFTER_FIELD "Retry-After: 1\r\n"
+
+// 状态行加上Content-Length字段的名字
+#define RESPONSE_HEAD( status, title ) "HTTP/1.1 " #status " " title "\r\nContent-Length: "
+
+struct response_head {
+    int status;
+    const char* head;
+    int head_len;
+    const char* form;   // 错误应答的正文，正常应答为NULL
+    int form_len;
+};
+
+#define HEAD( status, title ) status, RESPONSE_HEAD( status, title ), sizeof( RESPONSE_HEAD( status, title ) ) - 1
+
+static const response_head heads[] = {
+    { HEAD( 200, "OK" ), NULL, 0 },
+    { HEAD( 206, "Partial Content" ), NULL, 0 },
+    { HEAD( 304, "Not Modified" ), NULL, 0 },
+    { HEAD( 400, "Bad Request" ), ERROR_400_FORM, sizeof( ERROR_400_FORM ) - 1 },
+    { HEAD( 403, "Forbidden" ), ERROR_403_FORM, sizeof( ERROR_403_FORM ) - 1 },
+    { HEAD( 404, "Not Found" ), ERROR_404_FORM, sizeof( ERROR_404_FORM ) - 1 },
+    { HEAD( 416, "Range Not Satisfiable" ), NULL, 0 },
+    { HEAD( 500, "Internal Error" ), ERROR_500_FORM, sizeof( ERROR_500_FORM ) - 1 },
+    { HEAD( 503, "Service Unavailable" ), ERROR_503_FORM, sizeof( ERROR_503_FORM ) - 1 },
+};
+static const int HEAD_COUNT = sizeof( heads ) / sizeof( heads[0] );
+
+// Content-Length的值之后的固定字段，下标是是否保持连接
+#define RESPONSE_TAIL( conn ) "\r\nContent-Type: text/html\r\nConnection: " conn "\r\n"
+static const char* const tails[2] = { RESPONSE_TAIL( "close" ), RESPONSE_TAIL( "keep-alive" ) };
+static const int tail_lens[2] = { sizeof( RESPONSE_TAIL( "close" ) ) - 1, sizeof( RESPONSE_TAIL( "keep-alive" ) ) - 1 };
+// 其他Content-Type时，类型之后的Connection字段
+#define CONNECTION_TAIL( conn ) "\r\nConnection: " conn "\r\n"
+static const char* const conn_tails[2] = { CONNECTION_TAIL( "close" ), CONNECTION_TAIL( "keep-alive" ) };
+static const int conn_tail_lens[2] = { sizeof( CONNECTION_TAIL( "close" ) ) - 1, sizeof( CONNECTION_TAIL( "keep-alive" ) ) - 1 };
+
+static const response_head* find_head( int status )
+{
+    for( int i = 0; i < HEAD_COUNT; ++i ) {
+        if( heads[i].status == status ) {
+            return &heads[i];
+        }
+    }
+    return NULL;
+}
+
+// 00~99的两位数字，每次转换两位
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+int fast_utoa( unsigned long v, char* buf )
+{
+    char tmp[20];
+    char* p = tmp + sizeof( tmp );
+    while( v >= 100 ) {
+        const char* d = digit_pairs + ( v % 100 ) * 2;
+        v /= 100;
+        *--p = d[1];
+        *--p = d[0];
+    }
+    if( v >= 10 ) {
+        const char* d = digit_pairs + v * 2;
+        *--p = d[1];
+        *--p = d[0];
+    } else {
+        *--p = (char)( '0' + v );
+    }
+    int len = tmp + sizeof( tmp ) - p;
+    memcpy( buf, p, len );
+    return len;
+}
+
+int write_response_head( char* buf, int size, int status, unsigned long content_len, bool linger, const char* content_type )
+{
+    const response_head* h = find_head( status );
+    int type_len = content_type ? strlen( content_type ) : 0;
+    int tail_len = content_type ? sizeof( "\r\nContent-Type: " ) - 1 + type_len + conn_tail_lens[linger] : tail_lens[linger];
+    if( !h || size < h->head_len + 20 + tail_len ) {
+        return -1;
+    }
+    char* p = buf;
+    memcpy( p, h->head, h->head_len );
+    p += h->head_len;
+    p += fast_utoa( content_len, p );
+    if( !content_type ) {
+        memcpy( p, tails[linger], tail_lens[linger] );
+        p += tail_lens[linger];
+        return p - buf;
+    }
+    memcpy( p, "\r\nContent-Type: ", sizeof( "\r\nContent-Type: " ) - 1 );
+    p += sizeof( "\r\nContent-Type: " ) - 1;
+    memcpy( p, content_type, type_len );
+    p += type_len;
+    memcpy( p, conn_tails[linger], conn_tail_lens[linger] );
+    p += conn_tail_lens[linger];
+    return p - buf;
+}
+
+/*
+    错误应答在程序启动时生成，每个状态码按是否保持连接各有一份。
+    最长的一个应答也只有两百多字节，CANNED_SIZE留足了余量
+*/
+static const int CANNED_SIZE = 512;
+
+struct canned_table {
+    char data[HEAD_COUNT][2][CANNED_SIZE];
+    int len[HEAD_COUNT][2];
+
+    canned_table() {
+        for( int i = 0; i < HEAD_COUNT; ++i ) {
+            for( int linger = 0; linger < 2; ++linger ) {
+                len[i][linger] = 0;
+                if( !heads[i].form ) continue;
+                char* p = data[i][linger];
+                int n = write_response_head( p, CANNED_SIZE, heads[i].status, heads[i].form_len, linger );
+                if( heads[i].status == 503 ) {
+                    memcpy( p + n, RETRY_AFTER_FIELD, sizeof( RETRY_AFTER_FIELD ) - 1 );
+                    n += sizeof( RETRY_AFTER_FIELD ) - 1;
+                }
+                memcpy( p + n, "\r\n", 2 );
+                n += 2;
+                memcpy( p + n, heads[i].form, heads[i].form_len );
+                len[i][linger] = n + heads[i].form_len;
+            }
+        }
+    }
+};
+
+static const canned_table canned;
+
+const char* canned_response( int status, bool linger, int* len )
+{
+    const response_head* h = find_head( status );
+    if( !h || !h->form ) {
+        return NULL;
+    }
+    int i = h - heads;
+    *len = canned.len[i][linger];
+    return canned.data[i][linger];
+}
+
+static const char* const week_days[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char* const months[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static char* put2( char* p, int v )
+{
+    memcpy( p, digit_pairs + v * 2, 2 );
+    return p + 2;
+}
+
+int format_http_date( time_t t, char* buf )
+{
+    struct tm tm;
+    gmtime_r( &t, &tm );
+    char* p = buf;
+    memcpy( p, week_days[tm.tm_wday], 3 );
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    p = put2( p, tm.tm_mday );
+    *p++ = ' ';
+    memcpy( p, months[tm.tm_mon], 3 );
+    p += 3;
+    *p++ = ' ';
+    int year = tm.tm_year + 1900;
+    p = put2( p, year / 100 % 100 );
+    p = put2( p, year % 100 );
+    *p++ = ' ';
+    p = put2( p, tm.tm_hour );
+    *p++ = ':';
+    p = put2( p, tm.tm_min );
+    *p++ = ':';
+    p = put2( p, tm.tm_sec );
+    memcpy( p, " GMT", 4 );
+    return HTTP_DATE_LEN;
+}
+
+// 读n位十进制数字，不是数字时返回-1
+static int get_digits( const char* p, int n )
+{
+    int v = 0;
+    for( int i = 0; i < n; ++i ) {
+        if( p[i] < '0' || p[i] > '9' ) return -1;
+        v = v * 10 + ( p[i] - '0' );
+    }
+    return v;
+}
+
+time_t parse_http_date( const char* s, int len )
+{
+    // Sun, 06 Nov 1994 08:49:37 GMT，星期只检查格式，不检查和日期是否一致
+    if( len != HTTP_DATE_LEN || s[3] != ',' || s[4] != ' ' || s[7] != ' ' || s[11] != ' ' || s[16] != ' '
+        || s[19] != ':' || s[22] != ':' || memcmp( s + 25, " GMT", 4 ) != 0 ) {
+        return -1;
+    }
+    struct tm tm;
+    memset( &tm, 0, sizeof( tm ) );
+    tm.tm_mon = -1;
+    for( int i = 0; i < 12; ++i ) {
+        if( memcmp( s + 8, months[i], 3 ) == 0 ) {
+            tm.tm_mon = i;
+            break;
+        }
+    }
+    tm.tm_mday = get_digits( s + 5, 2 );
+    tm.tm_year = get_digits( s + 12, 4 ) - 1900;
+    tm.tm_hour = get_digits( s + 17, 2 );
+    tm.tm_min = get_digits( s + 20, 2 );
+    tm.tm_sec = get_digits( s + 23, 2 );
+    if( tm.tm_mon < 0 || tm.tm_mday < 1 || tm.tm_year < 0 || tm.tm_hour < 0 || tm.tm_min < 0 || tm.tm_sec < 0 ) {
+        return -1;
+    }
+    return timegm( &tm );
+}
+
+static char* put_hex( char* p, unsigned long v )
+{
+    char tmp[16];
+    int n = 0;
+    do {
+        tmp[n++] = "0123456789abcdef"[v & 15];
+        v >>= 4;
+    } while( v );
+    while( n ) *p++ = tmp[--n];
+    return p;
+}
+
+int make_etag( const struct stat& st, bool gzip, char* buf )
+{
+    // "inode-size-mtime"，每项最多16位十六进制数，加上引号、分隔符和-gz不超过ETAG_SIZE
+    char* p = buf;
+    *p++ = '"';
+    p = put_hex( p, st.st_ino );
+    *p++ = '-';
+    p = put_hex( p, st.st_size );
+    *p++ = '-';
+    p = put_hex( p, st.st_mtime );
+    if( gzip ) {
+        memcpy( p, "-gz", 3 );
+        p += 3;
+    }
+    *p++ = '"';
+    return p - buf;
+}
+
+bool etag_matches( const char* list, int len, const char* etag, int etag_len )
+{
+    const char* p = list;
+    const char* end = list + len;
+    while( p < end ) {
+        while( p < end && ( *p == ' ' || *p == '\t' || *p == ',' ) ) ++p;
+        if( p == end ) break;
+        if( *p == '*' ) return true;
+        if( end - p >= 2 && p[0] == 'W' && p[1] == '/' ) p += 2;
+        const char* tag_end = (const char*)memchr( p, ',', end - p );
+        if( !tag_end ) tag_end = end;
+        const char* e = tag_end;
+        while( e > p && ( e[-1] == ' ' || e[-1] == '\t' ) ) --e;
+        if( e - p == etag_len && memcmp( p, etag, etag_len ) == 0 ) return true;
+        p = tag_end;
+    }
+    return false;
+}
+
+int write_content_range( char* buf, long first, long last, long size )
+{
+    char* p = buf;
+    memcpy( p, "Content-Range: bytes ", 21 );
+    p += 21;
+    if( first < 0 ) {
+        *p++ = '*';
+    } else {
+        p += fast_utoa( first, p );
+        *p++ = '-';
+        p += fast_utoa( last, p );
+    }
+    *p++ = '/';
+    p += fast_utoa( size, p );
+    memcpy( p, "\r\n", 2 );
+    return p + 2 - buf;
+}
+
+const char* mime_type( const char* path )
+{
+    static const struct {
+        const char* ext;
+        const char* type;
+    } types[] = {
+        { "html", "text/html" },
+        { "htm", "text/html" },
+        { "css", "text/css" },
+        { "js", "application/javascript" },
+        { "json", "application/json" },
+        { "txt", "text/plain" },
+        { "xml", "application/xml" },
+        { "svg", "image/svg+xml" },
+        { "jpg", "image/jpeg" },
+        { "jpeg", "image/jpeg" },
+        { "png", "image/png" },
+        { "gif", "image/gif" },
+        { "ico", "image/x-icon" },
+        { "webp", "image/webp" },
+        { "pdf", "application/pdf" },
+        { "mp4", "video/mp4" },
+        { "woff2", "font/woff2" },
+        { "wasm", "application/wasm" },
+        { "gz", "application/gzip" },
+    };
+    const char* dot = strrchr( path, '.' );
+    if( dot && !strchr( dot, '/' ) ) {
+        for( size_t i = 0; i < sizeof( types ) / sizeof( types[0] ); ++i ) {
+            if( strcasecmp( dot + 1, types[i].ext ) == 0 ) {
+                return types[i].type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+bool normalize_url( const char* url, char* out, int size )
+{
+    char* o = out;
+    char* end = out + size - 1;     // 留一个字节给'\0'
+    const char* p = url;
+    bool dir = true;    // 最后一段是空的、"."或者".."，规范化之后的路径以'/'结尾
+    while( *p && *p != '?' && *p != '#' ) {
+        // 每次处理一个路径段
+        while( *p == '/' ) ++p;
+        const char* seg = p;
+        while( *p && *p != '/' && *p != '?' && *p != '#' ) ++p;
+        int len = p - seg;
+        dir = true;
+        if( len == 0 || ( len == 1 && seg[0] == '.' ) ) {
+            continue;
+        }
+        if( len == 2 && seg[0] == '.' && seg[1] == '.' ) {
+            if( o == out ) return false;
+            while( o > out && *--o != '/' ) {}
+            continue;
+        }
+        if( end - o < len + 1 ) return false;
+        *o++ = '/';
+        memcpy( o, seg, len );
+        o += len;
+        dir = false;
+    }
+    if( dir ) {
+        if( end - o < 1 ) return false;
+        *o++ = '/';
+    }
+    *o = '\0';
+    return true;
+}
+
+struct cache_control_rule {
+    std::string prefix;
+    std::string field;  // 完整的Cache-Control字段
+};
+static std::vector< cache_control_rule > cache_control_rules;
+
+bool add_cache_control_rule( const char* spec )
+{
+    const char* eq = strrchr( spec, '=' );
+    if( !eq || eq == spec || spec[0] != '/' ) {
+        return false;
+    }
+    char* end;
+    long max_age = strtol( eq + 1, &end, 10 );
+    if( end == eq + 1 || max_age < 0 ) {
+        return false;
+    }
+    bool immutable = false;
+    if( *end == ',' && strcasecmp( end + 1, "immutable" ) == 0 ) {
+        immutable = true;
+    } else if( *end != '\0' ) {
+        return false;
+    }
+    cache_control_rule rule;
+    rule.prefix.assign( spec, eq - spec );
+    char value[64];
+    value[ fast_utoa( max_age, value ) ] = '\0';
+    rule.field = std::string( "Cache-Control: max-age=" ) + value + ( immutable ? ", immutable" : "" ) + "\r\n";
+    cache_control_rules.push_back( rule );
+    return true;
+}
+
+const char* cache_control_for( const char* path, int* len )
+{
+    const cache_control_rule* best = NULL;
+    for( size_t i = 0; i < cache_control_rules.size(); ++i ) {
+        const cache_control_rule& r = cache_control_rules[i];
+        size_t n = r.prefix.size();
+        if( ( best && n <= best->prefix.size() ) || strncmp( path, r.prefix.data(), n ) != 0 ) {
+            continue;
+        }
+        // 前缀必须在路径段的边界上结束，/images只匹配/images和/images/...，不匹配/imagesfoo
+        if( r.prefix[n - 1] == '/' || path[n] == '\0' || path[n] == '/' ) {
+            best = &r;
+        }
+    }
+    if( !best ) {
+        return NULL;
+    }
+    *len = best->field.size();
+    return best->field.data();
+}
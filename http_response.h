@@ -0,0 +1,75 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <time.h>
+#include <sys/stat.h>
+
+/*
+    预先生成的HTTP应答头部，代替每个字段一次vsnprintf的add_response。
+    1. 状态行和"Content-Length: "连在一起，是按状态码编译期生成的字符串常量
+    2. Content-Length的值用fast_utoa转换
+    3. Content-Type和Connection字段是按是否保持连接编译期生成的字符串常量
+    生成一个应答头部只需要两次memcpy和一次整数转换。
+    400、403、404、500、503这几个错误应答的头部和正文都是固定的，程序启动时一次性生成完整的应答，
+    发送时直接引用，不需要复制到连接的写缓冲区。503是过载时reactor直接回答的，带有Retry-After字段。
+*/
+
+// 把v转换成十进制字符串写入buf（不加'\0'），返回写入的字节数，buf至少要有20个字节
+int fast_utoa( unsigned long v, char* buf );
+
+// 写入状态行、Content-Length、Content-Type和Connection字段（不包括结束头部的空行），
+// 返回写入的字节数，size不够或者不认识status时返回-1。content_type为NULL时是text/html
+int write_response_head( char* buf, int size, int status, unsigned long content_len, bool linger, const char* content_type = NULL );
+
+// 完整的错误应答（头部和正文），不是预先生成的状态码时返回NULL
+const char* canned_response( int status, bool linger, int* len );
+
+/*
+    缓存验证。ETag由文件的inode、大小和修改时间生成，文件被替换或者修改之后一定会变，
+    同一个文件的gzip版本加上-gz后缀，和原文件是不同的实体。
+    If-None-Match匹配或者（没有If-None-Match时）文件在If-Modified-Since之后没有修改过，返回304。
+*/
+static const int HTTP_DATE_LEN = 29;    // Sun, 06 Nov 1994 08:49:37 GMT
+static const int ETAG_SIZE = 64;
+
+// 把t格式化成HTTP日期写入buf（不加'\0'），返回HTTP_DATE_LEN
+int format_http_date( time_t t, char* buf );
+// 解析IMF-fixdate格式的HTTP日期，格式不对时返回-1
+time_t parse_http_date( const char* s, int len );
+// 生成带引号的实体标签写入buf（不加'\0'），buf至少要有ETAG_SIZE个字节，返回长度
+int make_etag( const struct stat& st, bool gzip, char* buf );
+// If-None-Match的值（*或者逗号分隔的实体标签列表）中是否有和etag匹配的，按弱比较，忽略W/前缀
+bool etag_matches( const char* list, int len, const char* etag, int etag_len );
+
+/*
+    Range请求。多个范围的应答是multipart/byteranges，每一段之前是分隔行和这一段的Content-Type、Content-Range，
+    最后是结束分隔行。这些分隔部分很短，写在写缓冲区中，各段的内容直接从文件（缓存、mmap或者sendfile）发送
+*/
+#define BYTERANGES_BOUNDARY "3d6b6a416f9b5webserver"
+#define BYTERANGES_TYPE "multipart/byteranges; boundary=" BYTERANGES_BOUNDARY
+static const int CONTENT_RANGE_SIZE = 96;
+
+// 写入"Content-Range: bytes first-last/size\r\n"，first小于0时写入不满足的范围"bytes */size"，
+// buf至少要有CONTENT_RANGE_SIZE个字节，返回写入的字节数
+int write_content_range( char* buf, long first, long last, long size );
+
+static const int MAX_MIME_LEN = 32;     // mime_type返回的类型最长的长度
+// 按扩展名得到文件的MIME类型，不认识的扩展名是application/octet-stream
+const char* mime_type( const char* path );
+
+// 把请求的URL规范化成以'/'开头的路径写入out：去掉查询字符串，合并连续的'/'，处理"."和".."。
+// ".."越过根目录或者out放不下时返回false
+bool normalize_url( const char* url, char* out, int size );
+
+/*
+    按URL前缀配置的Cache-Control规则，格式是"前缀=max-age[,immutable]"，比如
+    "/static/=31536000,immutable"。规则和规范化之后的路径（见normalize_url）比较，前缀要在路径段的边界上结束，
+    多条规则匹配时取最长的前缀，没有规则匹配时不发送Cache-Control。
+    规则在启动时加入，之后只读，不需要加锁
+*/
+// 加入一条规则，格式不对时返回false
+bool add_cache_control_rule( const char* spec );
+// 规范化之后的路径path对应的完整的Cache-Control字段（包括\r\n），没有规则匹配时返回NULL
+const char* cache_control_for( const char* path, int* len );
+
+#endif
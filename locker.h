@@ -4,6 +4,11 @@
 #include <pthread.h>
 #include <exception>
 #include <semaphore.h>
+#include <atomic>
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 // 线程同步机制分装类
 
@@ -78,6 +83,52 @@ private:
 };
 
 
+/*
+    基于futex的事件计数器，用来让线程在某个条件上睡眠，条件本身由调用者用原子变量维护。
+    等待方先调用prepare_wait取得当前计数，然后再检查一次条件，条件仍不满足才调用wait睡眠；
+    通知方在条件改变后调用notify_one或notify_all。如果在prepare_wait之后有通知，计数已经改变，
+    wait会立即返回，所以不会丢失唤醒。
+    和eventfd不同，notify_one只唤醒一个睡眠的线程，不会把所有线程都叫醒去争抢同一个事件。
+*/
+class event_count{
+public:
+    event_count() : m_seq(0) {}
+
+    int prepare_wait()
+    {
+        return m_seq.load(std::memory_order_acquire);
+    }
+
+    void wait(int key)
+    {
+        syscall(SYS_futex, &m_seq, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+    }
+
+    // 和wait一样，但最多睡眠timeout_ms毫秒
+    void wait_for(int key, long timeout_ms)
+    {
+        struct timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        syscall(SYS_futex, &m_seq, FUTEX_WAIT_PRIVATE, key, &ts, NULL, 0);
+    }
+
+    void notify_one()
+    {
+        m_seq.fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, &m_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+
+    void notify_all()
+    {
+        m_seq.fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, &m_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+
+private:
+    std::atomic<int> m_seq;
+};
+
 // 信号量类
 class sem{
 public:
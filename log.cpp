@@ -0,0 +1,313 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <atomic>
+#include "locker.h"
+#include "mpmc_queue.h"
+
+int log_level = LOG_LEVEL_INFO;
+bool access_log_enabled = false;
+
+enum { CHANNEL_LOG = 0, CHANNEL_ACCESS, CHANNEL_WRAP };
+
+// 缓冲区中每条记录的头部，后面紧跟着len字节的日志行（不带换行），整条记录按8字节对齐
+struct log_record {
+    uint16_t len;
+    uint8_t channel;    // CHANNEL_WRAP表示缓冲区末尾放不下下一条记录，从缓冲区开头继续
+    uint8_t level;
+    uint32_t pad;
+    long time_us;       // 写入时的时间（CLOCK_REALTIME，微秒），由写线程格式化
+};
+
+/*
+    一个线程的环形缓冲区。head和tail都是一直增加的字节位置，对LOG_RING_SIZE取模得到在buf中的偏移。
+    只有所属的线程移动tail，只有写线程移动head，分别放在不同的缓存行中
+*/
+struct log_ring {
+    char* buf;
+    log_ring* next;
+    unsigned long last_dropped;     // 写线程已经报告过的丢弃行数
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;
+    std::atomic<unsigned long> dropped;
+};
+
+static __thread log_ring* t_log_ring = NULL;
+static locker rings_lock;               // 只在注册新线程的缓冲区时使用
+static std::atomic<log_ring*> rings_head( NULL );
+
+static pthread_t writer_tid;
+static bool writer_running = false;
+static std::atomic<bool> writer_stop( false );
+static event_count writer_wakeup;
+
+static log_ring* register_ring()
+{
+    log_ring* r = new log_ring;
+    r->buf = ( char* )malloc( LOG_RING_SIZE );
+    if( !r->buf ) {
+        delete r;
+        return NULL;
+    }
+    r->last_dropped = 0;
+    r->head.store( 0, std::memory_order_relaxed );
+    r->tail.store( 0, std::memory_order_relaxed );
+    r->dropped.store( 0, std::memory_order_relaxed );
+    rings_lock.lock();
+    r->next = rings_head.load( std::memory_order_relaxed );
+    rings_head.store( r, std::memory_order_release );
+    rings_lock.unlock();
+    t_log_ring = r;
+    return r;
+}
+
+// 把一行日志放进当前线程的缓冲区
+static void log_push( int channel, int level, const char* text, int len )
+{
+    log_ring* r = t_log_ring ? t_log_ring : register_ring();
+    if( !r ) return;
+
+    size_t rec = ( sizeof( log_record ) + len + 7 ) & ~(size_t)7;
+    size_t tail = r->tail.load( std::memory_order_relaxed );
+    size_t head = r->head.load( std::memory_order_acquire );
+    size_t off = tail & ( LOG_RING_SIZE - 1 );
+    size_t contiguous = LOG_RING_SIZE - off;
+    size_t need = rec <= contiguous ? rec : contiguous + rec;
+    if( tail + need - head > LOG_RING_SIZE ) {
+        r->dropped.store( r->dropped.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+        return;
+    }
+    size_t used = tail - head;
+    if( rec > contiguous ) {
+        // 记录都按8字节对齐，末尾至少还有8个字节，放得下channel
+        r->buf[off + offsetof( log_record, channel )] = CHANNEL_WRAP;
+        tail += contiguous;
+        off = 0;
+    }
+
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    log_record* h = ( log_record* )( r->buf + off );
+    h->len = len;
+    h->channel = channel;
+    h->level = level;
+    h->time_us = ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+    memcpy( h + 1, text, len );
+    r->tail.store( tail + rec, std::memory_order_release );
+
+    // 缓冲区刚超过一半，不等写线程自己醒来
+    if( used < LOG_RING_SIZE / 2 && used + need >= LOG_RING_SIZE / 2 ) {
+        writer_wakeup.notify_one();
+    }
+}
+
+static int format_line( char* line, const char* fmt, va_list ap )
+{
+    int n = vsnprintf( line, LOG_LINE_MAX, fmt, ap );
+    if( n < 0 ) return -1;
+    if( n >= LOG_LINE_MAX ) n = LOG_LINE_MAX - 1;
+    // 换行由写线程统一加上
+    while( n > 0 && line[n - 1] == '\n' ) n--;
+    return n;
+}
+
+void log_write( int level, const char* fmt, ... )
+{
+    char line[LOG_LINE_MAX];
+    va_list ap;
+    va_start( ap, fmt );
+    int n = format_line( line, fmt, ap );
+    va_end( ap );
+    if( n >= 0 ) log_push( CHANNEL_LOG, level, line, n );
+}
+
+void log_access( const char* fmt, ... )
+{
+    char line[LOG_LINE_MAX];
+    va_list ap;
+    va_start( ap, fmt );
+    int n = format_line( line, fmt, ap );
+    va_end( ap );
+    if( n >= 0 ) log_push( CHANNEL_ACCESS, LOG_LEVEL_INFO, line, n );
+}
+
+static const char* const level_names[] = { "debug", "info", "warn", "error", "off" };
+static const char* const level_tags[] = { "DEBUG ", "INFO  ", "WARN  ", "ERROR " };
+
+int log_level_from_name( const char* name )
+{
+    for( int i = 0; i <= LOG_LEVEL_OFF; ++i ) {
+        if( strcmp( name, level_names[i] ) == 0 ) return i;
+    }
+    return -1;
+}
+
+unsigned long log_dropped()
+{
+    unsigned long total = 0;
+    for( log_ring* r = rings_head.load( std::memory_order_acquire ); r; r = r->next ) {
+        total += r->dropped.load( std::memory_order_relaxed );
+    }
+    return total;
+}
+
+// 写线程的输出缓冲区，攒满或者一轮取完之后才调用write
+struct out_buf {
+    int fd;
+    int len;
+    char data[64 * 1024];
+};
+static out_buf log_out = { STDOUT_FILENO, 0, {} };
+static out_buf access_out = { -1, 0, {} };
+
+static void out_flush( out_buf* out )
+{
+    int done = 0;
+    while( done < out->len ) {
+        ssize_t n = write( out->fd, out->data + done, out->len - done );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) break;     // 磁盘满了之类的错误，丢掉这一批，不能让写线程卡住
+        done += n;
+    }
+    out->len = 0;
+}
+
+static void out_append( out_buf* out, const char* data, int len )
+{
+    if( out->fd < 0 ) return;
+    if( out->len + len > (int)sizeof( out->data ) ) out_flush( out );
+    memcpy( out->data + out->len, data, len );
+    out->len += len;
+}
+
+// 2026-10-18 07:20:01.123456 ，同一秒内的日期和时间只格式化一次
+static int format_time( long time_us, char* buf )
+{
+    static time_t last_sec = -1;
+    static char last_text[32];
+    time_t sec = time_us / 1000000;
+    if( sec != last_sec ) {
+        struct tm tm;
+        localtime_r( &sec, &tm );
+        strftime( last_text, sizeof( last_text ), "%Y-%m-%d %H:%M:%S", &tm );
+        last_sec = sec;
+    }
+    return snprintf( buf, 32, "%s.%06ld ", last_text, time_us % 1000000 );
+}
+
+// 加上时间（普通日志还有级别）和换行，放进对应的输出缓冲区
+static void write_line( int channel, int level, long time_us, const char* text, int len )
+{
+    char prefix[48];
+    int n = format_time( time_us, prefix );
+    out_buf* out = &access_out;
+    if( channel == CHANNEL_LOG ) {
+        out = &log_out;
+        memcpy( prefix + n, level_tags[level < LOG_LEVEL_ERROR ? level : LOG_LEVEL_ERROR], 6 );
+        n += 6;
+    }
+    if( out->fd < 0 ) return;
+    // 一行总是完整地放进输出缓冲区
+    if( out->len + n + len + 1 > (int)sizeof( out->data ) ) out_flush( out );
+    out_append( out, prefix, n );
+    out_append( out, text, len );
+    out_append( out, "\n", 1 );
+}
+
+// 取空所有线程的缓冲区，返回是否取到了日志
+static bool drain()
+{
+    bool any = false;
+    for( log_ring* r = rings_head.load( std::memory_order_acquire ); r; r = r->next ) {
+        size_t head = r->head.load( std::memory_order_relaxed );
+        size_t tail = r->tail.load( std::memory_order_acquire );
+        while( head < tail ) {
+            size_t off = head & ( LOG_RING_SIZE - 1 );
+            const log_record* h = ( const log_record* )( r->buf + off );
+            if( h->channel == CHANNEL_WRAP ) {
+                head += LOG_RING_SIZE - off;
+                continue;
+            }
+            write_line( h->channel, h->level, h->time_us, ( const char* )( h + 1 ), h->len );
+            head += ( sizeof( log_record ) + h->len + 7 ) & ~(size_t)7;
+            any = true;
+        }
+        r->head.store( head, std::memory_order_release );
+
+        unsigned long dropped = r->dropped.load( std::memory_order_relaxed );
+        if( dropped != r->last_dropped ) {
+            char line[64];
+            int n = snprintf( line, sizeof( line ), "log buffer full, %lu lines dropped", dropped - r->last_dropped );
+            struct timespec ts;
+            clock_gettime( CLOCK_REALTIME, &ts );
+            write_line( CHANNEL_LOG, LOG_LEVEL_WARN, ts.tv_sec * 1000000L + ts.tv_nsec / 1000, line, n );
+            r->last_dropped = dropped;
+        }
+    }
+    out_flush( &log_out );
+    out_flush( &access_out );
+    return any;
+}
+
+static void* writer_thread( void* )
+{
+    while( !writer_stop.load( std::memory_order_acquire ) ) {
+        int key = writer_wakeup.prepare_wait();
+        if( !drain() ) {
+            writer_wakeup.wait_for( key, LOG_FLUSH_MS );
+        }
+    }
+    return NULL;
+}
+
+static int open_log_file( const char* path )
+{
+    if( strcmp( path, "-" ) == 0 ) return STDOUT_FILENO;
+    return open( path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+}
+
+bool log_open( const char* path, const char* access_path )
+{
+    static bool registered = false;
+    if( !registered ) {
+        // exit之前把缓冲区中的日志写出去，启动阶段出错退出时也一样
+        atexit( log_stop );
+        registered = true;
+    }
+    log_out.fd = path ? open_log_file( path ) : STDOUT_FILENO;
+    if( log_out.fd < 0 ) return false;
+    if( access_path ) {
+        access_out.fd = open_log_file( access_path );
+        if( access_out.fd < 0 ) return false;
+        access_log_enabled = true;
+    }
+    return true;
+}
+
+bool log_start()
+{
+    if( writer_running ) return true;
+    writer_stop.store( false );
+    writer_running = pthread_create( &writer_tid, NULL, writer_thread, NULL ) == 0;
+    return writer_running;
+}
+
+void log_stop()
+{
+    if( writer_running ) {
+        writer_stop.store( true, std::memory_order_release );
+        writer_wakeup.notify_all();
+        pthread_join( writer_tid, NULL );
+        writer_running = false;
+    }
+    drain();
+}
@@ -0,0 +1,70 @@
+#ifndef LOG_H
+#define LOG_H
+
+/*
+    异步日志，代替工作线程和reactor中直接调用的printf。
+    printf写的是行缓冲的stdout，每一行都要拿stdio的锁、调用一次write，所有线程在这把锁上排队。
+    这里每个线程有自己的环形缓冲区（单生产者单消费者，无锁），日志行在调用线程中格式化后复制进去，
+    后台的写线程定期把所有线程的缓冲区取空，攒成一大块再写到文件，每次写入包含很多行。
+    写线程每LOG_FLUSH_MS毫秒醒来一次，某个缓冲区用了一半以上时由写入的线程提前唤醒它。
+    缓冲区满了（写线程跟不上）时丢弃日志行并计数，不会让处理请求的线程等待。
+
+    级别分成编译期和运行期两层：低于LOG_COMPILE_LEVEL的日志语句在编译时就被去掉了；
+    运行期的级别log_level由-l选项设置，检查级别在求值参数之前，关闭的级别没有任何格式化的开销。
+
+    访问日志和普通日志共用每个线程的缓冲区，由写线程写到单独的文件中，每个请求一行：
+    客户端地址、请求行、状态码、发送的字节数和响应时间（从收到请求到最后一个字节发送出去，微秒）。
+    没有指定访问日志文件时不记录，也没有开销。
+*/
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF   4
+
+// 编译期的级别，编译时用-DLOG_COMPILE_LEVEL=1可以去掉所有的DEBUG日志
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_LINE_MAX 1024       // 一行日志最长的长度，超过的部分被截断
+#define LOG_RING_SIZE ( 256 * 1024 )    // 每个线程的环形缓冲区大小，必须是2的幂
+#define LOG_FLUSH_MS 50         // 写线程最长的睡眠时间，也就是日志最多延迟这么久写出
+
+// 运行期的级别，启动时设置，之后只读
+extern int log_level;
+// 是否记录访问日志，log_open打开了访问日志文件时为true
+extern bool access_log_enabled;
+
+#define LOG_AT( level, fmt, ... ) \
+    do { \
+        if( ( level ) >= LOG_COMPILE_LEVEL && ( level ) >= log_level ) log_write( ( level ), fmt, ##__VA_ARGS__ ); \
+    } while( 0 )
+#define LOG_DEBUG( fmt, ... ) LOG_AT( LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__ )
+#define LOG_INFO( fmt, ... ) LOG_AT( LOG_LEVEL_INFO, fmt, ##__VA_ARGS__ )
+#define LOG_WARN( fmt, ... ) LOG_AT( LOG_LEVEL_WARN, fmt, ##__VA_ARGS__ )
+#define LOG_ERROR( fmt, ... ) LOG_AT( LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__ )
+#define LOG_ACCESS( fmt, ... ) \
+    do { \
+        if( access_log_enabled ) log_access( fmt, ##__VA_ARGS__ ); \
+    } while( 0 )
+
+// 格式化一行日志放进当前线程的缓冲区，不检查级别，一般通过上面的宏调用
+void log_write( int level, const char* fmt, ... ) __attribute__(( format( printf, 2, 3 ) ));
+void log_access( const char* fmt, ... ) __attribute__(( format( printf, 1, 2 ) ));
+
+// 级别的名字（debug、info、warn、error、off）转换成级别，不认识时返回-1
+int log_level_from_name( const char* name );
+
+// 打开日志文件，path为NULL时写到标准输出；access_path为NULL时不记录访问日志，"-"表示标准输出。失败时返回false
+bool log_open( const char* path, const char* access_path );
+// 启动写线程。之前写入的日志留在缓冲区中，由写线程写出
+bool log_start();
+// 停止写线程，把所有缓冲区中剩下的日志写出去，进程退出时自动调用
+void log_stop();
+
+// 因为缓冲区满而丢弃的日志行数
+unsigned long log_dropped();
+
+#endif
@@ -8,27 +8,59 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "reactor.h"
+#include "uring_reactor.h"
+#include "stats.h"
+#include "log.h"
 #include <signal.h>
 #include <assert.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <atomic>
+#include <sched.h>
 
-#define MAX_FD 65535 // 最大的文件描述符的个数
 #define MAX_EVENT_NUMBER 10000   // 监听的最大事件数量
-
-#define TIMESLOT 5
-
-static int pipefd[2];
-static sort_timer_lst timer_lst;
-
-void sig_handler( int sig )
-{
-    int save_errno = errno;
-    int msg = sig;
-    send( pipefd[1], ( char* )&msg, 1, 0 );
-    errno = save_errno;
-}
+#define MAX_REACTOR_NUMBER 256   // 最多允许的reactor（事件循环）数量
+#define DEFAULT_BACKLOG SOMAXCONN    // 默认的监听队列长度，实际值还受net.core.somaxconn限制
+#define DEFAULT_MAX_ACCEPT 64    // 默认每次被唤醒时最多accept的连接数，避免连接风暴时饿死已有连接的I/O
+#define OVERFLOW_REPORT_MS 5000  // 检查监听队列溢出计数的间隔（毫秒），也是0号reactor空闲时timerfd的触发间隔
+#define DEFAULT_CACHE_MB 64      // 默认的静态文件缓存大小（MB）
+#define DEFAULT_GZIP_CACHE_MB 16 // 默认的gzip压缩变体缓存大小（MB）
+#define DEFAULT_STAT_TTL 10      // 默认的文件元数据缓存项的最长使用时间（秒），inotify失效之外的保底
+#define STAT_CACHE_ENTRIES 4096  // 文件元数据缓存最多的缓存项数，每个存在的文件占用一个文件描述符
+#define DEFAULT_MAX_QUEUE 10000  // 默认的线程池队列中最多等待处理的请求数，超过时回答503
+#define CLOSE_YIELDS 16          // 关闭仍然busy的连接之前，最多让出CPU等待工作线程清除busy的次数
+
+extern const char* doc_root;
+
+static reactor* reactors = NULL;
+static int reactor_number = 1;
+static threadpool<http_conn>* pool = NULL;
+static http_conn** users = NULL;
+static int listen_backlog = DEFAULT_BACKLOG;
+static int max_accept_per_wakeup = DEFAULT_MAX_ACCEPT;
+static unsigned long last_listen_overflows = 0;
+static unsigned long last_listen_drops = 0;
+static unsigned long start_listen_overflows = 0;   // 启动时的计数，/__stats输出启动以来的增量
+static unsigned long start_listen_drops = 0;
+static bool use_io_uring = false;
+static bool work_stealing = false;
+static int file_cache_mb = DEFAULT_CACHE_MB;
+static int gzip_cache_mb = DEFAULT_GZIP_CACHE_MB;
+static int stat_ttl = DEFAULT_STAT_TTL;
+static int max_header_kb = http_conn::DEFAULT_MAX_HEADER_SIZE >> 10;
+static int idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+static int max_queue = DEFAULT_MAX_QUEUE;
+static int max_queue_wait_ms = 0;
+static time_t last_overflow_report = 0;
+static const char* log_path = NULL;
+static const char* access_log_path = NULL;
+static std::atomic<bool> stop_server(false);
 
 // 添加信号捕捉
 void addsig(int sig, void(handler)(int))
@@ -37,17 +69,113 @@ void addsig(int sig, void(handler)(int))
     memset(&sa, '\0', sizeof(sa));
     sa.sa_handler = handler;
     sigfillset(&sa.sa_mask);
-    assert(sigaction(sig, &sa, NULL) != -1);
+    // 不能把sigaction写在assert中，定义了NDEBUG时整个调用都会被去掉
+    int ret = sigaction(sig, &sa, NULL);
+    assert(ret != -1);
+    (void)ret;
     // sigaction(sig, &sa, NULL);
 
 }
 
-void timer_handler()
+/*
+    从/proc/net/netstat中读取TcpExt的ListenOverflows和ListenDrops计数。
+    ListenOverflows表示因为accept队列满而被丢弃的连接，ListenDrops还包含了SYN队列上的丢弃。
+    这两个计数是整个网络命名空间的，失败时返回false
+*/
+bool read_listen_overflows(unsigned long* overflows, unsigned long* drops)
 {
-    // 定时处理任务，实际上就是调用tick()函数
-    timer_lst.tick();
-    // 因为一次 alarm 调用只会引起一次SIGALARM 信号，所以我们要重新定时，以不断触发 SIGALARM信号。
-    alarm(TIMESLOT);
+    FILE* fp = fopen("/proc/net/netstat", "r");
+    if( !fp ) return false;
+
+    char names[4096], values[4096];
+    bool found = false;
+    while( fgets(names, sizeof(names), fp) && fgets(values, sizeof(values), fp) )
+    {
+        if( strncmp(names, "TcpExt:", 7) != 0 ) continue;
+        // 第一行是字段名，第二行是对应的值，逐个字段对齐
+        char *nsave = NULL, *vsave = NULL;
+        char* name = strtok_r(names, " \n", &nsave);
+        char* value = strtok_r(values, " \n", &vsave);
+        while( name && value )
+        {
+            if( strcmp(name, "ListenOverflows") == 0 ) {
+                *overflows = strtoul(value, NULL, 10);
+                found = true;
+            } else if( strcmp(name, "ListenDrops") == 0 ) {
+                *drops = strtoul(value, NULL, 10);
+            }
+            name = strtok_r(NULL, " \n", &nsave);
+            value = strtok_r(NULL, " \n", &vsave);
+        }
+        break;
+    }
+    fclose(fp);
+    return found;
+}
+
+// 输出监听队列溢出计数的增量，只在计数变化时输出
+void report_listen_overflows()
+{
+    unsigned long overflows = last_listen_overflows, drops = last_listen_drops;
+    if( !read_listen_overflows(&overflows, &drops) ) return;
+    if( overflows != last_listen_overflows || drops != last_listen_drops ) {
+        LOG_WARN("ListenOverflows +%lu, ListenDrops +%lu (backlog %d)",
+               overflows - last_listen_overflows, drops - last_listen_drops, listen_backlog);
+    }
+    last_listen_overflows = overflows;
+    last_listen_drops = drops;
+}
+
+// 设置reactor的timerfd，interval_ms为0表示停止触发
+void set_timerfd( reactor* r, int interval_ms )
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = interval_ms / 1000;
+    its.it_value.tv_nsec = (long)(interval_ms % 1000) * 1000000;
+    its.it_interval = its.it_value;
+    timerfd_settime(r->timerfd, 0, &its, NULL);
+    r->timer_interval = interval_ms;
+}
+
+static void conn_timeout( http_conn* conn, void* arg );
+
+/*
+    定时处理任务，实际上就是调用tick()函数。timerfd每TIMER_TICK_MS毫秒触发一次，
+    时间轮按毫秒计时，所以空闲超时的精度是TIMER_TICK_MS毫秒，而不是原来alarm的5秒。
+    时间轮中没有定时器时停止timerfd，空闲的reactor不会被无谓地唤醒。
+    0号reactor还要定期检查监听队列是否溢出，时间轮为空时timerfd改为每OVERFLOW_REPORT_MS毫秒触发一次。
+*/
+void timer_handler( reactor* r )
+{
+    time_t now = current_ms();
+    r->timers.tick( now, conn_timeout, r );
+    if( r->timers.size() == 0 ) {
+        int idle_interval = r->id == 0 ? OVERFLOW_REPORT_MS : 0;
+        if( r->timer_interval != idle_interval ) set_timerfd( r, idle_interval );
+    }
+    if( r->id == 0 && now - last_overflow_report >= OVERFLOW_REPORT_MS ) {
+        report_listen_overflows();
+        last_overflow_report = now;
+    }
+}
+
+bool server_stopped()
+{
+    return stop_server;
+}
+
+// 收到SIGTERM后设置停止标志，并让所有reactor的timerfd立即触发，使它们尽快从等待中返回
+void handle_signal( const struct signalfd_siginfo& info )
+{
+    if( info.ssi_signo != SIGTERM ) return;
+    stop_server = true;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = 1;
+    for( int i = 0; i < reactor_number; ++i ) {
+        timerfd_settime(reactors[i].timerfd, 0, &its, NULL);
+    }
 }
 
 /*
@@ -64,82 +192,283 @@ extern void modfd(int epollfd, int fd, int ev);
 
 extern int setnonblocking(int fd);
 
-int main(int argc, char* argv[])
+// 创建监听的套接字，设置SO_REUSEPORT后每个reactor都可以绑定同一个端口
+int create_listenfd(int port)
 {
-    if(argc <= 1)
-    {
-        printf("usage: %s port_number\n", basename(argv[0]));
-        exit(-1);
-    }
-
-    // 获取端口号
-    int port = atoi(argv[1]);
-
-    int ret = 0;
-    // 对SIGPIE信号进行处理
-    addsig(SIGPIPE, SIG_IGN);   // SIGPIPE：连接断开    SIG_ICN：忽略操作
-    
-    // 创建线程池，初始化线程池
-    threadpool<http_conn> * pool = NULL;
-    try{
-        pool = new threadpool<http_conn>;
-    } 
-    catch(...){
-        exit(-1);
-    }
-
-    // 创建数组，用于保存所有的客户端信息
-    http_conn * users = new http_conn[ MAX_FD ];
-
-    // 创建监听的套接字
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    int listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     assert( listenfd >= 0 );
 
     // 设置端口复用
     int reuse = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
 
     // 绑定
     struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(port);
-    bind(listenfd, (struct sockaddr *)& address, sizeof(address));
+    // 端口被占用等错误在Release构建中也要报告，不能只用assert
+    if( bind(listenfd, (struct sockaddr *)& address, sizeof(address)) == -1 ) {
+        LOG_ERROR("cannot bind port %d: %s", port, strerror(errno));
+        exit(-1);
+    }
 
     // 监听
-    listen(listenfd, 5);
-    
+    if( listen(listenfd, listen_backlog) == -1 ) {
+        LOG_ERROR("cannot listen on port %d: %s", port, strerror(errno));
+        exit(-1);
+    }
+    return listenfd;
+}
+
+// 初始化reactor：监听socket、epoll对象和信号管道
+void reactor_init(reactor* r, int id, int port)
+{
+    r->id = id;
+    r->listenfd = create_listenfd(port);
+    r->users = users;
+
+    // 创建timerfd，0号reactor还负责通过signalfd接收SIGTERM（信号已经在所有线程中屏蔽）
+    r->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    assert( r->timerfd != -1 );
+    r->timer_interval = 0;
+    r->sigfd = -1;
+    if( id == 0 ) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGTERM);
+        r->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        assert( r->sigfd != -1 );
+        set_timerfd( r, OVERFLOW_REPORT_MS );
+    }
+
+    // io_uring后端在自己的环上监听这些fd，不需要epoll对象
+    r->epollfd = -1;
+    if( !use_io_uring ) {
+        r->epollfd = epoll_create(5);
+        assert( r->epollfd != -1 );
+
+        // 将监听的文件描述符、timerfd和signalfd添加到epoll对象中
+        addfd(r->epollfd, r->listenfd, false);
+        addfd( r->epollfd, r->timerfd, false);
+        if( r->sigfd != -1 ) addfd( r->epollfd, r->sigfd, false);
+    }
+
+}
+
+void reactor_destroy(reactor* r)
+{
+    LOG_INFO("reactor %d: %lu accepts in %lu wakeups, max batch %lu, capped %lu times, %d/%d connection objects in use",
+           r->id, r->accepts.get(), r->accept_wakeups.get(), r->max_accept_batch.get(), r->accept_capped.get(), r->conns.live(), r->conns.capacity());
+
+    if( r->epollfd >= 0 ) close(r->epollfd);
+    close(r->listenfd);
+    close( r->timerfd );
+    if( r->sigfd != -1 ) close( r->sigfd );
+}
+
+// 为连接添加一个timeout_ms毫秒后到期的定时器
+static void add_conn_timer( reactor* r, http_conn* conn, int timeout_ms )
+{
+    time_t now = current_ms();
+    // 时间轮为空时timerfd已经停止，时间轮的时钟停在最后一次tick。先把它拨到现在，否则定时器按过时的时钟散列，
+    // 重新触发timerfd之后的第一次tick还要逐个滴答地走过空闲的这段时间
+    if( r->timers.size() == 0 ) r->timers.tick( now, conn_timeout, r );
+    util_timer* timer = r->timers.create_timer();
+    timer->user_data = conn;
+    timer->expire = now + timeout_ms;
+    conn->timer = timer;
+    r->timers.add_timer( timer );
+    if( r->timer_interval != TIMER_TICK_MS ) set_timerfd( r, TIMER_TICK_MS );
+}
+
+void add_conn( reactor* r, int connfd, const sockaddr_in& addr, int epollfd )
+{
+    // 从连接池中取一个连接对象，放到users表中
+    http_conn* conn = r->conns.alloc();
+    users[connfd] = conn;
+    conn->init(connfd, addr, epollfd);
+    add_conn_timer( r, conn, idle_timeout_ms );
+    local_stats()->accepts.add();
+}
+
+void adjust_conn_timer( reactor* r, http_conn* conn )
+{
+    // 如果某个客户端上有数据可读，则我们要调整该连接对应的定时器，以延迟该连接被关闭的时间。
+    util_timer* timer = conn->timer;  // timer为指针，指向对应定时器的内存地址
+    if( timer ) {
+        timer->expire = current_ms() + idle_timeout_ms;
+        LOG_DEBUG( "adjust timer once" );
+        r->timers.adjust_timer( timer );
+    }
+}
+
+void close_user( reactor* r, http_conn* conn )
+{
+    util_timer* timer = conn->timer;
+    // 连接上的事件刚刚被reactor取走，这时busy只可能是工作线程在modfd之后、清除busy之前的最后一步，
+    // 让出几次CPU，一般就能等到它清除busy，直接关闭
+    for( int i = 0; i < CLOSE_YIELDS && r->epollfd >= 0 && conn->busy(); ++i ) {
+        sched_yield();
+    }
+    if( r->epollfd >= 0 && conn->busy() && timer ) {
+        // 工作线程已经重新注册了事件，但还没有清除busy，连接对象还不能回收。
+        // 工作线程只差最后一步，下一次tick时由conn_timeout关闭连接
+        conn->close_pending = true;
+        timer->expire = current_ms() + TIMER_TICK_MS;
+        r->timers.adjust_timer( timer );
+        return;
+    }
+    if( timer )  // 删除定时器
+    {
+        r->timers.del_timer( timer );
+        conn->timer = NULL;
+    }
+    if( r->epollfd < 0 ) {
+        // io_uring后端：连接上可能还有没完成的请求在使用连接对象，由事件循环在请求全部完成后回收
+        conn->close_conn();
+        return;
+    }
+    // 先从users表中移除再关闭，close之后fd号可能马上被其他reactor复用
+    users[conn->sockfd()] = NULL;
+    conn->close_conn(); // 关闭连接
+    r->conns.free( conn );
+}
+
+void free_conn( reactor* r, int fd )
+{
+    http_conn* conn = users[fd];
+    users[fd] = NULL;
+    r->conns.free( conn );
+}
+
+// 连接空闲超时，由时间轮回调
+static void conn_timeout( http_conn* conn, void* arg )
+{
+    reactor* r = (reactor*)arg;
+    if( conn->close_pending ) {
+        // 推迟的关闭，不是空闲超时。连接上的事件已经用掉了，只能由定时器关闭，busy还没有清除时下一次tick再检查
+        if( conn->busy() ) {
+            add_conn_timer( r, conn, TIMER_TICK_MS );
+            return;
+        }
+        close_user( r, conn );
+        return;
+    }
+    if( conn->busy() ) {
+        // 工作线程正在处理这个连接，不能关闭，重新计时
+        add_conn_timer( r, conn, idle_timeout_ms );
+        return;
+    }
+    local_stats()->timer_expirations.add();
+    close_user( r, conn );
+}
+
+/*
+    线程池过载时不再把请求放入队列，由reactor直接发送预先生成的503应答（带Retry-After）并关闭连接。
+    应答只有一百多字节，socket的发送缓冲区一定放得下，发不出去说明连接已经出错，也一样关闭。
+    请求在reactor中被拒绝，不占用工作线程，过载时已经排队的请求的延迟不会继续增加
+*/
+static void shed_request( reactor* r, http_conn* conn, shed_reason reason )
+{
+    int len;
+    const char* resp = canned_response( 503, false, &len );
+    int n = send( conn->sockfd(), resp, len, MSG_NOSIGNAL | MSG_DONTWAIT );
+    thread_stats* stats = local_stats();
+    stats->count_request( 503 );
+    stats->shed[reason].add();
+    if( n > 0 ) stats->bytes_sent.add( n );
+    close_user( r, conn );
+}
+
+// 最近取出的请求排队时间超过上限，并且队列中还有请求时，说明工作线程处理不过来
+static bool queue_too_slow()
+{
+    return http_conn::m_queue_slow.load( std::memory_order_relaxed ) && pool->pending() > 0;
+}
 
-    // 创建epoll对象，时间数组，添加
-    epoll_event events[MAX_EVENT_NUMBER];   //  MAX_EVENT_NUMBER = 10000
-    int epollfd = epoll_create(5);
+/*
+    把读缓冲区中有请求的连接交给线程池，过载时回答503。
+    新读到数据和发送完应答后流水线上还有请求的连接都从这里进入线程池，受同样的准入控制
+*/
+static void dispatch_conn( reactor* r, http_conn* conn, int sockfd )
+{
+    if( queue_too_slow() ) {
+        shed_request( r, conn, SHED_QUEUE_WAIT );
+        return;
+    }
+    conn->set_busy( true );
+    // 队列满了
+    if( !pool->append( conn, sockfd ) ) {
+        conn->set_busy( false );
+        shed_request( r, conn, SHED_QUEUE_DEPTH );
+    }
+}
 
-    // 将监听的文件描述符添加到epoll对象中
-    addfd(epollfd, listenfd, false);
+/*
+    处理监听socket上的可读事件。监听socket是水平触发的，每次唤醒循环accept直到EAGAIN，
+    但最多接收max_accept_per_wakeup个连接，剩下的连接留到下一次epoll_wait再处理，
+    这样连接风暴时已有连接的I/O也能得到处理。
+*/
+void handle_accept(reactor* r)
+{
+    int batch = 0;
+    r->accept_wakeups.add();
+    while( batch < max_accept_per_wakeup )
+    {
+        // 有客户端连接进来，accept4直接得到非阻塞的socket，省去了两次fcntl调用
+        struct sockaddr_in client_address;
+        socklen_t client_addrlen = sizeof(client_address);
+        int connfd = accept4(r->listenfd, (struct sockaddr *)&client_address, &client_addrlen,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-    // 创建管道
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
-    assert( ret != -1 );
-    setnonblocking( pipefd[1] );
-    addfd( epollfd, pipefd[0] , false);
+        if(connfd < 0)
+        {
+            // 队列已经取空，或者连接在accept之前已经被对方重置
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            // 其他错误（比如EMFILE）输出错误并结束这次accept
+            LOG_WARN("accept errno is: %d", errno);
+            break;
+        }
+        batch++;
+        // 已连接的客户端数超过最大可连接数，拒绝并关闭当前连接。
+        // 元数据缓存等也占用文件描述符，fd号可能超过MAX_FD，这样的连接放不进users表，同样拒绝
+        if(http_conn::m_user_count >= MAX_FD || connfd >= MAX_FD)
+        {
+            // 目前连接数满了
+            // 给客户端写一个信息：服务器正忙
+            close(connfd);
+            continue;
+        }
+        // 将新的客户的数据初始化，放到数组中，并注册到当前reactor的epoll对象上
+        add_conn(r, connfd, client_address, r->epollfd);
+    }
 
-    http_conn::m_epollfd = epollfd;
+    r->accepts.add( batch );
+    if( (unsigned long)batch > r->max_accept_batch.get() ) r->max_accept_batch.set( batch );
+    if( batch >= max_accept_per_wakeup ) r->accept_capped.add();
+}
 
-    // 设置信号处理函数
-    addsig( SIGALRM , sig_handler);
-    addsig( SIGTERM , sig_handler);
+// reactor的事件循环
+void* reactor_loop(void* arg)
+{
+    reactor* r = (reactor*)arg;
+    int epollfd = r->epollfd;
+    int listenfd = r->listenfd;
 
-    bool stop_server = false;
+    epoll_event* events = new epoll_event[MAX_EVENT_NUMBER];   //  MAX_EVENT_NUMBER = 10000
 
     bool timeout = false;
-    alarm(TIMESLOT);  // 定时,5秒后产生SIGALARM信号
 
     while(!stop_server)
     {
         int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
         if((num<0) && (errno != EINTR))
         {
-            printf("epoll failure\n");
+            LOG_ERROR("epoll failure");
             break;
         }
 
@@ -149,123 +478,346 @@ int main(int argc, char* argv[])
             int sockfd = events[i].data.fd;
             if(sockfd == listenfd)
             {
-                // 有客户端连接进来
-                struct sockaddr_in client_address;
-                socklen_t client_addrlen = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlen);
-
-                if(connfd < 0)  // 接收失败，输出错误并跳出之后操作，重新开始循环
-                {
-                    printf("errno is: %d\n", errno);
-                    continue;
-                }
-                if(http_conn::m_user_count >= MAX_FD)   // 已连接的客户端数超过最大可连接数，拒绝并关闭当前连接
-                {
-                    // 目前连接数满了
-                    // 给客户端写一个信息：服务器正忙
-                    close(connfd);
-                    continue;
+                handle_accept(r);
+            }
+            else if( sockfd == r->timerfd ) {
+                // 读出timerfd的触发次数，用timeout变量标记有定时任务需要处理，但不立即处理定时任务
+                // 这是因为定时任务的优先级不是很高，我们优先处理其他更重要的任务。
+                uint64_t expirations;
+                if( read( r->timerfd, &expirations, sizeof( expirations ) ) > 0 ) {
+                    timeout = true;
                 }
-                // 将新的客户的数据初始化，放到数组中
-                users[connfd].init(connfd, client_address);
-
-                util_timer* timer = new util_timer;
-                timer->user_data = &users[connfd];
-                time_t cur = time( NULL );
-                timer->expire = cur + 3 * TIMESLOT;
-                users[connfd].timer = timer;
-                timer_lst.add_timer( timer );
             }
-            else if( ( sockfd == pipefd[0] ) && ( events[i].events & EPOLLIN ) ) {
-                // 操作系统产生SIGALRM或SIGTERM信号，pipefd[0]接收到这两个信号
-                int sig;
-                char signals[1024];
-                ret = recv( pipefd[0], signals, sizeof( signals ), 0 );
-                if( ret == -1 ) {
-                    continue;
-                } else if( ret == 0 ) {
-                    continue;
-                } else  {
-                    for( int i = 0; i < ret; ++i ) {
-                        switch( signals[i] )  {
-                            case SIGALRM:
-                            {
-                                // 用timeout变量标记有定时任务需要处理，但不立即处理定时任务
-                                // 这是因为定时任务的优先级不是很高，我们优先处理其他更重要的任务。
-                                timeout = true;
-                                break;
-                            }
-                            case SIGTERM:
-                            {
-                                stop_server = true;
-                            }
-                        }
-                    }
+            else if( sockfd == r->sigfd ) {
+                // SIGTERM通过signalfd同步地到达，不需要在信号处理函数中做任何事情
+                struct signalfd_siginfo info;
+                while( read( r->sigfd, &info, sizeof( info ) ) == sizeof( info ) ) {
+                    handle_signal( info );
                 }
             }
             else if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
             {
                 // 对方异常断开或者错误等事件
-                util_timer* timer = users[sockfd].timer;
-                if(timer)
-                {
-                    printf("客户端异常断开或错误, 删除定时器\n");
-                    timer_lst.del_timer(timer);
-                }
-                users[sockfd].close_conn();
+                LOG_DEBUG("客户端异常断开或错误, 删除定时器");
+                close_user(r, users[sockfd]);
             }
             else if(events[i].events & EPOLLIN)   // 接收到对方的请求，更新对应定时器的超时时间
             {
-                util_timer* timer = users[sockfd].timer;  // timer为指针，指向对应定时器的内存地址
-                if(users[sockfd].read())   // 读取客户端请求数据成功
+                http_conn* conn = users[sockfd];
+                if(conn->read())   // 读取客户端请求数据成功
                 {
                     // 一次性把所有数据读完
-                    pool->append(users + sockfd);
-
-                    // 如果某个客户端上有数据可读，则我们要调整该连接对应的定时器，以延迟该连接被关闭的时间。
-                    if( timer ) {
-                        time_t cur = time( NULL );
-                        timer->expire = cur + 3 * TIMESLOT;
-                        printf( "adjust timer once\n" );
-                        timer_lst.adjust_timer( timer );
-                    }
+                    adjust_conn_timer(r, conn);
+                    dispatch_conn(r, conn, sockfd);
                 }
                 else{  // 读取失败
-                    if( timer )  // 删除定时器
-                    {
-                        timer_lst.del_timer( timer );
-                    }
-                    users[sockfd].close_conn(); // 关闭连接
-                    
+                    close_user(r, conn);
                 }
             }
             else if(events[i].events & EPOLLOUT)
             {
-                util_timer* timer = users[sockfd].timer;
                 // 一次性写完所有数据
-                if(!users[sockfd].write())
+                http_conn* conn = users[sockfd];
+                if(!conn->write())
                 {
-                    if( timer )
-                    {
-                        timer_lst.del_timer( timer );
-                    }
-                    users[sockfd].close_conn();
+                    close_user(r, conn);
+                }
+                else if(conn->pipeline_pending())
+                {
+                    dispatch_conn(r, conn, sockfd);
                 }
             }
         }
-        // 最后处理定时事件，因为I/O事件有更高的优先级。当然，这样做将导致定时任务不能精准的按照预定的时间执行。
+        // 最后处理定时事件，因为I/O事件有更高的优先级。定时任务最多被推迟一轮事件处理的时间。
         if( timeout ) {
-            timer_handler();
+            timer_handler( r );
             timeout = false;
         }
     }
 
-    close(epollfd);
-    close(listenfd);
-    close( pipefd[1] );
-    close( pipefd[0] );
-    delete [] users;
+    delete [] events;
+    return NULL;
+}
+
+// 文件缓存和gzip缓存的统计，同一个指标的样本必须连在一起，所以外层按指标循环
+static void cache_stats( std::string& out )
+{
+    static const char* const metrics[4][3] = {
+        { "webserver_cache_hits_total", "counter", "Cache lookups that found the entry." },
+        { "webserver_cache_misses_total", "counter", "Cache lookups that did not find the entry." },
+        { "webserver_cache_evictions_total", "counter", "Entries evicted to stay within the budget." },
+        { "webserver_cache_bytes", "gauge", "Bytes held by cached entries." },
+    };
+    file_cache* caches[2] = { http_conn::m_file_cache, http_conn::m_gzip_cache };
+    static const char* const labels[2] = { "{cache=\"file\"}", "{cache=\"gzip\"}" };
+    if( !caches[0] && !caches[1] ) return;
+    for( int i = 0; i < 4; ++i ) {
+        write_metric_header( out, metrics[i][0], metrics[i][1], metrics[i][2] );
+        for( int j = 0; j < 2; ++j ) {
+            file_cache* cache = caches[j];
+            if( !cache ) continue;
+            double values[4] = { (double)cache->hits(), (double)cache->misses(), (double)cache->evictions(), (double)cache->bytes() };
+            write_metric_value( out, metrics[i][0], labels[j], values[i] );
+        }
+    }
+}
+
+// 每个reactor的accept统计，同一个指标的样本连在一起
+static void reactor_stats( std::string& out )
+{
+    static const char* const metrics[4][3] = {
+        { "webserver_reactor_accepts_total", "counter", "Connections accepted by each reactor." },
+        { "webserver_reactor_accept_wakeups_total", "counter", "Times the listening socket woke the reactor." },
+        { "webserver_reactor_accept_capped_total", "counter", "Wakeups that hit the per-wakeup accept limit." },
+        { "webserver_reactor_max_accept_batch", "gauge", "Most connections accepted in one wakeup." },
+    };
+    char labels[32];
+    for( int i = 0; i < 4; ++i ) {
+        write_metric_header( out, metrics[i][0], metrics[i][1], metrics[i][2] );
+        for( int j = 0; j < reactor_number; ++j ) {
+            reactor* r = &reactors[j];
+            unsigned long values[4] = { r->accepts.get(), r->accept_wakeups.get(), r->accept_capped.get(), r->max_accept_batch.get() };
+            snprintf( labels, sizeof( labels ), "{reactor=\"%d\"}", j );
+            write_metric_value( out, metrics[i][0], labels, values[i] );
+        }
+    }
+    // 监听队列溢出是整个网络命名空间的计数，输出服务器启动以来的增量
+    unsigned long overflows, drops = start_listen_drops;
+    if( read_listen_overflows( &overflows, &drops ) ) {
+        write_metric( out, "webserver_listen_overflows_total", "counter", "TcpExt ListenOverflows since the server started.", overflows - start_listen_overflows );
+        write_metric( out, "webserver_listen_drops_total", "counter", "TcpExt ListenDrops since the server started.", drops - start_listen_drops );
+    }
+}
+
+// /__stats中线程统计之外的部分：连接数、线程池队列、读缓冲区池和各个缓存，都是直接读取已有的计数
+static void server_stats( std::string& out )
+{
+    write_metric( out, "webserver_connections", "gauge", "Open client connections.", http_conn::m_user_count.load() );
+    write_metric( out, "webserver_queue_depth", "gauge", "Requests queued for the thread pool.", pool->pending() );
+    write_metric( out, "webserver_read_buffer_bytes", "gauge", "Bytes of read buffers in use.", http_conn::m_read_pool.in_use() );
+    write_metric( out, "webserver_read_buffer_allocs_total", "counter", "Read buffer allocations.", http_conn::m_read_pool.allocs() );
+    write_metric( out, "webserver_read_buffer_reuses_total", "counter", "Read buffer allocations served from the free lists.", http_conn::m_read_pool.reuses() );
+    write_metric( out, "webserver_log_dropped_total", "counter", "Log lines dropped because a log buffer was full.", log_dropped() );
+    reactor_stats( out );
+    cache_stats( out );
+    if( http_conn::m_stat_cache ) {
+        stat_cache* cache = http_conn::m_stat_cache;
+        write_metric( out, "webserver_stat_cache_hits_total", "counter", "File metadata lookups served from the cache.", cache->hits() );
+        write_metric( out, "webserver_stat_cache_misses_total", "counter", "File metadata lookups that read the filesystem.", cache->misses() );
+        write_metric( out, "webserver_stat_cache_invalidations_total", "counter", "Entries dropped by inotify events.", cache->invalidations() );
+        write_metric( out, "webserver_stat_cache_entries", "gauge", "Entries in the file metadata cache.", cache->size() );
+    }
+}
+
+void usage(const char* prog)
+{
+    printf("usage: %s [-r reactor_number] [-b backlog] [-a max_accept_per_wakeup] [-t idle_timeout_ms] [-c cache_mb] [-z gzip_cache_mb] [-s stat_ttl_s] [-C prefix=max_age[,immutable]]... [-H max_header_kb] [-q max_queue] [-Q max_queue_wait_ms] [-l level] [-L log_file] [-A access_log] [-d doc_root] [-m] [-u] [-w] port_number\n", basename((char*)prog));
+    printf("  -c  static file cache size in MB, 0 disables the cache\n");
+    printf("  -z  gzip variant cache size in MB, 0 only serves precompressed .gz files\n");
+    printf("  -s  seconds a cached stat/open result is trusted without an inotify event, 0 disables the cache\n");
+    printf("  -C  send Cache-Control: max-age (and immutable) for URLs under prefix, may be repeated\n");
+    printf("  -H  largest request (request line, headers and body) accepted, in KB, up to %d\n", buffer_pool::MAX_SIZE >> 10);
+    printf("  -q  requests waiting for a worker thread before new ones get 503, default %d\n", DEFAULT_MAX_QUEUE);
+    printf("  -Q  answer 503 while queued requests wait longer than this many ms, 0 (default) disables\n");
+    printf("      (-q and -Q apply to the epoll backend, io_uring handles requests in the reactor)\n");
+    printf("  -l  log level: debug, info (default), warn, error or off\n");
+    printf("  -L  write the log to this file instead of stdout\n");
+    printf("  -A  write one access log line per request to this file (- for stdout), off by default\n");
+    printf("  -d  directory to serve files from, default %s\n", doc_root);
+    printf("  -m  send uncached files with mmap+writev instead of sendfile\n");
+    printf("  -u  use the io_uring backend instead of epoll\n");
+    printf("  -w  use work-stealing worker queues instead of one shared queue\n");
+    exit(-1);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+    while((opt = getopt(argc, argv, "r:b:a:t:c:z:s:C:H:q:Q:l:L:A:d:muw")) != -1)
+    {
+        switch(opt)
+        {
+            case 'r':   // reactor（事件循环）的数量，一般设置为CPU核数
+                reactor_number = atoi(optarg);
+                break;
+            case 'b':   // 监听队列长度
+                listen_backlog = atoi(optarg);
+                break;
+            case 'a':   // 每次唤醒最多accept的连接数
+                max_accept_per_wakeup = atoi(optarg);
+                break;
+            case 't':   // 连接的空闲超时时间（毫秒）
+                idle_timeout_ms = atoi(optarg);
+                break;
+            case 'c':   // 静态文件缓存的大小（MB），0表示不使用缓存
+                file_cache_mb = atoi(optarg);
+                break;
+            case 'z':   // gzip压缩变体缓存的大小（MB），0表示不在运行时压缩，只发送预先压缩好的.gz文件
+                gzip_cache_mb = atoi(optarg);
+                break;
+            case 's':   // 文件元数据缓存项的最长使用时间（秒），0表示不使用元数据缓存
+                stat_ttl = atoi(optarg);
+                break;
+            case 'C':   // URL前缀的Cache-Control规则，比如 -C /static/=31536000,immutable，最长的前缀优先
+                if( !add_cache_control_rule(optarg) ) usage(argv[0]);
+                break;
+            case 'H':   // 请求大小的上限（KB），读缓冲区最大增长到这个大小
+                max_header_kb = atoi(optarg);
+                break;
+            case 'q':   // 线程池队列中最多等待处理的请求数
+                max_queue = atoi(optarg);
+                break;
+            case 'Q':   // 请求在线程池队列中等待时间的上限（毫秒），0表示不限制
+                max_queue_wait_ms = atoi(optarg);
+                break;
+            case 'l':   // 日志级别
+                log_level = log_level_from_name(optarg);
+                if( log_level < 0 ) usage(argv[0]);
+                break;
+            case 'L':   // 日志文件，默认是标准输出
+                log_path = optarg;
+                break;
+            case 'A':   // 访问日志文件，默认不记录访问日志
+                access_log_path = optarg;
+                break;
+            case 'd':   // 网站根目录
+                doc_root = optarg;
+                break;
+            case 'm':   // 不使用sendfile，没有命中缓存的文件仍然mmap后用writev发送
+                http_conn::m_use_sendfile = false;
+                break;
+            case 'u':   // 使用io_uring后端
+                use_io_uring = true;
+                break;
+            case 'w':   // 线程池使用工作窃取模式
+                work_stealing = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(optind >= argc || reactor_number <= 0 || reactor_number > MAX_REACTOR_NUMBER
+        || listen_backlog <= 0 || max_accept_per_wakeup <= 0 || idle_timeout_ms <= 0 || file_cache_mb < 0 || gzip_cache_mb < 0 || stat_ttl < 0
+        || max_queue <= 0 || max_queue_wait_ms < 0
+        || max_header_kb <= 0 || max_header_kb > (buffer_pool::MAX_SIZE >> 10) || strlen(doc_root) >= http_conn::FILENAME_LEN / 2)
+    {
+        usage(argv[0]);
+    }
+
+    // 获取端口号
+    int port = atoi(argv[optind]);
+
+    if( !log_open(log_path, access_log_path) )
+    {
+        printf("cannot open log file: %s\n", strerror(errno));
+        exit(-1);
+    }
+    http_conn::m_max_header_size = max_header_kb << 10;
+    http_conn::m_max_queue_wait_ns = (long)max_queue_wait_ms * 1000000;
+
+    if( use_io_uring && !uring_supported() )
+    {
+        LOG_ERROR("io_uring backend is not available");
+        exit(-1);
+    }
+
+    // 对SIGPIE信号进行处理
+    addsig(SIGPIPE, SIG_IGN);   // SIGPIPE：连接断开    SIG_ICN：忽略操作
+
+    // 在创建任何线程之前屏蔽SIGTERM，新线程会继承这个屏蔽字，SIGTERM只能通过0号reactor的signalfd读到
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    // 日志的写线程，之后的日志都由它写出
+    log_start();
+    
+    // 创建线程池，初始化线程池
+    try{
+        pool = new threadpool<http_conn>(8, max_queue, work_stealing);
+    } 
+    catch(...){
+        exit(-1);
+    }
+
+    if( file_cache_mb > 0 ) {
+        http_conn::m_file_cache = new file_cache( (size_t)file_cache_mb << 20 );
+    }
+    if( gzip_cache_mb > 0 ) {
+        http_conn::m_gzip_cache = new file_cache( (size_t)gzip_cache_mb << 20 );
+    }
+    if( stat_ttl > 0 ) {
+        http_conn::m_stat_cache = new stat_cache( doc_root, stat_ttl, STAT_CACHE_ENTRIES );
+        if( !http_conn::m_stat_cache->watch() ) {
+            LOG_WARN("inotify is not available, cached file metadata expires after %d seconds", stat_ttl);
+        }
+    }
+
+    add_stats_source( server_stats );
+
+    // 创建以fd为下标的连接表，只保存指针，连接对象在accept时从reactor的连接池中分配
+    users = new http_conn*[ MAX_FD ]();
+
+    read_listen_overflows(&last_listen_overflows, &last_listen_drops);
+    start_listen_overflows = last_listen_overflows;
+    start_listen_drops = last_listen_drops;
+
+    // 创建所有的reactor
+    reactors = new reactor[ reactor_number ];
+    for(int i = 0; i < reactor_number; i++)
+    {
+        reactor_init(&reactors[i], i, port);
+    }
+
+    // 1号及以后的reactor运行在单独的线程中，0号reactor运行在主线程中
+    void* (*loop)(void*) = use_io_uring ? uring_reactor_loop : reactor_loop;
+    for(int i = 1; i < reactor_number; i++)
+    {
+        if(pthread_create(&reactors[i].tid, NULL, loop, &reactors[i]) != 0)
+        {
+            LOG_ERROR("create reactor %d failure", i);
+            exit(-1);
+        }
+    }
+    loop(&reactors[0]);
+
+    for(int i = 1; i < reactor_number; i++)
+    {
+        pthread_join(reactors[i].tid, NULL);
+    }
+
+    // 先等工作线程退出，它们可能还在使用连接池中的连接对象
     delete pool;
+    for(int i = 0; i < reactor_number; i++)
+    {
+        reactor_destroy(&reactors[i]);
+    }
+    delete [] reactors;
+    delete [] users;
+    LOG_INFO("read buffers: %lu allocs, %lu reused, %ld bytes in use",
+           http_conn::m_read_pool.allocs(), http_conn::m_read_pool.reuses(), http_conn::m_read_pool.in_use());
+    if( http_conn::m_file_cache ) {
+        file_cache* cache = http_conn::m_file_cache;
+        LOG_INFO("file cache: %lu hits, %lu misses, %lu evictions, %zu/%zu bytes",
+               cache->hits(), cache->misses(), cache->evictions(), cache->bytes(), cache->budget());
+        delete cache;
+        http_conn::m_file_cache = NULL;
+    }
+    if( http_conn::m_stat_cache ) {
+        stat_cache* cache = http_conn::m_stat_cache;
+        LOG_INFO("stat cache: %lu hits, %lu misses, %lu invalidations, %zu entries",
+               cache->hits(), cache->misses(), cache->invalidations(), cache->size());
+        delete cache;
+        http_conn::m_stat_cache = NULL;
+    }
+    if( http_conn::m_gzip_cache ) {
+        file_cache* cache = http_conn::m_gzip_cache;
+        LOG_INFO("gzip cache: %lu hits, %lu misses, %lu evictions, %zu/%zu bytes",
+               cache->hits(), cache->misses(), cache->evictions(), cache->bytes(), cache->budget());
+        delete cache;
+        http_conn::m_gzip_cache = NULL;
+    }
 
     return 0;
 }
\ No newline at end of file
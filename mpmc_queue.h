@@ -0,0 +1,131 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
+
+// 自旋等待时提示CPU降低功耗，并让出流水线给同一物理核上的另一个超线程
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/*
+    有界的多生产者多消费者无锁队列（Dmitry Vyukov的算法）。
+    队列是一个大小为2的幂的环形数组，每个槽带一个序号sequence：
+        sequence == pos        槽是空的，位置为pos的生产者可以写入
+        sequence == pos + 1    槽中有数据，位置为pos的消费者可以取出
+    生产者和消费者各自用CAS抢占enqueue_pos/dequeue_pos，抢到位置后只访问自己的槽，
+    所以入队和出队都不需要加锁，也不需要为每个元素分配内存。
+    enqueue_pos和dequeue_pos分别放在单独的缓存行中，避免生产者和消费者互相使对方的缓存行失效。
+*/
+template<typename T>
+class mpmc_queue {
+public:
+    explicit mpmc_queue(size_t capacity) : m_buffer(NULL), m_mask(0)
+    {
+        // 容量向上取整为2的幂，这样可以用位与代替取模
+        size_t size = 2;
+        while(size < capacity) size <<= 1;
+        m_buffer = new cell[size];
+        m_mask = size - 1;
+        for(size_t i = 0; i < size; ++i)
+        {
+            m_buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        m_enqueue_pos.store(0, std::memory_order_relaxed);
+        m_dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    ~mpmc_queue()
+    {
+        delete [] m_buffer;
+    }
+
+    // 入队，队列满时返回false
+    bool push(const T& data)
+    {
+        cell* c;
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            c = &m_buffer[pos & m_mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if(diff == 0)
+            {
+                // 槽是空的，尝试占用位置pos
+                if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            }
+            else if(diff < 0)
+            {
+                // 槽中的数据还没有被取走，队列满了
+                return false;
+            }
+            else
+            {
+                // 其他生产者已经占用了这个位置，重新读取
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        c->data = data;
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 出队，队列空时返回false
+    bool pop(T& data)
+    {
+        cell* c;
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            c = &m_buffer[pos & m_mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(diff == 0)
+            {
+                if(m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            }
+            else if(diff < 0)
+            {
+                // 槽还没有被写入，队列空了
+                return false;
+            }
+            else
+            {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        data = c->data;
+        // 序号加上队列长度，表示这个槽可以被下一圈的生产者使用
+        c->sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    mpmc_queue(const mpmc_queue&);
+    mpmc_queue& operator=(const mpmc_queue&);
+
+    struct cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    alignas(CACHE_LINE_SIZE) cell* m_buffer;
+    size_t m_mask;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_enqueue_pos;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_dequeue_pos;
+    char m_pad[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+};
+
+#endif
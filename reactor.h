@@ -0,0 +1,58 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/signalfd.h>
+#include "http_conn.h"
+#include "time_wheel.h"
+#include "conn_pool.h"
+#include "stats.h"
+
+#define MAX_FD 65535 // 最大的文件描述符的个数
+#define TIMER_TICK_MS 10    // timerfd的触发间隔，也就是超时的精度（毫秒）
+#define DEFAULT_IDLE_TIMEOUT_MS 15000   // 默认的连接空闲超时时间（毫秒）
+
+/*
+    多reactor模式：每个reactor是一个独立的事件循环，拥有自己的监听socket（SO_REUSEPORT，由内核在
+    各个监听socket之间分发新连接）、自己的epoll对象、自己的timerfd和定时器（时间轮）。
+    一个连接从accept开始就只属于接收它的reactor，连接对象从这个reactor的连接池中分配，也只由它关闭和回收。
+    users表虽然是全局的，但每个reactor只会访问自己接收的那部分fd，不需要加锁。
+*/
+struct reactor {
+    int id;
+    int listenfd;
+    int epollfd;        // epoll后端使用，io_uring后端为-1
+    int timerfd;        // 时间轮的滴答，时间轮为空时不触发（0号reactor改为每OVERFLOW_REPORT_MS毫秒触发一次）
+    int sigfd;          // 只有0号reactor通过signalfd接收SIGTERM，其他reactor为-1
+    int timer_interval; // timerfd当前的触发间隔（毫秒），0表示没有触发
+    time_wheel timers;
+    pthread_t tid;
+    http_conn** users;  // 所有reactor共享的、以fd为下标的连接表，没有连接的fd为NULL
+    conn_pool conns;    // 连接对象池
+
+    // accept统计，只由这个reactor修改，/__stats随时读取
+    stat_counter accept_wakeups;    // 监听socket可读而被唤醒的次数
+    stat_counter accepts;           // 成功accept的连接总数
+    stat_counter accept_capped;     // 达到单次accept上限、队列里仍可能有连接的次数
+    stat_counter max_accept_batch;  // 单次唤醒accept到的最多连接数
+};
+
+// 下面这组函数定义在main.cpp中，由不同的事件循环后端共用
+
+// 初始化新接收的连接并为它添加定时器，epollfd为-1表示连接不注册到epoll中
+void add_conn( reactor* r, int connfd, const sockaddr_in& addr, int epollfd );
+// 连接上有数据可读，延迟该连接的超时时间
+void adjust_conn_timer( reactor* r, http_conn* conn );
+// 删除连接的定时器并关闭连接，epoll后端同时回收连接对象
+void close_user( reactor* r, http_conn* conn );
+// 回收已经关闭的连接对象，io_uring后端在连接上的请求全部完成后调用
+void free_conn( reactor* r, int fd );
+// 处理从signalfd中读到的信号
+void handle_signal( const struct signalfd_siginfo& info );
+// 处理定时事件
+void timer_handler( reactor* r );
+// 服务器是否已经收到停止信号
+bool server_stopped();
+
+#endif
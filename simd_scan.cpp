@@ -0,0 +1,85 @@
+#include "simd_scan.h"
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_SCAN_X86
+#endif
+
+const char* scan2_scalar( const char* p, const char* end, char a, char b )
+{
+    for( ; p < end; ++p ) {
+        if( *p == a || *p == b ) {
+            return p;
+        }
+    }
+    return end;
+}
+
+#ifdef SIMD_SCAN_X86
+
+__attribute__(( target( "sse2" ) ))
+static const char* scan2_sse2( const char* p, const char* end, char a, char b )
+{
+    const __m128i va = _mm_set1_epi8( a );
+    const __m128i vb = _mm_set1_epi8( b );
+    while( end - p >= 16 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i*)p );
+        int mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( v, va ), _mm_cmpeq_epi8( v, vb ) ) );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+        p += 16;
+    }
+    return scan2_scalar( p, end, a, b );
+}
+
+__attribute__(( target( "avx2" ) ))
+static const char* scan2_avx2( const char* p, const char* end, char a, char b )
+{
+    const __m256i va = _mm256_set1_epi8( a );
+    const __m256i vb = _mm256_set1_epi8( b );
+    while( end - p >= 32 ) {
+        __m256i v = _mm256_loadu_si256( (const __m256i*)p );
+        unsigned mask = (unsigned)_mm256_movemask_epi8( _mm256_or_si256( _mm256_cmpeq_epi8( v, va ), _mm256_cmpeq_epi8( v, vb ) ) );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+        p += 32;
+    }
+    // 剩下不足32字节。尾部在这个函数里处理，调用非VEX编码的SSE2版本会有AVX/SSE切换的开销
+    if( end - p >= 16 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i*)p );
+        int mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( v, _mm256_castsi256_si128( va ) ),
+                                                    _mm_cmpeq_epi8( v, _mm256_castsi256_si128( vb ) ) ) );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+        p += 16;
+    }
+    for( ; p < end; ++p ) {
+        if( *p == a || *p == b ) {
+            return p;
+        }
+    }
+    return end;
+}
+
+static bool cpu_has( int avx2 )
+{
+    __builtin_cpu_init();
+    return avx2 ? __builtin_cpu_supports( "avx2" ) : __builtin_cpu_supports( "sse2" );
+}
+
+const scan2_fn scan2_sse2_impl = cpu_has( 0 ) ? scan2_sse2 : NULL;
+const scan2_fn scan2_avx2_impl = cpu_has( 1 ) ? scan2_avx2 : NULL;
+
+#else
+
+const scan2_fn scan2_sse2_impl = NULL;
+const scan2_fn scan2_avx2_impl = NULL;
+
+#endif
+
+scan2_fn scan2 = scan2_avx2_impl ? scan2_avx2_impl : ( scan2_sse2_impl ? scan2_sse2_impl : scan2_scalar );
+const char* scan2_name = scan2_avx2_impl ? "avx2" : ( scan2_sse2_impl ? "sse2" : "scalar" );
@@ -0,0 +1,25 @@
+#ifndef SIMD_SCAN_H
+#define SIMD_SCAN_H
+
+/*
+    HTTP解析器使用的字符扫描函数：在[p, end)中查找第一个等于a或b的字符，找不到时返回end。
+    解析器用它找行结束符（'\r'、'\n'）和请求行中的分隔符（' '、'\t'）。
+
+    x86上有SSE2（每次比较16字节）和AVX2（每次比较32字节）两个向量化版本，程序启动时根据CPU
+    支持的指令集选择最快的一个，其他平台使用逐字节比较的版本。向量化版本只读取[p, end)之内的数据，
+    不足一个向量的尾部用逐字节比较处理。
+*/
+
+typedef const char* (*scan2_fn)( const char* p, const char* end, char a, char b );
+
+// 运行时选择的实现
+extern scan2_fn scan2;
+// 当前实现的名字（"avx2"、"sse2"或"scalar"）
+extern const char* scan2_name;
+
+// 各个实现，供基准测试直接调用。不支持的实现为NULL
+const char* scan2_scalar( const char* p, const char* end, char a, char b );
+extern const scan2_fn scan2_sse2_impl;
+extern const scan2_fn scan2_avx2_impl;
+
+#endif
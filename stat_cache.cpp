@@ -0,0 +1,327 @@
+#include "stat_cache.h"
+#include "http_response.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <functional>
+
+// 文件内容和目录结构的变化，IN_ATTRIB包括权限的变化
+#define WATCH_EVENTS ( IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                       | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR )
+
+stat_cache::stat_cache(const char* root, int ttl, size_t max_entries)
+    : m_root(root), m_ttl(ttl), m_inotify_fd(-1), m_stop_fd(-1), m_hits(0), m_misses(0), m_invalidations(0)
+{
+    m_shard_max = max_entries / STAT_CACHE_SHARDS;
+    if(m_shard_max == 0) m_shard_max = 1;
+    for(int i = 0; i < STAT_CACHE_SHARDS; i++)
+    {
+        m_shards[i].head = m_shards[i].tail = NULL;
+        m_shards[i].count = 0;
+    }
+}
+
+stat_cache::~stat_cache()
+{
+    if(m_stop_fd >= 0)
+    {
+        uint64_t one = 1;
+        if(write(m_stop_fd, &one, sizeof(one)) == sizeof(one))
+        {
+            pthread_join(m_watch_tid, NULL);
+        }
+        close(m_stop_fd);
+    }
+    if(m_inotify_fd >= 0) close(m_inotify_fd);
+    clear();
+}
+
+stat_cache::shard* stat_cache::get_shard(const std::string& url)
+{
+    size_t h = std::hash<std::string>()(url);
+    return &m_shards[h % STAT_CACHE_SHARDS];
+}
+
+void stat_cache::unlink(shard* s, entry* e)
+{
+    if(e->prev) e->prev->next = e->next;
+    else s->head = e->next;
+    if(e->next) e->next->prev = e->prev;
+    else s->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+void stat_cache::push_front(shard* s, entry* e)
+{
+    e->prev = NULL;
+    e->next = s->head;
+    if(s->head) s->head->prev = e;
+    s->head = e;
+    if(!s->tail) s->tail = e;
+}
+
+void stat_cache::remove(shard* s, entry* e)
+{
+    unlink(s, e);
+    s->map.erase(e->url);
+    s->count--;
+}
+
+stat_cache::entry* stat_cache::load(const char* url, const char* path)
+{
+    entry* e = new entry;
+    e->url = url;
+    e->path = path;
+    e->fd = -1;
+    e->mime = mime_type(path);
+    e->loaded = time(NULL);
+    e->refs.store(1, std::memory_order_relaxed);
+    e->prev = e->next = NULL;
+
+    // 和原来do_request中的检查顺序一样：不存在、没有读权限、目录。FIFO、设备等特殊文件不能发送，当作没有权限
+    if(stat(path, &e->st) < 0) e->status = NOT_FOUND;
+    else if(!(e->st.st_mode & S_IROTH)) e->status = FORBIDDEN;
+    else if(S_ISDIR(e->st.st_mode)) e->status = IS_DIR;
+    else if(!S_ISREG(e->st.st_mode)) e->status = FORBIDDEN;
+    else
+    {
+        e->fd = open(path, O_RDONLY | O_CLOEXEC);
+        // 用打开之后的fstat结果，stat和open之间文件可能被替换了
+        if(e->fd < 0 || fstat(e->fd, &e->st) < 0) e->status = NOT_FOUND;
+        else e->status = OK;
+    }
+    return e;
+}
+
+void stat_cache::release(entry* e)
+{
+    if(e->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        if(e->fd >= 0) close(e->fd);
+        delete e;
+    }
+}
+
+stat_cache::entry* stat_cache::acquire(const char* url, const char* path)
+{
+    std::string key(url);
+    shard* s = get_shard(key);
+    time_t now = time(NULL);
+    entry* expired = NULL;
+
+    s->lock.lock();
+    std::unordered_map< std::string, entry* >::iterator it = s->map.find(key);
+    if(it != s->map.end())
+    {
+        entry* e = it->second;
+        if(now - e->loaded < m_ttl)
+        {
+            if(e != s->head)
+            {
+                unlink(s, e);
+                push_front(s, e);
+            }
+            e->refs.fetch_add(1, std::memory_order_relaxed);
+            s->lock.unlock();
+            m_hits.fetch_add(1, std::memory_order_relaxed);
+            return e;
+        }
+        // 过期了，重新读取
+        remove(s, e);
+        expired = e;
+    }
+    s->lock.unlock();
+    if(expired) release(expired);
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+
+    // 在锁外读取元数据
+    entry* e = load(url, path);
+    e->refs.store(2, std::memory_order_relaxed);   // 缓存和调用者各一个引用
+
+    entry* victim = NULL;
+    s->lock.lock();
+    it = s->map.find(key);
+    if(it != s->map.end())
+    {
+        // 其他线程已经先一步读取了同一个URL，替换成更新的结果
+        entry* old = it->second;
+        remove(s, old);
+        victim = old;
+    }
+    s->map[key] = e;
+    push_front(s, e);
+    s->count++;
+    entry* evicted = NULL;
+    if(s->count > m_shard_max && s->tail != e)
+    {
+        evicted = s->tail;
+        remove(s, evicted);
+    }
+    s->lock.unlock();
+
+    if(victim) release(victim);
+    if(evicted) release(evicted);
+    return e;
+}
+
+void stat_cache::invalidate(const std::string& url)
+{
+    shard* s = get_shard(url);
+    s->lock.lock();
+    std::unordered_map< std::string, entry* >::iterator it = s->map.find(url);
+    if(it == s->map.end())
+    {
+        s->lock.unlock();
+        return;
+    }
+    entry* e = it->second;
+    remove(s, e);
+    s->lock.unlock();
+    release(e);
+    m_invalidations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void stat_cache::clear()
+{
+    for(int i = 0; i < STAT_CACHE_SHARDS; i++)
+    {
+        shard* s = &m_shards[i];
+        s->lock.lock();
+        entry* e = s->head;
+        s->map.clear();
+        s->head = s->tail = NULL;
+        s->count = 0;
+        s->lock.unlock();
+        while(e)
+        {
+            entry* next = e->next;
+            release(e);
+            e = next;
+        }
+    }
+}
+
+size_t stat_cache::size() const
+{
+    size_t total = 0;
+    for(int i = 0; i < STAT_CACHE_SHARDS; i++)
+    {
+        total += m_shards[i].count;
+    }
+    return total;
+}
+
+void stat_cache::add_watch(const std::string& dir_url)
+{
+    std::string path = m_root + dir_url;
+    int wd = inotify_add_watch(m_inotify_fd, path.c_str(), WATCH_EVENTS);
+    if(wd < 0)
+    {
+        LOG_WARN("inotify_add_watch %s failed: %s", path.c_str(), strerror(errno));
+        return;
+    }
+    m_watches[wd] = dir_url;
+
+    DIR* dir = opendir(path.c_str());
+    if(!dir) return;
+    struct dirent* d;
+    while((d = readdir(dir)) != NULL)
+    {
+        if(d->d_type != DT_DIR || strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) continue;
+        add_watch(dir_url + "/" + d->d_name);
+    }
+    closedir(dir);
+}
+
+bool stat_cache::watch()
+{
+    m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(m_inotify_fd < 0) return false;
+    m_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if(m_stop_fd < 0)
+    {
+        close(m_inotify_fd);
+        m_inotify_fd = -1;
+        return false;
+    }
+    add_watch("");
+    if(m_watches.empty() || pthread_create(&m_watch_tid, NULL, watch_thread, this) != 0)
+    {
+        close(m_inotify_fd);
+        close(m_stop_fd);
+        m_inotify_fd = m_stop_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void* stat_cache::watch_thread(void* arg)
+{
+    ((stat_cache*)arg)->watch_loop();
+    return NULL;
+}
+
+void stat_cache::watch_loop()
+{
+    char buf[16 * 1024] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+    struct pollfd fds[2];
+    fds[0].fd = m_inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_stop_fd;
+    fds[1].events = POLLIN;
+    while(1)
+    {
+        if(poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR) continue;
+            break;
+        }
+        if(fds[1].revents) break;
+
+        ssize_t n;
+        while((n = read(m_inotify_fd, buf, sizeof(buf))) > 0)
+        {
+            for(char* p = buf; p < buf + n; )
+            {
+                struct inotify_event* ev = (struct inotify_event*)p;
+                p += sizeof(struct inotify_event) + ev->len;
+
+                if(ev->mask & IN_Q_OVERFLOW)
+                {
+                    // 丢失了事件，不知道哪些文件变了
+                    clear();
+                    continue;
+                }
+                std::unordered_map< int, std::string >::iterator it = m_watches.find(ev->wd);
+                if(it == m_watches.end()) continue;
+                if(ev->mask & IN_IGNORED)
+                {
+                    m_watches.erase(it);
+                    continue;
+                }
+                if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+                {
+                    clear();
+                    continue;
+                }
+                if(ev->len == 0) continue;
+                std::string url = it->second + "/" + ev->name;
+                if(ev->mask & IN_ISDIR)
+                {
+                    // 目录的变化影响它下面所有的路径，包括之前缓存的不存在的结果
+                    if(ev->mask & (IN_CREATE | IN_MOVED_TO)) add_watch(url);
+                    clear();
+                    continue;
+                }
+                invalidate(url);
+            }
+        }
+    }
+}
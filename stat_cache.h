@@ -0,0 +1,106 @@
+#ifndef STAT_CACHE_H
+#define STAT_CACHE_H
+
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+
+/*
+    文件元数据缓存，放在do_request的最前面，命中时不需要拼路径之外的任何系统调用（stat、open、close）。
+    以规范化之后的URL为键，值是完整路径、stat信息、只读打开的文件描述符和MIME类型。
+    文件不存在、没有权限和目录这些结果也一样缓存，扫描器反复请求不存在的路径时不会每次都访问文件系统。
+
+    缓存项的失效有两种方式：
+    1. inotify监视doc_root下的所有目录，文件被修改、替换、删除或者新建时，后台线程立即删除对应的缓存项，
+       目录被新建、删除、改名或者事件队列溢出时清空整个缓存
+    2. 每个缓存项最多使用ttl秒，inotify不可用（比如超过了监视数量的上限）时也不会一直使用过期的信息
+
+    和file_cache一样按URL的哈希值分片，每个分片有自己的锁、哈希表和LRU链表，缓存项的总数有上限。
+    缓存项带引用计数，连接用sendfile发送文件期间缓存项即使被删除，文件描述符也不会被关闭。
+*/
+
+#define STAT_CACHE_SHARDS 16
+
+class stat_cache {
+public:
+    enum STATUS { OK = 0, NOT_FOUND, FORBIDDEN, IS_DIR };
+
+    struct entry {
+        std::string url;        // 规范化之后的URL
+        std::string path;       // 完整路径
+        int status;             // STATUS
+        struct stat st;         // status为OK时有效
+        int fd;                 // 只读打开的文件，status为OK时有效，最后一个引用释放时关闭
+        const char* mime;       // 按扩展名得到的MIME类型
+        time_t loaded;          // 读取元数据的时间，超过ttl之后重新读取
+        std::atomic<int> refs;  // 引用计数
+        entry* prev;            // LRU链表，表头是最近使用的
+        entry* next;
+    };
+
+    stat_cache(const char* root, int ttl, size_t max_entries);
+    ~stat_cache();
+
+    // 开始用inotify监视根目录，失败时返回false，只能依靠ttl失效
+    bool watch();
+
+    // 查找url对应的缓存项，没有命中或者已经过期时读取path的元数据并加入缓存。返回增加了引用计数的缓存项
+    entry* acquire(const char* url, const char* path);
+    // 不经过缓存读取path的元数据，返回只有调用者一个引用的缓存项，不使用缓存时代替acquire
+    static entry* load(const char* url, const char* path);
+    // 释放引用
+    static void release(entry* e);
+
+    // 删除url对应的缓存项，由inotify线程调用
+    void invalidate(const std::string& url);
+    // 清空缓存
+    void clear();
+
+    // 统计信息
+    unsigned long hits() const { return m_hits; }
+    unsigned long misses() const { return m_misses; }
+    unsigned long invalidations() const { return m_invalidations; }
+    size_t size() const;
+
+private:
+    struct shard {
+        locker lock;
+        std::unordered_map< std::string, entry* > map;
+        entry* head;
+        entry* tail;
+        size_t count;
+    };
+
+    shard* get_shard(const std::string& url);
+    void unlink(shard* s, entry* e);
+    void push_front(shard* s, entry* e);
+    // 把缓存项从分片中移除，调用者持有分片的锁，缓存本身的引用由调用者在锁外释放
+    void remove(shard* s, entry* e);
+
+    static void* watch_thread(void* arg);
+    void watch_loop();
+    // 监视dir_url对应的目录和它下面的所有子目录
+    void add_watch(const std::string& dir_url);
+
+private:
+    std::string m_root;
+    int m_ttl;
+    size_t m_shard_max;     // 每个分片最多的缓存项数
+    shard m_shards[STAT_CACHE_SHARDS];
+
+    int m_inotify_fd;
+    int m_stop_fd;          // eventfd，析构时通知inotify线程退出
+    pthread_t m_watch_tid;
+    std::unordered_map< int, std::string > m_watches;   // inotify监视描述符到目录URL的映射，只由inotify线程使用
+
+    std::atomic<unsigned long> m_hits;
+    std::atomic<unsigned long> m_misses;
+    std::atomic<unsigned long> m_invalidations;
+};
+
+#endif
@@ -0,0 +1,214 @@
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "locker.h"
+
+__thread thread_stats* t_stats = NULL;
+
+static locker stats_lock;                       // 只在注册线程和统计来源时使用
+static std::atomic<thread_stats*> stats_head( NULL );
+static std::vector< void (*)( std::string& ) > stats_sources;
+
+int latency_histogram::bucket( unsigned long ns )
+{
+    if( ns < (unsigned long)SUB_BUCKETS ) return ns;
+    int msb = 63 - __builtin_clzl( ns );
+    if( msb >= MAX_BITS ) return BUCKETS - 1;
+    int shift = msb - SUB_BITS;
+    // ns >> shift在[SUB_BUCKETS, 2 * SUB_BUCKETS)之间
+    return ( shift + 1 ) * SUB_BUCKETS + (int)( ns >> shift ) - SUB_BUCKETS;
+}
+
+unsigned long latency_histogram::upper_bound( int index )
+{
+    if( index < SUB_BUCKETS ) return index;
+    int shift = index / SUB_BUCKETS - 1;
+    unsigned long sub = index % SUB_BUCKETS + SUB_BUCKETS;
+    return ( ( sub + 1 ) << shift ) - 1;
+}
+
+void latency_histogram::record( long ns )
+{
+    if( ns < 0 ) ns = 0;
+    m_counts[ bucket( ns ) ].add();
+    m_count.add();
+    m_sum.add( ns );
+}
+
+void latency_histogram::merge( unsigned long* counts, unsigned long* count, unsigned long* sum ) const
+{
+    for( int i = 0; i < BUCKETS; ++i ) {
+        counts[i] += m_counts[i].get();
+    }
+    *count += m_count.get();
+    *sum += m_sum.get();
+}
+
+void thread_stats::count_request( int status )
+{
+    int i = 0;
+    while( i < STATUS_COUNT && STATUS_CODES[i] != status ) ++i;
+    requests[i].add();
+}
+
+thread_stats* register_thread_stats()
+{
+    thread_stats* s = new thread_stats;
+    stats_lock.lock();
+    s->next = stats_head.load( std::memory_order_relaxed );
+    // release：读取链表的线程看到新节点时，它的计数器已经初始化好了
+    stats_head.store( s, std::memory_order_release );
+    stats_lock.unlock();
+    t_stats = s;
+    return s;
+}
+
+void add_stats_source( void (*source)( std::string& out ) )
+{
+    stats_lock.lock();
+    stats_sources.push_back( source );
+    stats_lock.unlock();
+}
+
+void write_metric_header( std::string& out, const char* name, const char* type, const char* help )
+{
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void write_metric_value( std::string& out, const char* name, const char* labels, double value )
+{
+    char buf[256];
+    // 计数按整数输出，时间保留9位有效数字（纳秒精度）
+    if( value == (double)(long)value ) {
+        snprintf( buf, sizeof( buf ), "%s%s %ld\n", name, labels, (long)value );
+    } else {
+        snprintf( buf, sizeof( buf ), "%s%s %.9g\n", name, labels, value );
+    }
+    out += buf;
+}
+
+void write_metric( std::string& out, const char* name, const char* type, const char* help, double value )
+{
+    write_metric_header( out, name, type, help );
+    write_metric_value( out, name, "", value );
+}
+
+double histogram_quantile( const histogram_sum& h, double q )
+{
+    if( h.count == 0 ) return 0;
+    // 第target个值，target = ceil(q * count)
+    unsigned long target = (unsigned long)( q * h.count );
+    if( target < q * h.count || target == 0 ) target++;
+    unsigned long seen = 0;
+    for( int i = 0; i < latency_histogram::BUCKETS; ++i ) {
+        seen += h.counts[i];
+        if( seen >= target ) return latency_histogram::upper_bound( i ) * 1e-9;
+    }
+    return latency_histogram::upper_bound( latency_histogram::BUCKETS - 1 ) * 1e-9;
+}
+
+/*
+    Prometheus的直方图。细分的桶太多，输出时只在2的幂（256纳秒到2^36纳秒）处给出累计数，
+    这些边界和细分的桶对齐，累计数是准确的。细分的桶用来计算精确一些的分位数，另外输出
+*/
+static void write_histogram( std::string& out, const char* name, const char* help, const histogram_sum& h )
+{
+    char bucket_name[128];
+    char labels[64];
+    snprintf( bucket_name, sizeof( bucket_name ), "%s_bucket", name );
+    write_metric_header( out, name, "histogram", help );
+    unsigned long cumulative = 0;
+    int i = 0;
+    for( int k = 8; k <= 36; ++k ) {
+        int end = latency_histogram::bucket( 1UL << k );
+        while( i < end ) cumulative += h.counts[i++];
+        snprintf( labels, sizeof( labels ), "{le=\"%.9g\"}", ( 1UL << k ) * 1e-9 );
+        write_metric_value( out, bucket_name, labels, cumulative );
+    }
+    write_metric_value( out, bucket_name, "{le=\"+Inf\"}", h.count );
+    snprintf( bucket_name, sizeof( bucket_name ), "%s_sum", name );
+    write_metric_value( out, bucket_name, "", h.sum * 1e-9 );
+    snprintf( bucket_name, sizeof( bucket_name ), "%s_count", name );
+    write_metric_value( out, bucket_name, "", h.count );
+}
+
+std::string render_stats()
+{
+    unsigned long accepts = 0, bytes_sent = 0, expirations = 0;
+    unsigned long requests[STATUS_COUNT + 1];
+    unsigned long shed[SHED_REASON_COUNT];
+    memset( requests, 0, sizeof( requests ) );
+    memset( shed, 0, sizeof( shed ) );
+    // 所有线程的三个直方图之和有将近15KB，不放在栈上
+    std::vector< histogram_sum > hists( 3 );
+    memset( &hists[0], 0, sizeof( histogram_sum ) * hists.size() );
+
+    for( thread_stats* s = stats_head.load( std::memory_order_acquire ); s; s = s->next ) {
+        accepts += s->accepts.get();
+        bytes_sent += s->bytes_sent.get();
+        expirations += s->timer_expirations.get();
+        for( int i = 0; i <= STATUS_COUNT; ++i ) {
+            requests[i] += s->requests[i].get();
+        }
+        for( int i = 0; i < SHED_REASON_COUNT; ++i ) {
+            shed[i] += s->shed[i].get();
+        }
+        s->queue_wait.merge( hists[0].counts, &hists[0].count, &hists[0].sum );
+        s->handle.merge( hists[1].counts, &hists[1].count, &hists[1].sum );
+        s->ttlb.merge( hists[2].counts, &hists[2].count, &hists[2].sum );
+    }
+
+    std::string out;
+    out.reserve( 16 * 1024 );
+    write_metric( out, "webserver_accepts_total", "counter", "Connections accepted.", accepts );
+    write_metric_header( out, "webserver_requests_total", "counter", "Requests answered, by status code." );
+    char labels[32];
+    for( int i = 0; i < STATUS_COUNT; ++i ) {
+        snprintf( labels, sizeof( labels ), "{code=\"%d\"}", STATUS_CODES[i] );
+        write_metric_value( out, "webserver_requests_total", labels, requests[i] );
+    }
+    write_metric_value( out, "webserver_requests_total", "{code=\"other\"}", requests[STATUS_COUNT] );
+    write_metric( out, "webserver_sent_bytes_total", "counter", "Response bytes written to sockets.", bytes_sent );
+    write_metric( out, "webserver_timer_expirations_total", "counter", "Connections closed by the idle timer.", expirations );
+    write_metric_header( out, "webserver_shed_total", "counter", "Requests answered with 503 because the thread pool was overloaded, by reason." );
+    write_metric_value( out, "webserver_shed_total", "{reason=\"queue_depth\"}", shed[SHED_QUEUE_DEPTH] );
+    write_metric_value( out, "webserver_shed_total", "{reason=\"queue_wait\"}", shed[SHED_QUEUE_WAIT] );
+
+    static const char* const names[3] = { "webserver_queue_wait_seconds", "webserver_handle_seconds", "webserver_response_seconds" };
+    static const char* const helps[3] = {
+        "Time a connection waited in the thread pool queue.",
+        "Time to handle a request: parsing, file lookup and reads, on-the-fly gzip on a cache miss, and queueing the response headers.",
+        "Time from receiving a request to sending the last byte of its response.",
+    };
+    for( int i = 0; i < 3; ++i ) {
+        write_histogram( out, names[i], helps[i], hists[i] );
+    }
+    write_metric_header( out, "webserver_latency_quantile_seconds", "gauge", "Latency quantiles from the fine-grained histograms." );
+    static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+    for( int i = 0; i < 3; ++i ) {
+        // 去掉前缀webserver_和后缀_seconds作为标签
+        std::string hist( names[i] + 10, strlen( names[i] ) - 10 - 8 );
+        for( size_t j = 0; j < sizeof( qs ) / sizeof( qs[0] ); ++j ) {
+            char buf[96];
+            snprintf( buf, sizeof( buf ), "{histogram=\"%s\",quantile=\"%g\"}", hist.c_str(), qs[j] );
+            write_metric_value( out, "webserver_latency_quantile_seconds", buf, histogram_quantile( hists[i], qs[j] ) );
+        }
+    }
+
+    stats_lock.lock();
+    std::vector< void (*)( std::string& ) > sources = stats_sources;
+    stats_lock.unlock();
+    for( size_t i = 0; i < sources.size(); ++i ) {
+        sources[i]( out );
+    }
+    return out;
+}
@@ -0,0 +1,118 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <time.h>
+#include <atomic>
+#include <string>
+#include "mpmc_queue.h"
+
+/*
+    运行统计。每个线程（reactor和工作线程）有自己的一组计数器和延迟直方图，只由这个线程自己修改，
+    修改时是普通的读加写（relaxed的load和store），不需要加锁，也没有lock前缀的原子指令。
+    访问/__stats时才把所有线程的数据加起来，以Prometheus的文本格式输出。读的时候不加锁，
+    只会读到某个线程稍早一点的值，不会读到一半的值。线程第一次使用统计时注册，之后一直保留，
+    线程退出之后它的计数仍然计入总数。
+
+    延迟直方图是HDR风格的对数线性分桶：每个2的幂区间再均分成16个桶，相对误差不超过1/16，
+    从1纳秒到2^41纳秒（约36分钟）一共608个桶，记录一个值只需要一次clz和几次加法。
+*/
+
+#define STATS_URL "/__stats"
+#define STATS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+// 单调时钟的纳秒数
+inline long monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// 只由一个线程修改的计数器，其他线程可以随时读
+class stat_counter {
+public:
+    stat_counter() : m_value( 0 ) {}
+    void add( unsigned long n = 1 ) { m_value.store( m_value.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed ); }
+    unsigned long get() const { return m_value.load( std::memory_order_relaxed ); }
+    void set( unsigned long v ) { m_value.store( v, std::memory_order_relaxed ); }
+
+private:
+    std::atomic<unsigned long> m_value;
+};
+
+class latency_histogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_BITS = 41;
+    static const int BUCKETS = ( MAX_BITS - SUB_BITS + 1 ) * SUB_BUCKETS;
+
+    // 记录一个以纳秒为单位的值，只能由所属的线程调用
+    void record( long ns );
+    // 把计数加到counts（BUCKETS个元素）、count和sum上
+    void merge( unsigned long* counts, unsigned long* count, unsigned long* sum ) const;
+
+    // 值所在的桶
+    static int bucket( unsigned long ns );
+    // 桶中最大的值
+    static unsigned long upper_bound( int index );
+
+private:
+    stat_counter m_counts[BUCKETS];
+    stat_counter m_count;
+    stat_counter m_sum;
+};
+
+// 多个直方图之和
+struct histogram_sum {
+    unsigned long counts[latency_histogram::BUCKETS];
+    unsigned long count;
+    unsigned long sum;
+};
+
+// 不超过q的比例的值落在哪个桶，返回这个桶中最大的值（秒）
+double histogram_quantile( const histogram_sum& h, double q );
+
+// 按状态码统计的请求数，STATUS_CODES中没有的状态码计入最后一项
+static const int STATUS_CODES[] = { 200, 206, 304, 400, 403, 404, 416, 500, 503 };
+static const int STATUS_COUNT = sizeof( STATUS_CODES ) / sizeof( STATUS_CODES[0] );
+
+// 过载时拒绝请求的原因：线程池队列满了，或者队列中的等待时间超过了上限
+enum shed_reason { SHED_QUEUE_DEPTH, SHED_QUEUE_WAIT, SHED_REASON_COUNT };
+
+struct alignas(CACHE_LINE_SIZE) thread_stats {
+    stat_counter accepts;               // 接受的连接数
+    stat_counter requests[STATUS_COUNT + 1];    // 按状态码统计的请求数
+    stat_counter bytes_sent;            // 发送的字节数（响应头和响应体）
+    stat_counter timer_expirations;     // 因为空闲超时被关闭的连接数
+    stat_counter shed[SHED_REASON_COUNT];   // 因为过载被回答503的请求数，按原因统计
+    latency_histogram queue_wait;       // 连接在线程池队列中等待的时间
+    latency_histogram handle;           // 处理一个请求的时间：解析、do_request（stat/open、读文件、缓存未命中时的gzip压缩、
+                                        // 生成统计页面）和生成应答头部，不包括排队和发送
+    latency_histogram ttlb;             // 从收到请求到应答的最后一个字节发送出去的时间
+    thread_stats* next;                 // 所有线程的统计链成一个链表
+
+    void count_request( int status );
+};
+
+// 当前线程的统计，第一次调用时注册
+extern __thread thread_stats* t_stats;
+thread_stats* register_thread_stats();
+inline thread_stats* local_stats()
+{
+    return t_stats ? t_stats : register_thread_stats();
+}
+
+// 输出一个指标（HELP、TYPE和值），type是counter或者gauge
+void write_metric( std::string& out, const char* name, const char* type, const char* help, double value );
+// 带标签的指标：先输出一次HELP和TYPE，再逐个输出值，labels形如{cache="file"}，没有标签时是空字符串
+void write_metric_header( std::string& out, const char* name, const char* type, const char* help );
+void write_metric_value( std::string& out, const char* name, const char* labels, double value );
+
+// 加入一个统计来源，生成/__stats时调用它输出线程统计之外的指标（连接数、队列长度、缓存等），启动时加入
+void add_stats_source( void (*source)( std::string& out ) );
+
+// 汇总所有线程的统计，生成Prometheus文本格式的内容
+std::string render_stats();
+
+#endif
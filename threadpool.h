@@ -2,22 +2,64 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
-#include <list>
 #include <exception>
 #include <cstdio>
+#include <atomic>
+#include <unistd.h>
 #include "locker.h"
+#include "mpmc_queue.h"
+#include "ws_deque.h"
+#include "log.h"
 
-// 线程池类，定义成模板类是为了代码的复用，模板参数T是任务类
+#define WORKER_SPIN_COUNT 64    // 队列为空时，工作线程在睡眠之前自旋重试的次数（单核机器上不自旋）
+#define WS_BATCH 32             // 工作窃取模式下，每次从收件箱移到本地队列的最多任务数
+
+/*
+    线程池类，定义成模板类是为了代码的复用，模板参数T是任务类
+    请求队列是无锁的环形队列mpmc_queue，append和run都不需要加锁，也不需要为每个任务分配链表节点。
+    只有队列为空时工作线程才会在futex上睡眠（见event_count）：
+        工作线程先把m_idle加一，再检查一次队列，仍然为空才睡眠；
+        append先把任务放入队列，再检查m_idle，有线程在睡眠时才唤醒其中一个。
+    两边都是先写后读，中间用seq_cst栅栏隔开，所以要么工作线程看到新任务，要么append看到有线程在睡眠，
+    不会出现任务在队列中而所有线程都在睡眠的情况。队列一直有任务时append和run都不会进入内核。
+
+    工作窃取模式（work_stealing为true）下没有全局队列，每个工作线程有自己的收件箱和本地双端队列：
+        append根据hint（一般是连接的fd）选择一个工作线程，把任务放进它的收件箱，
+        同一个连接的请求总是由同一个线程处理，连接的数据留在这个线程所在核的缓存中；
+        工作线程把收件箱中的任务成批移到本地队列ws_deque中，从底部依次取出处理；
+        自己没有任务时，从其他线程本地队列的顶部或者收件箱中窃取任务。
+    两种模式都用m_pending限制等待处理的请求总数不超过m_max_requests。
+*/
 template<typename T>
 class threadpool {
 public:
-    threadpool(int thread_num=8, int max_requests=10000);
+    threadpool(int thread_num=8, int max_requests=10000, bool work_stealing=false);
     ~threadpool();
-    bool append(T* request);
+    // hint只在工作窃取模式下使用，决定任务交给哪个工作线程，小于0时轮流分配
+    bool append(T* request, int hint = -1);
+    // 已经放入队列、还没有被工作线程取出的请求数量
+    int pending() const { return m_pending.load(std::memory_order_relaxed); }
 
 private:
+    // 每个工作线程的数据，单独占用缓存行
+    struct alignas(CACHE_LINE_SIZE) worker_slot {
+        threadpool* pool;
+        int index;
+        mpmc_queue< T* >* inbox;        // reactor放入的任务
+        ws_deque< T* >* deque;          // 本地队列，其他线程可以从顶部窃取
+        std::atomic<bool> sleeping;     // 是否正在睡眠或准备睡眠
+        event_count wakeup;
+    };
+
     static void* worker(void * arg);
-    void run();
+    void run(worker_slot* slot);
+    // 从队列中取出一个任务，队列为空时睡眠，被唤醒后返回false
+    bool take(T*& request);
+    // 工作窃取模式下的take
+    bool take_local(worker_slot* slot, T*& request);
+    bool find_task(worker_slot* slot, T*& request);
+    // 唤醒k号之后的第一个睡眠中的工作线程
+    void wake_idle(int k);
 
 private:
     // 线程数量
@@ -29,43 +71,74 @@ private:
     // 请求队列中最多允许的，等待处理的请求数量
     int m_max_requests;
 
-    // 请求队列
-    std::list< T*> m_workqueue;
+    // 已经放入队列、还没有被工作线程取出的请求数量
+    std::atomic<int> m_pending;
+
+    // 请求队列，工作窃取模式下不使用
+    mpmc_queue< T* > m_workqueue;
+
+    // 空闲的工作线程在这里睡眠，工作窃取模式下每个线程在自己的worker_slot中睡眠
+    event_count m_wakeup;
 
-    // 互斥锁
-    locker m_queuelocker;
+    // 是否使用工作窃取模式
+    bool m_work_stealing;
 
-    // 信号量，用来判断是否有任务需要处理
-    sem m_queuestat;   // 信号量初始化的值为0
+    // 每个工作线程的数据，大小为m_thread_number
+    worker_slot* m_slots;
+
+    // hint小于0时轮流分配任务
+    std::atomic<unsigned> m_next;
+
+    // 睡眠之前自旋重试的次数
+    int m_spin_count;
+
+    // 正在睡眠或准备睡眠的工作线程数量
+    std::atomic<int> m_idle;
 
     // 是否结束线程
-    bool m_stop;
+    std::atomic<bool> m_stop;
 };
 
 template<typename T>
-threadpool<T>::threadpool(int thread_num, int max_requests): m_thread_number(thread_num), m_max_requests(max_requests),
-                                                            m_stop(false), m_threads(NULL)
+threadpool<T>::threadpool(int thread_num, int max_requests, bool work_stealing): m_thread_number(thread_num), m_threads(NULL),
+                                                            m_max_requests(max_requests), m_pending(0),
+                                                            m_workqueue(work_stealing || max_requests <= 0 ? 1 : max_requests),
+                                                            m_work_stealing(work_stealing), m_slots(NULL), m_next(0),
+                                                            m_spin_count(WORKER_SPIN_COUNT), m_idle(0), m_stop(false)
     {
         if((thread_num <= 0)||(max_requests <= 0)) throw std::exception();
 
+        // 只有一个CPU时，自旋期间生产者不可能在运行，自旋没有意义
+        if(sysconf(_SC_NPROCESSORS_ONLN) <= 1) m_spin_count = 0;
+
+        m_slots = new worker_slot[m_thread_number];
+        for(int i = 0; i < thread_num; i++)
+        {
+            m_slots[i].pool = this;
+            m_slots[i].index = i;
+            m_slots[i].inbox = NULL;
+            m_slots[i].deque = NULL;
+            m_slots[i].sleeping = false;
+            if(work_stealing)
+            {
+                // 收件箱的容量不小于m_max_requests，通过了m_pending检查的任务一定放得进去
+                m_slots[i].inbox = new mpmc_queue< T* >(max_requests);
+                m_slots[i].deque = new ws_deque< T* >(WS_BATCH);
+            }
+        }
+
         m_threads = new pthread_t[m_thread_number];  // 初始化线程数组
         if(!m_threads) throw std::exception();
-        // 创建thread_number个线程，并将它们设置为线程脱离
+        // 创建thread_number个线程，析构时等待它们退出
         for(int i = 0;i < thread_num; i++)
         {
-            printf("create the %dth thread\n",i);
+            LOG_DEBUG("create the %dth thread", i);
 
-            if(pthread_create(m_threads +i, NULL, worker, this) != 0 )
+            if(pthread_create(m_threads +i, NULL, worker, m_slots + i) != 0 )
             {
                 delete [] m_threads;
                 throw std::exception();
             }
-
-            if(pthread_detach(m_threads[i]))
-            {
-                delete[] m_threads;
-                throw std::exception();
-            }
         }
     }
 
@@ -73,52 +146,185 @@ threadpool<T>::threadpool(int thread_num, int max_requests): m_thread_number(thr
 template<typename T>
 threadpool<T>::~threadpool()
 {
-    delete [] m_threads;
+    // 设置结束标志，并唤醒所有睡眠中的工作线程
     m_stop = true;
+    m_wakeup.notify_all();
+    for(int i = 0; i < m_thread_number; i++)
+    {
+        m_slots[i].wakeup.notify_all();
+    }
+    for(int i = 0; i < m_thread_number; i++)
+    {
+        pthread_join(m_threads[i], NULL);
+    }
+    for(int i = 0; i < m_thread_number; i++)
+    {
+        delete m_slots[i].inbox;
+        delete m_slots[i].deque;
+    }
+    delete [] m_slots;
+    delete [] m_threads;
 }
 
 template<typename T>
-bool threadpool<T>::append(T * request)
+bool threadpool<T>::append(T * request, int hint)
 {
-    // 操作工作队列时一定要加锁，因为它被所有线程共享
-    m_queuelocker.lock();
-    if(m_workqueue.size() > m_max_requests)
+    // 等待处理的请求太多，拒绝这个请求
+    if(m_pending.fetch_add(1, std::memory_order_relaxed) >= m_max_requests)
     {
-        m_queuelocker.unlock();
+        m_pending.fetch_sub(1, std::memory_order_relaxed);
         return false;
     }
 
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();   // 信号量加一
+    if(!m_work_stealing)
+    {
+        if(!m_workqueue.push(request))
+        {
+            m_pending.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        // 有工作线程在睡眠时才唤醒其中一个
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(m_idle.load(std::memory_order_relaxed) > 0)
+        {
+            m_wakeup.notify_one();
+        }
+        return true;
+    }
+
+    unsigned k = hint >= 0 ? (unsigned)hint : m_next.fetch_add(1, std::memory_order_relaxed);
+    worker_slot* slot = &m_slots[k % m_thread_number];
+    if(!slot->inbox->push(request))
+    {
+        m_pending.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // 目标线程在睡眠就唤醒它，否则它正忙，唤醒另一个空闲的线程来窃取
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(slot->sleeping.load(std::memory_order_relaxed))
+    {
+        slot->wakeup.notify_one();
+    }
+    else if(m_idle.load(std::memory_order_relaxed) > 0)
+    {
+        wake_idle(slot->index);
+    }
 
     return true;
 }
 
+template<typename T>
+void threadpool<T>::wake_idle(int k)
+{
+    for(int i = 1; i < m_thread_number; i++)
+    {
+        worker_slot* slot = &m_slots[(k + i) % m_thread_number];
+        if(slot->sleeping.load(std::memory_order_relaxed))
+        {
+            slot->wakeup.notify_one();
+            return;
+        }
+    }
+}
+
 template<typename T>
 void* threadpool<T>::worker(void *arg)
 {
-    threadpool * pool = (threadpool *) arg;
-    pool->run();
-    return pool;
+    worker_slot * slot = (worker_slot *) arg;
+    slot->pool->run(slot);
+    return slot->pool;
 }
 
 template<typename T>
-void threadpool<T>::run()
+bool threadpool<T>::take(T*& request)
 {
-    while(!m_stop)
+    // 任务往往是成批到达的，先自旋几次，避免刚处理完一个任务就进入内核睡眠
+    for(int i = 0; i < m_spin_count; i++)
     {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if(m_workqueue.empty())
+        if(m_workqueue.pop(request)) return true;
+        cpu_relax();
+    }
+
+    m_idle.fetch_add(1);
+    int key = m_wakeup.prepare_wait();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // 登记为空闲之后再检查一次队列，避免错过在此之前放入的任务
+    bool got = m_workqueue.pop(request);
+    if(got || m_stop)
+    {
+        m_idle.fetch_sub(1);
+        return got;
+    }
+    m_wakeup.wait(key);
+    m_idle.fetch_sub(1);
+    return false;
+}
+
+template<typename T>
+bool threadpool<T>::find_task(worker_slot* slot, T*& request)
+{
+    if(slot->deque->pop(request)) return true;
+
+    // 本地队列空了，把收件箱中的任务成批移过来。倒序放入，使得从底部取出的顺序和到达的顺序一致，
+    // 窃取者从顶部拿走的是最新的任务
+    T* batch[WS_BATCH];
+    int n = 0;
+    while(n < WS_BATCH && slot->inbox->pop(batch[n])) n++;
+    if(n > 0)
+    {
+        request = batch[0];
+        for(int i = n - 1; i >= 1; i--)
         {
-            m_queuelocker.unlock();
-            continue;
+            slot->deque->push(batch[i]);
         }
+        return true;
+    }
+
+    // 自己没有任务，从其他线程窃取
+    for(int i = 1; i < m_thread_number; i++)
+    {
+        worker_slot* victim = &m_slots[(slot->index + i) % m_thread_number];
+        if(victim->deque->steal(request)) return true;
+        if(victim->inbox->pop(request)) return true;
+    }
+    return false;
+}
 
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
+template<typename T>
+bool threadpool<T>::take_local(worker_slot* slot, T*& request)
+{
+    for(int i = 0; i < m_spin_count; i++)
+    {
+        if(find_task(slot, request)) return true;
+        cpu_relax();
+    }
+
+    // 和take一样，先登记为睡眠再检查一次，append在放入任务之后检查sleeping
+    slot->sleeping.store(true);
+    m_idle.fetch_add(1);
+    int key = slot->wakeup.prepare_wait();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool got = find_task(slot, request);
+    if(!got && !m_stop)
+    {
+        slot->wakeup.wait(key);
+    }
+    m_idle.fetch_sub(1);
+    slot->sleeping.store(false);
+    return got;
+}
+
+template<typename T>
+void threadpool<T>::run(worker_slot* slot)
+{
+    while(!m_stop)
+    {
+        T* request = NULL;
+        bool got = m_work_stealing ? take_local(slot, request) : take(request);
+        if(!got) continue;
+        m_pending.fetch_sub(1, std::memory_order_relaxed);
 
         if(!request) continue;
 
@@ -128,4 +334,4 @@ void threadpool<T>::run()
 }
 
 
-#endif
\ No newline at end of file
+#endif
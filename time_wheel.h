@@ -0,0 +1,222 @@
+#ifndef TIME_WHEEL_H
+#define TIME_WHEEL_H
+
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include "http_conn.h"
+
+// 单调时钟的当前时间（毫秒），不受系统时间调整的影响
+inline time_t current_ms() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (time_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+    分层时间轮，用来代替升序链表 sort_timer_lst。
+    sort_timer_lst 的 add_timer 和 adjust_timer 都要遍历链表，连接数多的时候每次请求都是O(n)的开销，
+    时间轮把定时器按超时时间散列到槽中，添加、调整、删除都是O(1)。
+
+    时间轮共4层：第0层256个槽，每个槽代表1个滴答；第1~3层各64个槽，每个槽分别代表256、256*64、
+    256*64*64个滴答。第0层转完一圈时，把上一层对应槽中的定时器重新散列到下一层（cascade）。
+    超时时间和tick的参数使用同一个时间单位（毫秒，取自CLOCK_MONOTONIC，见current_ms），
+    每个滴答就是一个时间单位。
+
+    每个槽是一个带哨兵节点的双向循环链表，定时器节点复用 util_timer 的 prev/next 指针，
+    所以删除定时器时不需要知道它在哪个槽里。定时器节点从节点池中分配，不再每个连接 new 一次。
+*/
+class time_wheel {
+public:
+    static const int TV0_BITS = 8;
+    static const int TVN_BITS = 6;
+    static const int TV0_SIZE = 1 << TV0_BITS;  // 第0层的槽数
+    static const int TVN_SIZE = 1 << TVN_BITS;  // 其他层的槽数
+    static const int LEVELS = 4;
+    static const int POOL_CHUNK = 1024;         // 节点池每次扩充的节点数
+
+    explicit time_wheel( time_t now = current_ms() ) : m_current( now ), m_count( 0 ), m_free( NULL ) {
+        for( int i = 0; i < TV0_SIZE; ++i ) {
+            init_slot( &m_tv0[i] );
+        }
+        for( int l = 0; l < LEVELS - 1; ++l ) {
+            for( int i = 0; i < TVN_SIZE; ++i ) {
+                init_slot( &m_tvn[l][i] );
+            }
+        }
+    }
+
+    // 时间轮被销毁时，释放节点池中的所有节点
+    ~time_wheel() {
+        for( size_t i = 0; i < m_chunks.size(); ++i ) {
+            delete [] m_chunks[i];
+        }
+    }
+
+    // 从节点池中分配一个定时器节点
+    util_timer* create_timer() {
+        if( !m_free ) {
+            util_timer* chunk = new util_timer[POOL_CHUNK];
+            m_chunks.push_back( chunk );
+            for( int i = 0; i < POOL_CHUNK; ++i ) {
+                chunk[i].next = m_free;
+                m_free = &chunk[i];
+            }
+        }
+        util_timer* timer = m_free;
+        m_free = timer->next;
+        timer->prev = timer->next = NULL;
+        timer->user_data = NULL;
+        return timer;
+    }
+
+    // 将目标定时器timer添加到时间轮中
+    void add_timer( util_timer* timer ) {
+        if( !timer ) {
+            return;
+        }
+        place( timer );
+        m_count++;
+    }
+
+    // 定时器的超时时间发生变化后（延长或缩短都可以），把它移动到新的槽中
+    void adjust_timer( util_timer* timer ) {
+        if( !timer ) {
+            return;
+        }
+        unlink( timer );
+        place( timer );
+    }
+
+    // 将目标定时器 timer 从时间轮中删除，节点归还给节点池
+    void del_timer( util_timer* timer ) {
+        if( !timer ) {
+            return;
+        }
+        unlink( timer );
+        m_count--;
+        release( timer );
+    }
+
+    // 定时器到期时的回调函数，回调函数负责关闭连接，也可以为连接重新添加定时器
+    typedef void (*expire_cb)( http_conn* conn, void* arg );
+
+    // 处理到期的定时器
+    void tick( expire_cb expire, void* arg ) {
+        tick( current_ms(), expire, arg );
+    }
+
+    // 处理超时时间不晚于now的所有定时器
+    void tick( time_t now, expire_cb expire, void* arg ) {
+        if( m_count == 0 ) {
+            // 时间轮为空时直接跳到当前时间，避免长时间空闲后逐个滴答地空转
+            if( now >= m_current ) {
+                m_current = now + 1;
+            }
+            return;
+        }
+        while( m_current <= now ) {
+            int index = (int)( m_current & ( TV0_SIZE - 1 ) );
+            // 第0层转完一圈，从上层取下一批定时器重新散列
+            if( index == 0 ) {
+                for( int l = 0; l < LEVELS - 1; ++l ) {
+                    int slot = (int)( ( m_current >> ( TV0_BITS + l * TVN_BITS ) ) & ( TVN_SIZE - 1 ) );
+                    cascade( &m_tvn[l][slot] );
+                    if( slot != 0 ) {
+                        break;
+                    }
+                }
+            }
+
+            util_timer* head = &m_tv0[index];
+            while( head->next != head ) {
+                util_timer* tmp = head->next;
+                unlink( tmp );
+                m_count--;
+                // 调用定时器的回调函数，以执行定时任务
+                http_conn* conn = tmp->user_data;
+                conn->timer = NULL;
+                release( tmp );
+                expire( conn, arg );
+            }
+            m_current++;
+            if( m_count == 0 && now >= m_current ) {
+                m_current = now + 1;
+            }
+        }
+    }
+
+    // 时间轮中定时器的数量
+    int size() const { return m_count; }
+
+private:
+    static void init_slot( util_timer* head ) {
+        head->prev = head->next = head;
+    }
+
+    static void unlink( util_timer* timer ) {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = timer->next = NULL;
+    }
+
+    static void link( util_timer* head, util_timer* timer ) {
+        timer->prev = head->prev;
+        timer->next = head;
+        head->prev->next = timer;
+        head->prev = timer;
+    }
+
+    // 根据超时时间和当前时间的差值，计算定时器应该放在哪一层的哪个槽中
+    void place( util_timer* timer ) {
+        time_t expire = timer->expire;
+        if( expire < m_current ) {
+            // 已经过期的定时器放到下一个要处理的槽中
+            expire = m_current;
+        }
+        time_t delta = expire - m_current;
+        if( delta < TV0_SIZE ) {
+            link( &m_tv0[ expire & ( TV0_SIZE - 1 ) ], timer );
+            return;
+        }
+        for( int l = 0; l < LEVELS - 1; ++l ) {
+            int shift = TV0_BITS + ( l + 1 ) * TVN_BITS;
+            if( l == LEVELS - 2 || delta < ( (time_t)1 << shift ) ) {
+                if( delta >= ( (time_t)1 << shift ) ) {
+                    // 超出时间轮范围的定时器先放在最高层最远的槽中，转到时会再次散列
+                    expire = m_current + ( (time_t)1 << shift ) - 1;
+                }
+                int slot = (int)( ( expire >> ( shift - TVN_BITS ) ) & ( TVN_SIZE - 1 ) );
+                link( &m_tvn[l][slot], timer );
+                return;
+            }
+        }
+    }
+
+    // 把一个高层槽中的定时器全部取出，按当前时间重新散列
+    void cascade( util_timer* head ) {
+        util_timer* tmp = head->next;
+        init_slot( head );
+        while( tmp != head ) {
+            util_timer* next = tmp->next;
+            place( tmp );
+            tmp = next;
+        }
+    }
+
+    void release( util_timer* timer ) {
+        timer->user_data = NULL;
+        timer->next = m_free;
+        m_free = timer;
+    }
+
+private:
+    time_t m_current;                           // 下一个要处理的滴答
+    int m_count;                                // 时间轮中定时器的数量
+    util_timer m_tv0[TV0_SIZE];                 // 第0层
+    util_timer m_tvn[LEVELS - 1][TVN_SIZE];     // 第1~3层
+    util_timer* m_free;                         // 节点池的空闲链表
+    std::vector< util_timer* > m_chunks;        // 节点池分配的所有内存块
+};
+
+#endif
@@ -0,0 +1,617 @@
+#include "uring_reactor.h"
+#include "reactor.h"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+/*
+    io_uring网络后端。和epoll后端相比，每个请求省掉了epoll_wait、反复recv直到EAGAIN、
+    多次epoll_ctl(EPOLL_CTL_MOD)这些系统调用：
+    1. 监听socket上挂一个multishot accept，一次提交持续产生新连接
+    2. 每个连接挂一个multishot recv，数据直接收到内核从provided buffer（优先使用buffer ring）中挑选的缓冲区里
+    3. 应答用一个sendmsg提交，m_iv中的响应头和文件内容在同一个请求里发出（MSG_WAITALL）
+    请求的解析和应答的生成仍然由http_conn完成，为了不在reactor和工作线程之间传递完成事件，
+    请求直接在reactor线程中处理，不经过线程池。
+
+    这里没有依赖liburing，直接使用io_uring_setup/io_uring_enter/io_uring_register系统调用。
+*/
+
+#define URING_ENTRIES 4096      // 提交队列的长度
+#define URING_BUF_COUNT 1024    // provided buffer的个数，必须是2的幂
+#define URING_BUF_SIZE 2048     // 每个provided buffer的大小
+#define URING_BUF_GROUP 0       // provided buffer ring的组号
+
+// user_data的编码：高8位是操作类型，低32位是fd，0留给不需要处理结果的请求（比如提供缓冲区）
+enum URING_OP { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_TIMER, OP_SIGNAL };
+
+static inline __u64 make_user_data(int op, int fd)
+{
+    return ((__u64)op << 56) | (__u32)fd;
+}
+
+static inline int user_data_op(__u64 data) { return (int)(data >> 56); }
+static inline int user_data_fd(__u64 data) { return (int)(__u32)data; }
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// 对内核共享的提交/完成队列的简单封装
+class io_ring {
+public:
+    io_ring() : m_fd(-1), m_sq_ptr(MAP_FAILED), m_cq_ptr(MAP_FAILED), m_sqes(NULL),
+                m_buf_ring(NULL), m_bufs(NULL), m_to_submit(0) {}
+    ~io_ring() { destroy(); }
+
+    bool init(unsigned entries);
+    void destroy();
+
+    struct io_uring_sqe* get_sqe();
+    int submit_and_wait(unsigned wait_nr);
+
+    // 完成队列的遍历
+    struct io_uring_cqe* peek_cqe();
+    void cqe_seen();
+
+    // 内核是否支持某个操作码
+    bool probe(int op);
+
+    // provided buffer ring
+    bool setup_buf_ring();
+    bool buf_ring_works();
+    char* buffer(int bid) { return m_bufs + (size_t)bid * URING_BUF_SIZE; }
+    void recycle_buffer(int bid);
+
+private:
+    int m_fd;
+    struct io_uring_params m_params;
+
+    void* m_sq_ptr;
+    size_t m_sq_len;
+    void* m_cq_ptr;
+    size_t m_cq_len;
+    struct io_uring_sqe* m_sqes;
+    size_t m_sqes_len;
+
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned* m_sq_mask;
+    unsigned* m_sq_array;
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned* m_cq_mask;
+    struct io_uring_cqe* m_cqes;
+
+    struct io_uring_buf_ring* m_buf_ring;
+    size_t m_buf_ring_len;
+    char* m_bufs;
+    unsigned short m_buf_tail;
+
+    unsigned m_to_submit;   // 已经填好但还没有提交给内核的sqe数量
+};
+
+bool io_ring::init(unsigned entries)
+{
+    memset(&m_params, 0, sizeof(m_params));
+    m_fd = io_uring_setup(entries, &m_params);
+    if(m_fd < 0) return false;
+
+    m_sq_len = m_params.sq_off.array + m_params.sq_entries * sizeof(unsigned);
+    m_cq_len = m_params.cq_off.cqes + m_params.cq_entries * sizeof(struct io_uring_cqe);
+    if(m_params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(m_cq_len > m_sq_len) m_sq_len = m_cq_len;
+        m_cq_len = m_sq_len;
+    }
+
+    m_sq_ptr = mmap(0, m_sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if(m_sq_ptr == MAP_FAILED) return false;
+
+    if(m_params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        m_cq_ptr = m_sq_ptr;
+    }
+    else
+    {
+        m_cq_ptr = mmap(0, m_cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if(m_cq_ptr == MAP_FAILED) return false;
+    }
+
+    m_sqes_len = m_params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = (struct io_uring_sqe*)mmap(0, m_sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                        m_fd, IORING_OFF_SQES);
+    if(m_sqes == MAP_FAILED)
+    {
+        m_sqes = NULL;
+        return false;
+    }
+
+    char* sq = (char*)m_sq_ptr;
+    m_sq_head = (unsigned*)(sq + m_params.sq_off.head);
+    m_sq_tail = (unsigned*)(sq + m_params.sq_off.tail);
+    m_sq_mask = (unsigned*)(sq + m_params.sq_off.ring_mask);
+    m_sq_array = (unsigned*)(sq + m_params.sq_off.array);
+
+    char* cq = (char*)m_cq_ptr;
+    m_cq_head = (unsigned*)(cq + m_params.cq_off.head);
+    m_cq_tail = (unsigned*)(cq + m_params.cq_off.tail);
+    m_cq_mask = (unsigned*)(cq + m_params.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe*)(cq + m_params.cq_off.cqes);
+    return true;
+}
+
+void io_ring::destroy()
+{
+    if(m_buf_ring)
+    {
+        munmap(m_buf_ring, m_buf_ring_len);
+        m_buf_ring = NULL;
+    }
+    if(m_bufs)
+    {
+        free(m_bufs);
+        m_bufs = NULL;
+    }
+    if(m_sqes)
+    {
+        munmap(m_sqes, m_sqes_len);
+        m_sqes = NULL;
+    }
+    if(m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr) munmap(m_cq_ptr, m_cq_len);
+    if(m_sq_ptr != MAP_FAILED) munmap(m_sq_ptr, m_sq_len);
+    m_cq_ptr = m_sq_ptr = MAP_FAILED;
+    if(m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+// 获取一个空闲的sqe，提交队列满时先把已有的sqe提交给内核
+struct io_uring_sqe* io_ring::get_sqe()
+{
+    unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *m_sq_tail + m_to_submit;
+    if(tail - head >= m_params.sq_entries)
+    {
+        if(submit_and_wait(0) < 0) return NULL;
+        tail = *m_sq_tail;
+    }
+    unsigned index = tail & *m_sq_mask;
+    struct io_uring_sqe* sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[index] = index;
+    m_to_submit++;
+    return sqe;
+}
+
+// 提交所有填好的sqe，并至少等待wait_nr个完成事件
+int io_ring::submit_and_wait(unsigned wait_nr)
+{
+    unsigned submit = m_to_submit;
+    if(submit)
+    {
+        __atomic_store_n(m_sq_tail, *m_sq_tail + submit, __ATOMIC_RELEASE);
+        m_to_submit = 0;
+    }
+    int ret = io_uring_enter(m_fd, submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    if(ret < 0 && errno != EINTR) return -1;
+    return 0;
+}
+
+struct io_uring_cqe* io_ring::peek_cqe()
+{
+    unsigned head = *m_cq_head;
+    if(head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &m_cqes[head & *m_cq_mask];
+}
+
+void io_ring::cqe_seen()
+{
+    __atomic_store_n(m_cq_head, *m_cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool io_ring::probe(int op)
+{
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* p = (struct io_uring_probe*)calloc(1, len);
+    if(!p) return false;
+    bool ok = false;
+    if(io_uring_register(m_fd, IORING_REGISTER_PROBE, p, 256) == 0 && op <= p->last_op)
+    {
+        ok = p->ops[op].flags & IO_URING_OP_SUPPORTED;
+    }
+    free(p);
+    return ok;
+}
+
+/*
+    注册provided buffer ring，并把所有缓冲区交给内核。
+    有些内核上ring注册成功了但recv仍然返回ENOBUFS，所以注册之后用一对socket实际收一次数据验证，
+    验证失败就退回到用IORING_OP_PROVIDE_BUFFERS提供缓冲区的旧方式。
+*/
+bool io_ring::setup_buf_ring()
+{
+    m_bufs = (char*)malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if(!m_bufs) return false;
+
+    m_buf_ring_len = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    void* ring = mmap(0, m_buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring == MAP_FAILED) return false;
+    m_buf_ring = (struct io_uring_buf_ring*)ring;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (__u64)(unsigned long)ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if(io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0)
+    {
+        m_buf_tail = 0;
+        for(int i = 0; i < URING_BUF_COUNT; i++) recycle_buffer(i);
+        if(buf_ring_works()) return true;
+        io_uring_register(m_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    munmap(m_buf_ring, m_buf_ring_len);
+    m_buf_ring = NULL;
+
+    // 旧方式：一次把所有缓冲区提供给内核
+    struct io_uring_sqe* sqe = get_sqe();
+    if(!sqe) return false;
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = URING_BUF_COUNT;
+    sqe->addr = (__u64)(unsigned long)m_bufs;
+    sqe->len = URING_BUF_SIZE;
+    sqe->off = 0;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = 0;
+    if(submit_and_wait(1) < 0) return false;
+    struct io_uring_cqe* cqe = peek_cqe();
+    int res = cqe ? cqe->res : -1;
+    if(cqe) cqe_seen();
+    return res >= 0;
+}
+
+// 用一对本地socket验证provided buffer ring确实可用，验证用掉的缓冲区会被放回ring
+bool io_ring::buf_ring_works()
+{
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return false;
+    bool ok = false;
+    struct io_uring_sqe* sqe = NULL;
+    if(::write(sv[1], "x", 1) == 1 && (sqe = get_sqe()) != NULL)
+    {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sv[0];
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->user_data = 0;
+        if(submit_and_wait(1) == 0)
+        {
+            struct io_uring_cqe* cqe = peek_cqe();
+            if(cqe)
+            {
+                ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER);
+                if(ok) recycle_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                cqe_seen();
+            }
+        }
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return ok;
+}
+
+// 把用完的缓冲区还给内核：ring方式直接放回ring的尾部，旧方式提交一个PROVIDE_BUFFERS请求
+void io_ring::recycle_buffer(int bid)
+{
+    if(!m_buf_ring)
+    {
+        struct io_uring_sqe* sqe = get_sqe();
+        if(!sqe) return;
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = 1;
+        sqe->addr = (__u64)(unsigned long)buffer(bid);
+        sqe->len = URING_BUF_SIZE;
+        sqe->off = bid;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;   // 成功时不产生完成事件
+        sqe->user_data = 0;
+        return;
+    }
+    struct io_uring_buf* buf = &m_buf_ring->bufs[m_buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (__u64)(unsigned long)buffer(bid);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = (unsigned short)bid;
+    m_buf_tail++;
+    __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+// 每个连接在io_uring后端中的状态
+struct uring_conn {
+    int pending;        // 还没有完成的请求数（recv和send），为0之后才能close(fd)
+    bool sending;       // 是否有应答正在发送
+    struct msghdr msg;  // sendmsg使用的消息头，在请求完成之前必须保持有效
+};
+
+static void prep_accept(io_ring& ring, int listenfd)
+{
+    struct io_uring_sqe* sqe = ring.get_sqe();
+    if(!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    // 同时接收多个连接时对端地址缓冲区会被覆盖，所以不取地址
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(OP_ACCEPT, listenfd);
+}
+
+static void prep_recv(io_ring& ring, uring_conn* conns, int fd)
+{
+    struct io_uring_sqe* sqe = ring.get_sqe();
+    if(!sqe) return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = make_user_data(OP_RECV, fd);
+    conns[fd].pending++;
+}
+
+static void prep_send(io_ring& ring, uring_conn* conns, http_conn* conn, int fd)
+{
+    struct io_uring_sqe* sqe = ring.get_sqe();
+    if(!sqe) return;
+    struct msghdr* msg = &conns[fd].msg;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_iov = (struct iovec*)conn->write_iov();
+    msg->msg_iovlen = conn->write_iov_count();
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (__u64)(unsigned long)msg;
+    sqe->len = 1;
+    // MSG_WAITALL让内核在socket缓冲区满时自己等待，直到整个应答发完
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = make_user_data(OP_SEND, fd);
+    conns[fd].pending++;
+    conns[fd].sending = true;
+}
+
+// 读timerfd或signalfd
+static void prep_read(io_ring& ring, int op, int fd, void* buf, int len)
+{
+    struct io_uring_sqe* sqe = ring.get_sqe();
+    if(!sqe) return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (__u64)(unsigned long)buf;
+    sqe->len = len;
+    sqe->off = (__u64)-1;
+    sqe->user_data = make_user_data(op, fd);
+}
+
+// 解析连接上已经收到的数据，得到完整的请求后提交应答
+static void process_conn(reactor* r, io_ring& ring, uring_conn* conns, int fd)
+{
+    http_conn* conn = r->users[fd];
+    http_conn::HTTP_CODE ret = conn->handle_request();
+    if(ret == http_conn::NO_REQUEST) return;
+    if(ret == http_conn::CLOSED_CONNECTION)
+    {
+        close_user(r, conn);
+        return;
+    }
+    prep_send(ring, conns, conn, fd);
+}
+
+bool uring_supported()
+{
+    io_ring ring;
+    if(!ring.init(8)) return false;
+    if(!ring.probe(IORING_OP_ACCEPT) || !ring.probe(IORING_OP_RECV) || !ring.probe(IORING_OP_SENDMSG)) return false;
+    // 内核至少要支持provided buffer，multishot accept/recv在提交时还会再检查
+    return ring.probe(IORING_OP_PROVIDE_BUFFERS) && ring.setup_buf_ring();
+}
+
+void* uring_reactor_loop(void* arg)
+{
+    reactor* r = (reactor*)arg;
+    io_ring ring;
+    if(!ring.init(URING_ENTRIES) || !ring.setup_buf_ring())
+    {
+        LOG_ERROR("reactor %d: io_uring setup failure", r->id);
+        return NULL;
+    }
+
+    // calloc得到的大块内存是按需映射的零页，只有用到的fd对应的页才会真正分配
+    uring_conn* conns = (uring_conn*)calloc(MAX_FD, sizeof(uring_conn));
+
+    uint64_t expirations;
+    struct signalfd_siginfo info;
+    prep_accept(ring, r->listenfd);
+    prep_read(ring, OP_TIMER, r->timerfd, &expirations, sizeof(expirations));
+    if(r->sigfd != -1) prep_read(ring, OP_SIGNAL, r->sigfd, &info, sizeof(info));
+
+    bool timeout = false;
+
+    while(!server_stopped())
+    {
+        if(ring.submit_and_wait(1) < 0)
+        {
+            LOG_ERROR("io_uring failure");
+            break;
+        }
+
+        struct io_uring_cqe* cqe;
+        while((cqe = ring.peek_cqe()) != NULL)
+        {
+            int op = user_data_op(cqe->user_data);
+            int fd = user_data_fd(cqe->user_data);
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring.cqe_seen();
+
+            switch(op)
+            {
+                case OP_ACCEPT:
+                {
+                    r->accept_wakeups.add();
+                    if(res >= 0)
+                    {
+                        if(http_conn::m_user_count >= MAX_FD || res >= MAX_FD)
+                        {
+                            // 目前连接数满了
+                            close(res);
+                        }
+                        else
+                        {
+                            r->accepts.add();
+                            sockaddr_in client_address;
+                            memset(&client_address, 0, sizeof(client_address));
+                            add_conn(r, res, client_address, -1);
+                            conns[res].pending = 0;
+                            conns[res].sending = false;
+                            prep_recv(ring, conns, res);
+                        }
+                    }
+                    else if(res != -EAGAIN && res != -ECONNABORTED && res != -EINTR)
+                    {
+                        LOG_WARN("accept errno is: %d", -res);
+                    }
+                    // multishot accept被内核终止时重新提交
+                    if(!(flags & IORING_CQE_F_MORE)) prep_accept(ring, r->listenfd);
+                    break;
+                }
+                case OP_TIMER:
+                {
+                    // timerfd触发，定时任务放到这一批完成事件处理完之后再执行
+                    if(res > 0) timeout = true;
+                    prep_read(ring, OP_TIMER, r->timerfd, &expirations, sizeof(expirations));
+                    break;
+                }
+                case OP_SIGNAL:
+                {
+                    if(res == (int)sizeof(info)) handle_signal(info);
+                    prep_read(ring, OP_SIGNAL, r->sigfd, &info, sizeof(info));
+                    break;
+                }
+                case OP_RECV:
+                {
+                    http_conn* conn = r->users[fd];
+                    bool more = flags & IORING_CQE_F_MORE;
+                    if(!more) conns[fd].pending--;
+
+                    if(res > 0)
+                    {
+                        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                        if(conn->is_open())
+                        {
+                            if(conn->append_read(ring.buffer(bid), res))
+                            {
+                                adjust_conn_timer(r, conn);
+                                if(!conns[fd].sending) process_conn(r, ring, conns, fd);
+                            }
+                            else close_user(r, conn);   // 读缓冲区满了
+                        }
+                        ring.recycle_buffer(bid);
+                        // 连接还打开着但multishot被终止了（比如缓冲区暂时用完），重新提交
+                        if(!more && conn->is_open()) prep_recv(ring, conns, fd);
+                    }
+                    else if(res == -ENOBUFS && conn->is_open())
+                    {
+                        // provided buffer用完了，重新提交recv
+                        prep_recv(ring, conns, fd);
+                    }
+                    else if(conn->is_open())
+                    {
+                        // 对方关闭连接或者出错
+                        close_user(r, conn);
+                    }
+                    break;
+                }
+                case OP_SEND:
+                {
+                    http_conn* conn = r->users[fd];
+                    conns[fd].pending--;
+                    conns[fd].sending = false;
+                    if(!conn->is_open()) break;
+                    if(res < 0)
+                    {
+                        close_user(r, conn);
+                        break;
+                    }
+                    if(!conn->advance_write(res))
+                    {
+                        // 没有全部发送出去（比如被信号打断），继续发送剩下的数据
+                        prep_send(ring, conns, conn, fd);
+                    }
+                    else if(!conn->finish_write())
+                    {
+                        close_user(r, conn);
+                    }
+                    else if(conn->has_pending_input())
+                    {
+                        // 发送期间收到的（流水线上的）后续请求
+                        process_conn(r, ring, conns, fd);
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+
+            // 连接已经关闭，且所有请求都已经完成，现在可以安全地释放fd了
+            if((op == OP_RECV || op == OP_SEND) && !r->users[fd]->is_open() && conns[fd].pending == 0)
+            {
+                conns[fd].pending = -1;
+                free_conn(r, fd);
+                close(fd);
+            }
+        }
+
+        // 最后处理定时事件，因为I/O事件有更高的优先级。
+        if( timeout ) {
+            timer_handler( r );
+            timeout = false;
+        }
+    }
+
+    free(conns);
+    return NULL;
+}
+
+#else
+
+bool uring_supported()
+{
+    return false;
+}
+
+void* uring_reactor_loop(void* arg)
+{
+    return NULL;
+}
+
+#endif
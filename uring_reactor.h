@@ -0,0 +1,17 @@
+#ifndef URING_REACTOR_H
+#define URING_REACTOR_H
+
+// 编译环境提供了io_uring的内核头文件时才编译io_uring后端，运行时再用 -u 选择
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+// 当前内核是否支持io_uring后端需要的特性（multishot accept/recv、provided buffer ring）
+bool uring_supported();
+
+// io_uring后端的事件循环，参数为reactor*，和epoll后端的reactor_loop可以互换
+void* uring_reactor_loop(void* arg);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <atomic>
+#include <stddef.h>
+#include "mpmc_queue.h"
+
+/*
+    工作窃取用的双端队列（Chase-Lev算法，内存序参考Lê等人2013年的C11版本）。
+    只有拥有者线程在底部（bottom）push和pop，其他线程只能从顶部（top）steal。
+    拥有者的push和pop只有在队列中只剩一个元素时才需要CAS，和窃取者竞争时由CAS决定谁拿到元素。
+    队列的容量是固定的（2的幂），满了push返回false，由调用者决定如何处理。
+    模板参数T必须是可以放进std::atomic的类型，一般是指针。
+*/
+template<typename T>
+class ws_deque {
+public:
+    explicit ws_deque(size_t capacity) : m_buffer(NULL), m_mask(0)
+    {
+        size_t size = 2;
+        while(size < capacity) size <<= 1;
+        m_buffer = new std::atomic<T>[size];
+        m_mask = size - 1;
+        m_top.store(0, std::memory_order_relaxed);
+        m_bottom.store(0, std::memory_order_relaxed);
+    }
+
+    ~ws_deque()
+    {
+        delete [] m_buffer;
+    }
+
+    // 拥有者在底部放入一个元素，队列满时返回false
+    bool push(T data)
+    {
+        long b = m_bottom.load(std::memory_order_relaxed);
+        long t = m_top.load(std::memory_order_acquire);
+        if(b - t > (long)m_mask) return false;
+        m_buffer[b & m_mask].store(data, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // 拥有者从底部取出最后放入的元素，队列空时返回false
+    bool pop(T& data)
+    {
+        long b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long t = m_top.load(std::memory_order_relaxed);
+        if(t > b)
+        {
+            // 队列是空的，恢复bottom
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        data = m_buffer[b & m_mask].load(std::memory_order_relaxed);
+        if(t == b)
+        {
+            // 只剩最后一个元素，和窃取者竞争
+            bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // 其他线程从顶部窃取最早放入的元素，队列空或者竞争失败时返回false
+    bool steal(T& data)
+    {
+        long t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long b = m_bottom.load(std::memory_order_acquire);
+        if(t >= b) return false;
+        data = m_buffer[t & m_mask].load(std::memory_order_relaxed);
+        return m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    bool empty() const
+    {
+        return m_bottom.load(std::memory_order_relaxed) <= m_top.load(std::memory_order_relaxed);
+    }
+
+private:
+    ws_deque(const ws_deque&);
+    ws_deque& operator=(const ws_deque&);
+
+    std::atomic<T>* m_buffer;
+    size_t m_mask;
+    alignas(CACHE_LINE_SIZE) std::atomic<long> m_top;      // 窃取者修改
+    alignas(CACHE_LINE_SIZE) std::atomic<long> m_bottom;   // 只有拥有者修改
+    char m_pad[CACHE_LINE_SIZE - sizeof(std::atomic<long>)];
+};
+
+#endif